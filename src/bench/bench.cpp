@@ -0,0 +1,793 @@
+// Microbenchmarks of the renderer's hot loops. CPU cases never create a GL context; GL cases use
+// a hidden window, or GLFW's null platform with OSMesa (llvmpipe) when there is no display.
+//
+//   gl_pipes_bench [case|all] [--count N] [--repeat R] [--json <path>] [--compare <baseline.json>]
+//                  [--tolerance F] [--software]
+//
+// Cases:
+//   transforms  glm translate/rotate/scale per instance against the batched segment writer
+//   convert     scalar against SIMD narrowing of .jpraw doubles and 32 bit indices
+//   fetch       position + normal fetches through an index buffer, planar against interleaved
+//   pack        jpraw_pack stages on a generated OBJ grid of about --count triangles
+//   world       Ocupied::set and getRandomFree, Pipe::update and World::pipe_update at several
+//               fill ratios of a grid of about --count cells, rounded to a side of 16 to 128
+//   reader      RawobjectReader parsing and decoding of generated .jpraw files
+//   instances   PipeRenderData::addPipe and addPipes into a mapped buffer (GL)
+//
+// --json writes every measurement, "-" for stdout. --compare reads such a file back and fails if
+// any measurement got slower than the baseline by more than --tolerance (default 0.1, 10%).
+// --software skips straight to OSMesa for the GL cases.
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../transforms.hpp"
+#include "../jpraw_convert.hpp"
+#include "../quantise.hpp"
+#include "../tools/mesh_import.hpp"
+#include "../tools/mesh_opt.hpp"
+#include "../world.hpp"
+#include "../pipe_render_data.hpp"
+
+struct BenchConfig {
+	std::string name = "transforms";
+	size_t count = 1'000'000;
+	size_t repeat = 20;
+	std::string json_path;
+	std::string compare_path;
+	double tolerance = 0.1;
+	bool software = false;
+};
+
+/// Every measurement of a run, for --json and --compare. Measurements are keyed by case and name,
+/// so names must stay stable for baselines to keep matching.
+struct BenchResults {
+	struct Result {
+		std::string bench;
+		std::string name;
+		double ms;
+		// Nanoseconds per unit of work, the number to compare across counts
+		double ns_per_unit;
+		std::string unit;
+	};
+
+	std::vector<Result> results;
+	// GL_RENDERER of the GL cases, empty if none ran
+	std::string renderer;
+
+	void add(const std::string& bench, const std::string& name, double ms, double units, const std::string& unit) {
+		results.push_back({ bench, name, ms, ms * 1e6 / units, unit });
+	}
+
+	const Result* find(const std::string& bench, const std::string& name) const {
+		for (const Result& result : results) {
+			if (result.bench == bench && result.name == name)
+				return &result;
+		}
+		return nullptr;
+	}
+
+	void write(std::ostream& out, const BenchConfig& config) const {
+		out << std::setprecision(9);
+		out << "{\n";
+		out << "\t\"count\": " << config.count << ",\n";
+		out << "\t\"repeat\": " << config.repeat << ",\n";
+		out << "\t\"renderer\": \"" << renderer << "\",\n";
+		out << "\t\"results\": [\n";
+		// One result per line, read() depends on it
+		for (size_t i = 0; i < results.size(); ++i) {
+			const Result& r = results[i];
+			out << "\t\t{ \"case\": \"" << r.bench << "\", \"name\": \"" << r.name << "\", \"ms\": " << r.ms
+				<< ", \"ns_per_unit\": " << r.ns_per_unit << ", \"unit\": \"" << r.unit << "\" }" << (i + 1 < results.size() ? "," : "") << "\n";
+		}
+		out << "\t]\n}\n";
+	}
+
+	void write(const std::string& path, const BenchConfig& config) const {
+		if (path == "-") {
+			write(std::cout, config);
+			return;
+		}
+		std::ofstream file(path);
+		if (!file) {
+			throw std::runtime_error("Can't open benchmark output " + path);
+		}
+		write(file, config);
+	}
+
+	/// Reads what write() wrote
+	static BenchResults read(const std::string& path) {
+		std::ifstream file(path);
+		if (!file) {
+			throw std::runtime_error("Can't open baseline " + path);
+		}
+		auto string_field = [](const std::string& line, const std::string& key) {
+			size_t start = line.find("\"" + key + "\": \"");
+			if (start == std::string::npos)
+				throw std::runtime_error("Baseline result without " + key + ": " + line);
+			start += key.size() + 5;
+			return line.substr(start, line.find('"', start) - start);
+		};
+		auto number_field = [](const std::string& line, const std::string& key) {
+			size_t start = line.find("\"" + key + "\": ");
+			if (start == std::string::npos)
+				throw std::runtime_error("Baseline result without " + key + ": " + line);
+			return std::stod(line.substr(start + key.size() + 4));
+		};
+
+		BenchResults baseline;
+		std::string line;
+		while (std::getline(file, line)) {
+			if (line.find("\"case\"") == std::string::npos)
+				continue;
+			baseline.results.push_back({ string_field(line, "case"), string_field(line, "name"), number_field(line, "ms"),
+				number_field(line, "ns_per_unit"), string_field(line, "unit") });
+		}
+		return baseline;
+	}
+
+	/// Prints every measurement against baseline by ns per unit, returns how many got slower by
+	/// more than tolerance
+	size_t compare(const BenchResults& baseline, double tolerance) const {
+		size_t regressions = 0;
+		std::cout << std::fixed << std::setprecision(2) << "compared with baseline, tolerance " << tolerance * 100 << "%\n";
+		for (const Result& result : results) {
+			std::cout << "  " << std::left << std::setw(12) << result.bench << std::setw(28) << result.name << std::right;
+			const Result* base = baseline.find(result.bench, result.name);
+			if (base == nullptr) {
+				std::cout << "new\n";
+				continue;
+			}
+			double ratio = result.ns_per_unit / base->ns_per_unit;
+			std::cout << std::setw(10) << base->ns_per_unit << " -> " << std::setw(10) << result.ns_per_unit << " ns/" << result.unit
+				<< "  " << std::setw(6) << ratio << "x";
+			if (ratio > 1 + tolerance) {
+				std::cout << "  SLOWER";
+				++regressions;
+			}
+			else if (ratio < 1 / (1 + tolerance)) {
+				std::cout << "  faster";
+			}
+			std::cout << "\n";
+		}
+		std::cout << std::defaultfloat << std::flush;
+		return regressions;
+	}
+};
+
+/// Best time of config.repeat runs of body, in milliseconds
+template<typename F>
+double best_ms(const BenchConfig& config, F&& body) {
+	double best = 1e300;
+	for (size_t r = 0; r < config.repeat; ++r) {
+		auto start = std::chrono::steady_clock::now();
+		body();
+		best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	return best;
+}
+
+/// Best time of config.repeat runs of body, each after an untimed setup
+template<typename Setup, typename F>
+double best_ms(const BenchConfig& config, Setup&& setup, F&& body) {
+	double best = 1e300;
+	for (size_t r = 0; r < config.repeat; ++r) {
+		setup();
+		auto start = std::chrono::steady_clock::now();
+		body();
+		best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	return best;
+}
+
+/// Destination like a mapped GL buffer: aligned, written once per frame and never read
+struct AlignedMatrices {
+	glm::mat4* data;
+	size_t count;
+
+	AlignedMatrices(size_t count) : count{ count } {
+		data = static_cast<glm::mat4*>(::operator new(count * sizeof(glm::mat4), std::align_val_t{ 64 }));
+	}
+	~AlignedMatrices() {
+		::operator delete(data, std::align_val_t{ 64 });
+	}
+};
+
+void bench_transforms(const BenchConfig& config, BenchResults& results) {
+	std::default_random_engine rng{ 1 };
+	std::uniform_int_distribution<int> cell{ 0, 255 };
+	std::uniform_int_distribution<int> dir{ 0, 5 };
+	std::vector<SegmentInstance> segments(config.count);
+	for (SegmentInstance& segment : segments) {
+		segment = { glm::vec3(cell(rng), cell(rng), cell(rng)), (Direction)dir(rng) };
+	}
+
+	AlignedMatrices reference{ config.count };
+	AlignedMatrices batched{ config.count };
+
+	double glm_ms = best_ms(config, [&] {
+		for (size_t i = 0; i < segments.size(); ++i) {
+			reference.data[i] = segment_transform_glm(segments[i].cell, segments[i].dir);
+		}
+	});
+	double batched_ms = best_ms(config, [&] {
+		write_segment_transforms(segments, batched.data);
+	});
+
+	if (std::memcmp(reference.data, batched.data, config.count * sizeof(glm::mat4)) != 0) {
+		throw std::runtime_error("Batched transforms differ from the glm path");
+	}
+
+	double ns = 1e6 / (double)config.count;
+	std::cout << "transforms: " << config.count << " instances, best of " << config.repeat << "\n";
+	std::cout << "  glm per instance: " << glm_ms << " ms (" << glm_ms * ns << " ns/instance)\n";
+	std::cout << "  batched" <<
+#ifdef GL_PIPES_SSE
+		" sse nt"
+#else
+		" scalar"
+#endif
+		<< ":  " << batched_ms << " ms (" << batched_ms * ns << " ns/instance)\n";
+	std::cout << "  speedup: " << glm_ms / batched_ms << "x" << std::endl;
+	results.add("transforms", "glm", glm_ms, (double)config.count, "instance");
+	results.add("transforms", "batched", batched_ms, (double)config.count, "instance");
+}
+
+void bench_convert(const BenchConfig& config, BenchResults& results) {
+	std::default_random_engine rng{ 1 };
+	std::uniform_real_distribution<double> coordinate{ -1, 1 };
+	std::uniform_int_distribution<uint32_t> vertex{ 0, 65535 };
+	std::vector<double> doubles(config.count);
+	std::vector<uint32_t> indices(config.count);
+	for (size_t i = 0; i < config.count; ++i) {
+		doubles[i] = coordinate(rng);
+		indices[i] = vertex(rng);
+	}
+
+	std::vector<float> floats_scalar(config.count), floats_simd(config.count);
+	std::vector<uint16_t> shorts_scalar(config.count), shorts_simd(config.count);
+
+	double doubles_scalar_ms = best_ms(config, [&] {
+		for (size_t i = 0; i < config.count; ++i) {
+			floats_scalar[i] = (float)doubles[i];
+		}
+	});
+	double doubles_simd_ms = best_ms(config, [&] {
+		narrow_doubles(doubles.data(), config.count, floats_simd.data());
+	});
+	double indices_scalar_ms = best_ms(config, [&] {
+		for (size_t i = 0; i < config.count; ++i) {
+			shorts_scalar[i] = (uint16_t)indices[i];
+		}
+	});
+	double indices_simd_ms = best_ms(config, [&] {
+		repack_indices((const std::byte*)indices.data(), 4, config.count, (std::byte*)shorts_simd.data(), 2);
+	});
+
+	if (floats_scalar != floats_simd || shorts_scalar != shorts_simd) {
+		throw std::runtime_error("SIMD conversion differs from the scalar path");
+	}
+
+	double ns = 1e6 / (double)config.count;
+	std::cout << "convert: " << config.count << " elements, best of " << config.repeat << "\n";
+	std::cout << "  double -> float scalar: " << doubles_scalar_ms << " ms (" << doubles_scalar_ms * ns << " ns/element)\n";
+	std::cout << "  double -> float simd:   " << doubles_simd_ms << " ms (" << doubles_simd_ms * ns << " ns/element)\n";
+	std::cout << "  u32 -> u16 scalar:      " << indices_scalar_ms << " ms (" << indices_scalar_ms * ns << " ns/element)\n";
+	std::cout << "  u32 -> u16 simd:        " << indices_simd_ms << " ms (" << indices_simd_ms * ns << " ns/element)" << std::endl;
+	results.add("convert", "double scalar", doubles_scalar_ms, (double)config.count, "element");
+	results.add("convert", "double simd", doubles_simd_ms, (double)config.count, "element");
+	results.add("convert", "index scalar", indices_scalar_ms, (double)config.count, "element");
+	results.add("convert", "index simd", indices_simd_ms, (double)config.count, "element");
+}
+
+/// Sums every fetched attribute so the loads can't be dropped
+template<typename Fetch>
+double fetch_all(const std::vector<uint32_t>& indices, Fetch&& fetch) {
+	double sum = 0;
+	for (uint32_t index : indices) {
+		sum += fetch(index);
+	}
+	return sum;
+}
+
+/// Vertex fetch as the input assembler does it, in index order, once per attribute stream. Vertex
+/// arrays are much larger than the caches and indices jump around, so the planar layout pays a
+/// cache line per attribute and vertex where the interleaved one pays one per vertex.
+void bench_fetch(const BenchConfig& config, BenchResults& results) {
+	std::default_random_engine rng{ 1 };
+	std::uniform_real_distribution<float> coordinate{ -1, 1 };
+	std::uniform_int_distribution<uint32_t> vertex{ 0, (uint32_t)config.count - 1 };
+
+	std::vector<glm::vec3> positions(config.count), normals(config.count);
+	for (size_t v = 0; v < config.count; ++v) {
+		positions[v] = glm::vec3(coordinate(rng), coordinate(rng), coordinate(rng));
+		normals[v] = glm::normalize(glm::vec3(coordinate(rng), coordinate(rng), coordinate(rng)) + glm::vec3(0, 0, 0.001f));
+	}
+	std::vector<uint32_t> indices(config.count * 3);
+	for (uint32_t& index : indices) {
+		index = vertex(rng);
+	}
+
+	struct FloatVertex {
+		glm::vec3 position;
+		glm::vec3 normal;
+	};
+	// Quantised record padded to 4 bytes, as RawobjectWriter interleaves it
+	struct QuantisedVertex {
+		QuantisedPosition position;
+		OctahedralNormal normal;
+		uint16_t padding;
+	};
+	Quantisation q = bounds_quantisation(positions);
+	std::vector<FloatVertex> float_records(config.count);
+	std::vector<QuantisedPosition> quantised_positions(config.count);
+	std::vector<OctahedralNormal> quantised_normals(config.count);
+	std::vector<QuantisedVertex> quantised_records(config.count);
+	for (size_t v = 0; v < config.count; ++v) {
+		float_records[v] = { positions[v], normals[v] };
+		quantised_positions[v] = quantise_position(positions[v], q);
+		quantised_normals[v] = encode_octahedral(normals[v]);
+		quantised_records[v] = { quantised_positions[v], quantised_normals[v], 0 };
+	}
+
+	double sums[4];
+	double float_planar_ms = best_ms(config, [&] {
+		sums[0] = fetch_all(indices, [&](uint32_t i) {
+			return positions[i].x + positions[i].y + positions[i].z + normals[i].x + normals[i].y + normals[i].z;
+		});
+	});
+	double float_interleaved_ms = best_ms(config, [&] {
+		sums[1] = fetch_all(indices, [&](uint32_t i) {
+			const FloatVertex& v = float_records[i];
+			return v.position.x + v.position.y + v.position.z + v.normal.x + v.normal.y + v.normal.z;
+		});
+	});
+	double quantised_planar_ms = best_ms(config, [&] {
+		sums[2] = fetch_all(indices, [&](uint32_t i) {
+			const QuantisedPosition& p = quantised_positions[i];
+			const OctahedralNormal& n = quantised_normals[i];
+			return (double)(p.x + p.y + p.z + n.x + n.y);
+		});
+	});
+	double quantised_interleaved_ms = best_ms(config, [&] {
+		sums[3] = fetch_all(indices, [&](uint32_t i) {
+			const QuantisedVertex& v = quantised_records[i];
+			return (double)(v.position.x + v.position.y + v.position.z + v.normal.x + v.normal.y);
+		});
+	});
+
+	if (sums[0] != sums[1] || sums[2] != sums[3]) {
+		throw std::runtime_error("Layouts fetched different vertices");
+	}
+
+	double ns = 1e6 / (double)indices.size();
+	std::cout << "fetch: " << config.count << " vertices, " << indices.size() << " indices, best of " << config.repeat << "\n";
+	std::cout << "  float planar (12 + 12 B):        " << float_planar_ms << " ms (" << float_planar_ms * ns << " ns/index)\n";
+	std::cout << "  float interleaved (24 B):        " << float_interleaved_ms << " ms (" << float_interleaved_ms * ns << " ns/index)\n";
+	std::cout << "  quantised planar (6 + 4 B):      " << quantised_planar_ms << " ms (" << quantised_planar_ms * ns << " ns/index)\n";
+	std::cout << "  quantised interleaved (12 B):    " << quantised_interleaved_ms << " ms (" << quantised_interleaved_ms * ns << " ns/index)" << std::endl;
+	results.add("fetch", "float planar", float_planar_ms, (double)indices.size(), "index");
+	results.add("fetch", "float interleaved", float_interleaved_ms, (double)indices.size(), "index");
+	results.add("fetch", "quantised planar", quantised_planar_ms, (double)indices.size(), "index");
+	results.add("fetch", "quantised interleaved", quantised_interleaved_ms, (double)indices.size(), "index");
+}
+
+/// Throughput of each jpraw_pack stage on a large mesh: parsing OBJ text, the vertex cache
+/// order, meshlets and encoding. Files are kept in memory so disk speed doesn't count.
+void bench_pack(const BenchConfig& config, BenchResults& results) {
+	// side x side quads with positions, normals and uvs
+	size_t side = std::max<size_t>(2, (size_t)std::sqrt((double)config.count / 2));
+	std::ostringstream obj;
+	for (size_t y = 0; y <= side; ++y) {
+		for (size_t x = 0; x <= side; ++x) {
+			float u = (float)x / side, v = (float)y / side;
+			obj << "v " << u << " " << std::sin(u * 6.28f) * 0.1f << " " << v << "\nvt " << u << " " << v << "\nvn 0 1 0\n";
+		}
+	}
+	for (size_t y = 0; y < side; ++y) {
+		for (size_t x = 0; x < side; ++x) {
+			size_t a = y * (side + 1) + x + 1, b = a + side + 1;
+			obj << "f " << a << "/" << a << "/" << a << " " << b << "/" << b << "/" << b << " " << b + 1 << "/" << b + 1 << "/" << b + 1
+				<< " " << a + 1 << "/" << a + 1 << "/" << a + 1 << "\n";
+		}
+	}
+	std::string text = obj.str();
+
+	std::vector<MeshObject> objects;
+	double parse_ms = best_ms(config, [&] {
+		std::istringstream in{ text };
+		objects = read_obj(in);
+	});
+	MeshObject& object = objects.at(0);
+	std::vector<uint32_t> optimized;
+	double cache_ms = best_ms(config, [&] {
+		optimized = optimize_vertex_cache(object.indices, object.positions.size());
+	});
+	object.indices = optimized;
+	double meshlets_ms = best_ms(config, [&] {
+		object.meshlets = build_meshlets(object.indices, object.positions);
+	});
+	std::vector<std::byte> bytes;
+	double encode_ms = best_ms(config, [&] {
+		bytes = RawobjectWriter{ objects, RawobjectFormat{ true, true } }.encode();
+	});
+
+	size_t triangles = object.indices.size() / 3;
+	double ns = 1e6 / (double)triangles;
+	std::cout << "pack: " << triangles << " triangles, " << object.positions.size() << " vertices, " << text.size() / 1e6 << " MB of OBJ, best of " << config.repeat << "\n";
+	std::cout << "  parse obj:        " << parse_ms << " ms (" << parse_ms * ns << " ns/triangle, " << text.size() / 1e3 / parse_ms << " MB/s)\n";
+	std::cout << "  vertex cache:     " << cache_ms << " ms (" << cache_ms * ns << " ns/triangle)\n";
+	std::cout << "  meshlets:         " << meshlets_ms << " ms (" << meshlets_ms * ns << " ns/triangle, " << object.meshlets.records.size() << " meshlets)\n";
+	std::cout << "  encode quantised: " << encode_ms << " ms (" << encode_ms * ns << " ns/triangle, " << bytes.size() << " bytes)" << std::endl;
+	results.add("pack", "parse obj", parse_ms, (double)triangles, "triangle");
+	results.add("pack", "vertex cache", cache_ms, (double)triangles, "triangle");
+	results.add("pack", "meshlets", meshlets_ms, (double)triangles, "triangle");
+	results.add("pack", "encode quantised", encode_ms, (double)triangles, "triangle");
+}
+
+/// Occupancy grid side for about config.count cells
+size_t grid_side(const BenchConfig& config) {
+	return std::max<size_t>(8, (size_t)std::cbrt((double)config.count));
+}
+
+/// Marks fill of the cells of occupied, in random order
+template<typename Bounds>
+void fill_randomly(Ocupied<Bounds>& occupied, double fill, std::default_random_engine& rng) {
+	std::vector<size_t> cells(occupied.ocupied_nodes.size());
+	std::iota(cells.begin(), cells.end(), 0);
+	std::shuffle(cells.begin(), cells.end(), rng);
+	cells.resize((size_t)(fill * (double)cells.size()));
+	for (size_t cell : cells) {
+		occupied.set(cell);
+	}
+}
+
+/// The simulation's per tick work. Fill ratios matter because growing pipes test their
+/// neighbours and die sooner in a crowded grid, and getRandomFree has fewer free cells to find.
+/// Dead pipes are respawned within the timed loop, so the update costs include getRandomFree at
+/// the rate pipes die.
+template<typename Bounds>
+void bench_world(const BenchConfig& config, BenchResults& results) {
+	int side = (int)Bounds::x;
+	size_t cells = Bounds::cells;
+	std::cout << "world: " << side << "^3 grid, best of " << config.repeat << "\n";
+
+	std::default_random_engine rng{ 1 };
+	std::vector<size_t> order(cells);
+	std::iota(order.begin(), order.end(), 0);
+	std::shuffle(order.begin(), order.end(), rng);
+	Ocupied<Bounds> occupied;
+	double set_ms = best_ms(config, [&] { occupied.clear(); }, [&] {
+		for (size_t cell : order) {
+			occupied.set(cell);
+		}
+	});
+	std::cout << "  Ocupied::set:                 " << set_ms << " ms (" << set_ms * 1e6 / (double)cells << " ns/cell)\n";
+	results.add("world", "set", set_ms, (double)cells, "cell");
+
+	// Updates per measurement, small against the grid so the fill ratio barely moves
+	size_t updates = std::max<size_t>(1, cells / 100);
+	for (double fill : { 0.1, 0.5, 0.9 }) {
+		std::string ratio = std::to_string((int)(fill * 100)) + "%";
+
+		size_t finds = std::max<size_t>(1, updates / 10);
+		double free_ms = best_ms(config, [&] {
+			occupied.clear();
+			fill_randomly(occupied, fill, rng);
+		}, [&] {
+			for (size_t i = 0; i < finds; ++i) {
+				occupied.getRandomFree(rng);
+			}
+		});
+
+		// Every cell handed out has to have been free when it was picked
+		occupied.clear();
+		fill_randomly(occupied, fill, rng);
+		auto expected = occupied;
+		for (size_t i = 0; i < finds; ++i) {
+			auto cell = occupied.getRandomFree(rng);
+			if (!cell || expected[*cell])
+				throw std::runtime_error("getRandomFree returned an occupied cell");
+			expected.set(*cell);
+		}
+
+		std::optional<Pipe<Bounds>> pipe;
+		double pipe_ms = best_ms(config, [&] {
+			occupied.clear();
+			fill_randomly(occupied, fill, rng);
+			pipe.emplace(occupied, rng);
+		}, [&] {
+			for (size_t i = 0; i < updates; ++i) {
+				pipe->update(occupied, rng);
+				if (!pipe->alive)
+					pipe->reset(occupied, rng);
+			}
+		});
+
+		std::optional<World<Bounds>> world;
+		PipeUpdateData<Bounds> data;
+		double world_ms = best_ms(config, [&] {
+			world.emplace(1);
+			fill_randomly(world->ocupied_nodes, fill, rng);
+			for (size_t p = 0; p < world->max_pipes; ++p) {
+				world->new_pipe(data);
+			}
+		}, [&] {
+			for (size_t i = 0; i < updates; ++i) {
+				size_t id = i % world->pipe_count();
+				if (!world->is_pipe_alive(id))
+					world->respawn_pipe(data, id);
+				world->pipe_update(data, id);
+			}
+		});
+
+		std::cout << "  fill " << std::setw(3) << ratio << " getRandomFree:       " << free_ms << " ms (" << free_ms * 1e6 / (double)finds << " ns/call)\n";
+		std::cout << "  fill " << std::setw(3) << ratio << " Pipe::update:        " << pipe_ms << " ms (" << pipe_ms * 1e6 / (double)updates << " ns/update)\n";
+		std::cout << "  fill " << std::setw(3) << ratio << " World::pipe_update:  " << world_ms << " ms (" << world_ms * 1e6 / (double)updates << " ns/update)\n";
+		results.add("world", "getRandomFree " + ratio, free_ms, (double)finds, "call");
+		results.add("world", "Pipe::update " + ratio, pipe_ms, (double)updates, "update");
+		results.add("world", "World::pipe_update " + ratio, world_ms, (double)updates, "update");
+	}
+	std::cout << std::flush;
+}
+
+/// Grid bounds are compile time, so --count picks the nearest of a few instantiations
+void bench_world(const BenchConfig& config, BenchResults& results) {
+	size_t side = grid_side(config);
+	if (side <= 16)
+		bench_world<GridBounds<16, 16, 16, 8>>(config, results);
+	else if (side <= 32)
+		bench_world<GridBounds<32, 32, 32, 8>>(config, results);
+	else if (side <= 64)
+		bench_world<GridBounds<64, 64, 64, 8>>(config, results);
+	else
+		bench_world<GridBounds<128, 128, 128, 8>>(config, results);
+}
+
+/// side x side quad grid with normals and uvs
+MeshObject grid_object(size_t side) {
+	MeshObject object;
+	for (size_t y = 0; y <= side; ++y) {
+		for (size_t x = 0; x <= side; ++x) {
+			float u = (float)x / side, v = (float)y / side;
+			object.positions.emplace_back(u, std::sin(u * 6.28f) * 0.1f, v);
+			object.normals.emplace_back(0, 1, 0);
+			object.uvs.emplace_back(u, v);
+		}
+	}
+	for (uint32_t y = 0; y < side; ++y) {
+		for (uint32_t x = 0; x < side; ++x) {
+			uint32_t a = y * (uint32_t)(side + 1) + x, b = a + (uint32_t)side + 1;
+			object.indices.insert(object.indices.end(), { a, b, b + 1, a, b + 1, a + 1 });
+		}
+	}
+	return object;
+}
+
+/// Opening a file (mapping, header and section offsets) and decoding every sub object, for the
+/// formats jpraw_pack writes. The file stays in the page cache, so disk speed doesn't count.
+void bench_reader(const BenchConfig& config, BenchResults& results) {
+	// Sub objects like tubes.jpraw's, small and many
+	constexpr size_t OBJECTS = 64;
+	size_t side = std::max<size_t>(2, (size_t)std::sqrt((double)config.count / 2 / OBJECTS));
+	std::vector<MeshObject> objects(OBJECTS, grid_object(side));
+	size_t triangles = OBJECTS * side * side * 2;
+	std::cout << "reader: " << OBJECTS << " sub objects, " << triangles << " triangles, best of " << config.repeat << "\n";
+
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "gl_pipes_bench.jpraw";
+	struct Format {
+		const char* name;
+		RawobjectFormat format;
+	};
+	for (const Format& format : { Format{ "float", { false, false } }, Format{ "quantised interleaved", { true, true } } }) {
+		write_file(path.string(), RawobjectWriter{ objects, format.format }.encode());
+		size_t sub_objects = 0;
+		double open_ms = best_ms(config, [&] {
+			RawobjectReader reader{ path.string().c_str() };
+			sub_objects += reader.sub_offsets.size();
+		});
+		size_t decoded = 0;
+		double decode_ms = best_ms(config, [&] {
+			RawobjectReader reader{ path.string().c_str() };
+			decoded += read_objects(reader).size();
+		});
+		if (sub_objects != OBJECTS * config.repeat || decoded != OBJECTS * config.repeat) {
+			throw std::runtime_error("Reader lost sub objects");
+		}
+		std::cout << "  " << std::left << std::setw(22) << format.name << std::right << " open:   " << open_ms << " ms\n";
+		std::cout << "  " << std::left << std::setw(22) << format.name << std::right << " decode: " << decode_ms << " ms (" << decode_ms * 1e6 / (double)triangles << " ns/triangle)\n";
+		results.add("reader", std::string("open ") + format.name, open_ms, OBJECTS, "sub object");
+		results.add("reader", std::string("decode ") + format.name, decode_ms, (double)triangles, "triangle");
+	}
+	std::filesystem::remove(path);
+	std::cout << std::flush;
+}
+
+/// Hidden window with a GL 4.6 context for the GL cases. Tries the default platform first and
+/// falls back to GLFW's null platform with OSMesa, which runs on llvmpipe without a display or GPU.
+struct BenchContext {
+	GLFWwindow* window = nullptr;
+	std::string renderer;
+
+	BenchContext(bool software) {
+		if (software || !create(false)) {
+			if (!create(true)) {
+				throw std::runtime_error("No GL 4.6 context, not even through OSMesa");
+			}
+		}
+		renderer = (const char*)glGetString(GL_RENDERER);
+	}
+
+	BenchContext(const BenchContext&) = delete;
+	BenchContext& operator=(const BenchContext&) = delete;
+
+	~BenchContext() {
+		destroy();
+	}
+
+private:
+	bool create(bool software) {
+		destroy();
+#ifdef GLFW_PLATFORM_NULL
+		glfwInitHint(GLFW_PLATFORM, software ? GLFW_PLATFORM_NULL : GLFW_ANY_PLATFORM);
+#endif
+		if (!glfwInit())
+			return false;
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API, software ? GLFW_OSMESA_CONTEXT_API : GLFW_NATIVE_CONTEXT_API);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+		glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+		window = glfwCreateWindow(64, 64, "gl_pipes_bench", nullptr, nullptr);
+		if (window == nullptr)
+			return false;
+		glfwMakeContextCurrent(window);
+		glewExperimental = true;
+		return glewInit() == GLEW_OK;
+	}
+
+	void destroy() {
+		if (window) {
+			glfwDestroyWindow(window);
+			window = nullptr;
+		}
+		glfwTerminate();
+	}
+};
+
+/// Instance matrices written into a persistently mapped buffer, one at a time as the world ticks
+/// and batched. Both start from a small buffer, so growing is part of the cost.
+void bench_instances(const BenchConfig& config, BenchResults& results, BenchContext& context) {
+	size_t count = std::min<size_t>(config.count, 1 << 20);
+	std::default_random_engine rng{ 1 };
+	std::uniform_int_distribution<int> cell{ 0, 255 };
+	std::uniform_int_distribution<int> dir{ 0, 5 };
+	std::vector<SegmentInstance> segments(count);
+	for (SegmentInstance& segment : segments) {
+		segment = { glm::vec3(cell(rng), cell(rng), cell(rng)), (Direction)dir(rng) };
+	}
+
+	using Bounds = GridBounds<256, 256, 256, 8>;
+	std::optional<PipeRenderData<Bounds>> prd;
+	double single_ms = best_ms(config, [&] {
+		prd.reset();
+		prd.emplace(128);
+	}, [&] {
+		for (const SegmentInstance& segment : segments) {
+			prd->addPipe(Bounds::Coord{ glm::uvec3(segment.cell) }, segment.dir);
+		}
+		glFinish();
+	});
+	double batched_ms = best_ms(config, [&] {
+		prd.reset();
+		prd.emplace(128);
+	}, [&] {
+		prd->addPipes(segments);
+		glFinish();
+	});
+	prd.reset();
+
+	double ns = 1e6 / (double)count;
+	std::cout << "instances: " << count << " segments on " << context.renderer << ", best of " << config.repeat << "\n";
+	std::cout << "  addPipe:  " << single_ms << " ms (" << single_ms * ns << " ns/instance)\n";
+	std::cout << "  addPipes: " << batched_ms << " ms (" << batched_ms * ns << " ns/instance)" << std::endl;
+	results.add("instances", "addPipe", single_ms, (double)count, "instance");
+	results.add("instances", "addPipes", batched_ms, (double)count, "instance");
+	results.renderer = context.renderer;
+}
+
+BenchConfig parse_args(int argc, char* argv[]) {
+	BenchConfig config;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto value = [&]() -> std::string {
+			if (i + 1 >= argc)
+				throw std::invalid_argument("Missing value for " + arg);
+			return argv[++i];
+		};
+
+		if (arg == "--count")
+			config.count = std::stoull(value());
+		else if (arg == "--repeat")
+			config.repeat = std::max<size_t>(1, std::stoull(value()));
+		else if (arg == "--json")
+			config.json_path = value();
+		else if (arg == "--compare")
+			config.compare_path = value();
+		else if (arg == "--tolerance")
+			config.tolerance = std::stod(value());
+		else if (arg == "--software")
+			config.software = true;
+		else if (arg.rfind("--", 0) != 0)
+			config.name = arg;
+		else
+			throw std::invalid_argument("Unknown argument " + arg);
+	}
+	return config;
+}
+
+int main(int argc, char* argv[]) {
+	try {
+		BenchConfig config = parse_args(argc, argv);
+		BenchResults results;
+		using Case = void (*)(const BenchConfig&, BenchResults&);
+		const std::pair<const char*, Case> cpu_cases[] = {
+			{ "transforms", bench_transforms }, { "convert", bench_convert }, { "fetch", bench_fetch },
+			{ "pack", bench_pack }, { "world", bench_world }, { "reader", bench_reader },
+		};
+		bool all = config.name == "all";
+		bool found = false;
+		for (const auto& [name, run] : cpu_cases) {
+			if (all || config.name == name) {
+				run(config, results);
+				found = true;
+			}
+		}
+		if (all || config.name == "instances") {
+			try {
+				BenchContext context{ config.software };
+				bench_instances(config, results, context);
+			}
+			catch (std::runtime_error& e) {
+				// A machine without any GL still runs the CPU cases of all
+				if (!all)
+					throw;
+				std::cout << "instances: skipped, " << e.what() << std::endl;
+			}
+			found = true;
+		}
+		if (!found) {
+			throw std::invalid_argument("Unknown benchmark " + config.name);
+		}
+
+		if (!config.json_path.empty()) {
+			results.write(config.json_path, config);
+		}
+		if (!config.compare_path.empty()) {
+			size_t regressions = results.compare(BenchResults::read(config.compare_path), config.tolerance);
+			if (regressions) {
+				std::cerr << regressions << " measurements got slower than the baseline" << std::endl;
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
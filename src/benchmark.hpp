@@ -0,0 +1,243 @@
+#pragma once
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "gl_objects.hpp"
+
+/// Deterministic camera path for benchmarks: a slow orbit around the grid that also bobs up and
+/// down, so both wide shots and close ups of the volume are covered.
+struct ScriptedCameraPath {
+	glm::vec3 center;
+	float radius;
+	// Radians per frame
+	float step = 0.01f;
+
+	ScriptedCameraPath(glm::vec3 bounds) : center{ bounds * 0.5f }, radius{ glm::length(bounds) } {}
+
+	glm::vec3 eye(size_t frame) const {
+		float t = (float)frame * step;
+		float r = radius * (0.6f + 0.4f * std::cos(t * 0.37f));
+		return center + glm::vec3{ r * std::sin(t), center.y * std::sin(t * 0.5f), r * std::cos(t) };
+	}
+
+	/// Always the middle of the grid
+	glm::vec3 target() const {
+		return center;
+	}
+};
+
+/// Color and depth target for rendering without a default framebuffer
+struct OffscreenTarget {
+	GLuint renderbuffers[2]{ 0, 0 };
+	GLFramebuffers<1> framebuffers;
+	int width;
+	int height;
+
+	OffscreenTarget(int width, int height) : width{ width }, height{ height } {
+		glCreateRenderbuffers(2, renderbuffers);
+		glNamedRenderbufferStorage(renderbuffers[0], GL_RGBA8, width, height);
+		// Same format as the default framebuffer so the hi-z resolve can read it
+		glNamedRenderbufferStorage(renderbuffers[1], GL_DEPTH24_STENCIL8, width, height);
+		glNamedFramebufferRenderbuffer(framebuffer(), GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+		glNamedFramebufferRenderbuffer(framebuffer(), GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+
+		if (glCheckNamedFramebufferStatus(framebuffer(), GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			throw std::runtime_error("Offscreen framebuffer is incomplete");
+		}
+	}
+
+	~OffscreenTarget() {
+		glDeleteRenderbuffers(2, renderbuffers);
+	}
+
+	GLuint framebuffer() const {
+		return framebuffers.framebuffers[0];
+	}
+};
+
+/// Per frame CPU and GPU times. GPU times come from a ring of GL_TIMESTAMP query pairs that is
+/// read back RING frames late, so timing never stalls the frame it measures. Timestamps rather
+/// than GL_TIME_ELAPSED leave the elapsed time target free for profiler zones inside the frame.
+struct FrameTimer {
+	static constexpr size_t RING = 4;
+
+	// Start and end timestamp of each frame in the ring
+	GLQueries<RING * 2> queries{ GL_TIMESTAMP };
+	size_t frame = 0;
+	std::chrono::steady_clock::time_point cpu_start;
+	// Keep every sample in cpu_ms and gpu_ms, off when only the latest is wanted
+	bool record = true;
+	// GPU time of the newest frame read back, and whether end() read one back
+	double latest_gpu_ms = 0;
+	bool collected = false;
+
+	std::vector<double> cpu_ms;
+	std::vector<double> gpu_ms;
+
+	void begin() {
+		cpu_start = std::chrono::steady_clock::now();
+		glQueryCounter(queries.queries[(frame % RING) * 2], GL_TIMESTAMP);
+	}
+
+	void end() {
+		glQueryCounter(queries.queries[(frame % RING) * 2 + 1], GL_TIMESTAMP);
+		if (record) {
+			cpu_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - cpu_start).count());
+		}
+		++frame;
+
+		collected = frame >= RING;
+		if (collected) {
+			collect(frame % RING);
+		}
+	}
+
+	/// Blocks on the queries still in flight
+	void finish() {
+		for (size_t i = frame >= RING ? frame - RING + 1 : 0; i < frame; ++i) {
+			collect(i % RING);
+		}
+	}
+
+	void collect(size_t slot) {
+		GLuint64 start = 0;
+		GLuint64 end = 0;
+		glGetQueryObjectui64v(queries.queries[slot * 2], GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(queries.queries[slot * 2 + 1], GL_QUERY_RESULT, &end);
+		latest_gpu_ms = (double)(end - start) / 1e6;
+		if (record) {
+			gpu_ms.push_back(latest_gpu_ms);
+		}
+	}
+};
+
+/// Time from an input event to the GPU finishing the frame that applied it, from a GL_TIMESTAMP
+/// query issued after the swap. The GPU clock is mapped onto glfwGetTime() by sampling both when
+/// the query is issued. Scan out comes later still, so this is a lower bound on what is seen.
+/// Results are read once available; a query still in flight a whole ring later is dropped rather
+/// than waited on, so measuring never stalls the render thread.
+struct InputLatency {
+	static constexpr size_t RING = 4;
+
+	GLQueries<RING> queries{ GL_TIMESTAMP };
+	// glfwGetTime() of the frame's oldest input event
+	double event_time[RING]{};
+	// glfwGetTime() minus GPU time in seconds, when the query was issued
+	double clock_offset[RING]{};
+	// Issued and not read back yet
+	bool pending[RING]{};
+	size_t frame = 0;
+	// Samples lost to queries that took longer than RING frames
+	size_t dropped = 0;
+
+	std::vector<double> latency_ms;
+
+	/// Call right after the swap of a frame that applied input from oldest_event_time onwards,
+	/// negative if it applied none
+	void presented(double oldest_event_time) {
+		collect();
+		size_t slot = frame % RING;
+		if (pending[slot]) {
+			pending[slot] = false;
+			++dropped;
+		}
+		if (oldest_event_time >= 0) {
+			event_time[slot] = oldest_event_time;
+			glQueryCounter(queries.queries[slot], GL_TIMESTAMP);
+			GLint64 gpu_now = 0;
+			glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+			clock_offset[slot] = glfwGetTime() - (double)gpu_now / 1e9;
+			pending[slot] = true;
+		}
+		++frame;
+	}
+
+	/// Reads the finished queries, oldest first, up to the first one still in flight
+	void collect() {
+		for (size_t i = frame >= RING ? frame - RING : 0; i < frame; ++i) {
+			size_t slot = i % RING;
+			if (!pending[slot])
+				continue;
+			GLint available = GL_FALSE;
+			glGetQueryObjectiv(queries.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				return;
+			GLuint64 done = 0;
+			glGetQueryObjectui64v(queries.queries[slot], GL_QUERY_RESULT, &done);
+			latency_ms.push_back(((double)done / 1e9 + clock_offset[slot] - event_time[slot]) * 1e3);
+			pending[slot] = false;
+		}
+	}
+};
+
+inline double percentile(std::vector<double> samples, double p) {
+	if (samples.empty())
+		return 0;
+	std::sort(samples.begin(), samples.end());
+	size_t rank = (size_t)std::ceil(p / 100.0 * (double)samples.size());
+	return samples[std::clamp<size_t>(rank, 1, samples.size()) - 1];
+}
+
+inline void write_percentiles(std::ostream& out, const char* name, const std::vector<double>& samples) {
+	out << "\t\"" << name << "\": { \"p50\": " << percentile(samples, 50) << ", \"p95\": " << percentile(samples, 95)
+		<< ", \"p99\": " << percentile(samples, 99) << " }";
+}
+
+struct BenchmarkReport {
+	size_t frames;
+	unsigned seed;
+	int width;
+	int height;
+	// Process start to the end of the first frame
+	double startup_ms;
+	// Render scale of every frame
+	std::vector<double> scales;
+	// Vertex shader invocations and triangles submitted per frame, from pipeline statistics
+	std::vector<double> vs_invocations;
+	std::vector<double> triangles;
+
+	void write(std::ostream& out, const FrameTimer& timer) const {
+		out << "{\n";
+		out << "\t\"frames\": " << frames << ",\n";
+		out << "\t\"seed\": " << seed << ",\n";
+		out << "\t\"width\": " << width << ",\n";
+		out << "\t\"height\": " << height << ",\n";
+		out << "\t\"startup_ms\": " << startup_ms << ",\n";
+		write_percentiles(out, "cpu_ms", timer.cpu_ms);
+		out << ",\n";
+		write_percentiles(out, "gpu_ms", timer.gpu_ms);
+		out << ",\n";
+		write_percentiles(out, "scale", scales);
+		out << ",\n";
+		write_percentiles(out, "vs_invocations", vs_invocations);
+		out << ",\n";
+		write_percentiles(out, "triangles", triangles);
+		out << ",\n";
+		// Transformed vertices per triangle as the GPU saw it, the measured ACMR
+		double total_vs = std::accumulate(vs_invocations.begin(), vs_invocations.end(), 0.0);
+		double total_triangles = std::accumulate(triangles.begin(), triangles.end(), 0.0);
+		out << "\t\"vs_per_triangle\": " << (total_triangles > 0 ? total_vs / total_triangles : 0) << "\n}\n";
+	}
+
+	void write(const std::string& path, const FrameTimer& timer) const {
+		if (path.empty() || path == "-") {
+			write(std::cout, timer);
+			return;
+		}
+		std::ofstream file(path);
+		if (!file) {
+			throw std::runtime_error("Can't open benchmark output " + path);
+		}
+		write(file, timer);
+	}
+};
@@ -0,0 +1,324 @@
+#pragma once
+// Frame capture to a video file. Frames are read back through a ring of pixel pack buffers with a
+// fence each, so glReadPixels returns at once, and are converted and written on a thread of their
+// own, so the render thread never waits on the GPU or the disk.
+#include <GL/glew.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gl_objects.hpp"
+
+/// Writes bottom-up RGBA8 frames, as glReadPixels returns them, as YUV4MPEG2 (4:2:0, full range
+/// BT.601, what players expect of C420jpeg) or as raw top-down RGB24.
+class VideoEncoder {
+public:
+	enum class Format {
+		Y4M,
+		RawRGB,
+	};
+
+	Format format;
+	int width;
+	int height;
+
+	/// Y4M for a .y4m path, raw RGB otherwise. fps only goes into the Y4M header.
+	VideoEncoder(const std::string& path, int width, int height, double fps) :
+		format{ path.ends_with(".y4m") ? Format::Y4M : Format::RawRGB }, width{ width }, height{ height }, out{ path, std::ios::binary } {
+		if (!out) {
+			throw std::runtime_error("Can't open capture output " + path);
+		}
+		if (format == Format::Y4M) {
+			// Frame rate as a fraction, to a thousandth of a frame
+			out << "YUV4MPEG2 W" << width << " H" << height << " F" << (long long)(fps * 1000 + 0.5) << ":1000 Ip A1:1 C420jpeg\n";
+			// Chroma planes are rounded up for odd sizes
+			y_plane.resize((size_t)width * height);
+			u_plane.resize((size_t)chroma_width() * chroma_height());
+			v_plane.resize(u_plane.size());
+		}
+		else {
+			row.resize((size_t)width * 3);
+		}
+	}
+
+	int chroma_width() const {
+		return (width + 1) / 2;
+	}
+	int chroma_height() const {
+		return (height + 1) / 2;
+	}
+
+	void write(const uint8_t* rgba) {
+		if (format == Format::Y4M)
+			write_y4m(rgba);
+		else
+			write_rgb(rgba);
+		if (!out) {
+			throw std::runtime_error("Writing the capture failed");
+		}
+	}
+
+private:
+	std::ofstream out;
+	std::vector<uint8_t> row;
+	std::vector<uint8_t> y_plane;
+	std::vector<uint8_t> u_plane;
+	std::vector<uint8_t> v_plane;
+
+	const uint8_t* source_row(const uint8_t* rgba, int y) const {
+		return rgba + (size_t)(height - 1 - y) * width * 4;
+	}
+
+	void write_rgb(const uint8_t* rgba) {
+		for (int y = 0; y < height; ++y) {
+			const uint8_t* src = source_row(rgba, y);
+			for (int x = 0; x < width; ++x) {
+				row[x * 3 + 0] = src[x * 4 + 0];
+				row[x * 3 + 1] = src[x * 4 + 1];
+				row[x * 3 + 2] = src[x * 4 + 2];
+			}
+			out.write((const char*)row.data(), (std::streamsize)row.size());
+		}
+	}
+
+	/// Fixed point BT.601 with 8 fractional bits, chroma averaged over each 2x2 block
+	void write_y4m(const uint8_t* rgba) {
+		for (int y = 0; y < height; ++y) {
+			const uint8_t* src = source_row(rgba, y);
+			uint8_t* luma = y_plane.data() + (size_t)y * width;
+			for (int x = 0; x < width; ++x) {
+				int r = src[x * 4 + 0], g = src[x * 4 + 1], b = src[x * 4 + 2];
+				luma[x] = (uint8_t)((77 * r + 150 * g + 29 * b + 128) >> 8);
+			}
+		}
+		for (int cy = 0; cy < chroma_height(); ++cy) {
+			const uint8_t* top = source_row(rgba, cy * 2);
+			const uint8_t* bottom = source_row(rgba, std::min(cy * 2 + 1, height - 1));
+			for (int cx = 0; cx < chroma_width(); ++cx) {
+				int x0 = cx * 2 * 4;
+				int x1 = std::min(cx * 2 + 1, width - 1) * 4;
+				int r = top[x0] + top[x1] + bottom[x0] + bottom[x1];
+				int g = top[x0 + 1] + top[x1 + 1] + bottom[x0 + 1] + bottom[x1 + 1];
+				int b = top[x0 + 2] + top[x1 + 2] + bottom[x0 + 2] + bottom[x1 + 2];
+				// Sums of four, so shifted by two more bits. Shifts round negatives down, unlike division.
+				size_t i = (size_t)cy * chroma_width() + cx;
+				u_plane[i] = (uint8_t)std::clamp(((-43 * r - 85 * g + 128 * b + 512) >> 10) + 128, 0, 255);
+				v_plane[i] = (uint8_t)std::clamp(((128 * r - 107 * g - 21 * b + 512) >> 10) + 128, 0, 255);
+			}
+		}
+		out << "FRAME\n";
+		out.write((const char*)y_plane.data(), (std::streamsize)y_plane.size());
+		out.write((const char*)u_plane.data(), (std::streamsize)u_plane.size());
+		out.write((const char*)v_plane.data(), (std::streamsize)v_plane.size());
+	}
+};
+
+/// Reads frames back into SLOTS persistently mapped pixel pack buffers. A slot goes from read
+/// (fenced, the GPU is copying into it) to written (the writer thread owns its mapping) and back
+/// to free. Only when every slot is busy does read() wait, which stalls counts.
+class FrameCapture {
+public:
+	static constexpr size_t SLOTS = 4;
+
+	// Frames written, frames read() had to wait for a slot and frames skipped for having another
+	// size than the first
+	std::atomic<size_t> frames{ 0 };
+	size_t stalls = 0;
+	size_t skipped = 0;
+
+	FrameCapture(std::string path, double fps) : path{ std::move(path) }, fps{ fps } {}
+
+	FrameCapture(const FrameCapture&) = delete;
+	FrameCapture& operator=(const FrameCapture&) = delete;
+
+	~FrameCapture() {
+		try {
+			stop_writer();
+		}
+		catch (...) {
+			// Reported by finish(), if it was called
+		}
+		for (Slot& slot : slots) {
+			if (slot.fence)
+				glDeleteSync(slot.fence);
+			if (slot.buffer) {
+				glUnmapNamedBuffer(slot.buffer);
+				glDeleteBuffers(1, &slot.buffer);
+			}
+		}
+	}
+
+	/// Starts reading the colour of framebuffer, 0 for the default one's back buffer, so call it
+	/// before the swap. The first frame fixes the size of the video.
+	void read(GLuint framebuffer, int width, int height) {
+		if (!encoder) {
+			start(width, height);
+		}
+		if (width != encoder->width || height != encoder->height) {
+			++skipped;
+			return;
+		}
+		poll();
+		Slot& slot = slots[next];
+		if (slot.state != State::Free) {
+			++stalls;
+			if (slot.state == State::Read) {
+				glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+				hand_over(next);
+			}
+			std::unique_lock lock{ mutex };
+			freed.wait(lock, [&] { return slot.state == State::Free; });
+		}
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		slot.state = State::Read;
+		next = (next + 1) % SLOTS;
+	}
+
+	/// Hands finished readbacks to the writer without waiting, oldest first and stopping at the
+	/// first unfinished one, so frames keep their order
+	void poll() {
+		for (size_t i = 0; i < SLOTS; ++i) {
+			size_t index = (next + i) % SLOTS;
+			if (slots[index].state != State::Read)
+				continue;
+			GLenum status = glClientWaitSync(slots[index].fence, 0, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+				return;
+			hand_over(index);
+		}
+	}
+
+	/// Waits for every readback and for the writer to write them, then closes the file
+	void finish() {
+		for (size_t i = 0; i < SLOTS; ++i) {
+			size_t index = (next + i) % SLOTS;
+			if (slots[index].state == State::Read) {
+				glClientWaitSync(slots[index].fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+				hand_over(index);
+			}
+		}
+		stop_writer();
+		encoder.reset();
+	}
+
+private:
+	enum class State {
+		Free,
+		Read,
+		Written,
+	};
+
+	struct Slot {
+		GLuint buffer = 0;
+		const uint8_t* mapped = nullptr;
+		GLsync fence = nullptr;
+		// The writer sets Free with mutex held, so read() can wait on freed
+		std::atomic<State> state{ State::Free };
+	};
+
+	std::string path;
+	double fps;
+	std::unique_ptr<VideoEncoder> encoder;
+	Slot slots[SLOTS];
+	size_t next = 0;
+
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable queued;
+	std::condition_variable freed;
+	// Slots handed over, in frame order
+	std::deque<size_t> queue;
+	bool stopping = false;
+	// Rethrown on the render thread by stop_writer
+	std::exception_ptr error;
+
+	void start(int width, int height) {
+		encoder = std::make_unique<VideoEncoder>(path, width, height, fps);
+		GLsizeiptr size = (GLsizeiptr)width * height * 4;
+		GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		for (Slot& slot : slots) {
+			glCreateBuffers(1, &slot.buffer);
+			glNamedBufferStorage(slot.buffer, size, nullptr, flags);
+			slot.mapped = (const uint8_t*)glMapNamedBufferRange(slot.buffer, 0, size, flags);
+			if (slot.mapped == nullptr) {
+				throw gl_error();
+			}
+		}
+		writer = std::thread([this] { write_frames(); });
+	}
+
+	/// Passes a slot whose fence has signalled to the writer
+	void hand_over(size_t index) {
+		Slot& slot = slots[index];
+		glDeleteSync(slot.fence);
+		slot.fence = nullptr;
+		{
+			std::lock_guard lock{ mutex };
+			slot.state = State::Written;
+			queue.push_back(index);
+		}
+		queued.notify_one();
+	}
+
+	void write_frames() {
+		while (true) {
+			size_t index;
+			{
+				std::unique_lock lock{ mutex };
+				queued.wait(lock, [&] { return stopping || !queue.empty(); });
+				if (queue.empty())
+					return;
+				index = queue.front();
+				queue.pop_front();
+			}
+			// The mapping is coherent and the fence has signalled, so the pixels are all there
+			try {
+				if (!error)
+					encoder->write(slots[index].mapped);
+			}
+			catch (...) {
+				error = std::current_exception();
+			}
+			frames.fetch_add(1, std::memory_order_relaxed);
+			{
+				std::lock_guard lock{ mutex };
+				slots[index].state = State::Free;
+			}
+			freed.notify_all();
+		}
+	}
+
+	void stop_writer() {
+		if (!writer.joinable())
+			return;
+		{
+			std::lock_guard lock{ mutex };
+			stopping = true;
+		}
+		queued.notify_one();
+		writer.join();
+		stopping = false;
+		if (error) {
+			std::exception_ptr rethrown = error;
+			error = nullptr;
+			std::rethrow_exception(rethrown);
+		}
+	}
+};
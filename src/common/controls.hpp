@@ -3,10 +3,14 @@
 #include <bitset>
 #include <GLFW/glfw3.h>
 #include "keymap.h"
+#include "input_events.hpp"
 // Include GLM
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
 #include <iostream>
+#include <mutex>
+#include <vector>
 constexpr double PI = glm::pi<double>();
 namespace _KeyBinds {
 	enum KeyBinds {
@@ -17,17 +21,28 @@ namespace _KeyBinds {
 	};
 }
 using KeyBinds = _KeyBinds::KeyBinds;
+/// Callbacks only queue timestamped events, update() applies them in order on whichever thread
+/// renders, so GLFW's event loop can run on a thread of its own.
 template<typename relthis>
 struct Camera {
+	// Events queued by the callbacks and not yet applied by update()
+	static constexpr size_t EVENT_RING = 4096;
 
-	bool triggers[1]{ false };
+	bool triggers[2]{ false };
 	int window_width, window_height;
 	double cursor_x, cursor_y;
-	double next_cursor_x, next_cursor_y;
 
 	std::bitset<4> key_states{ 0 };
-	std::bitset<4> key_pressed{ 0 };
-	std::bitset<4> key_released{ 0 };
+
+	SpscRing<InputEvent, EVENT_RING> events;
+	// Events that didn't fit in the ring, all newer than what is in it. While there are any the
+	// callbacks queue here too, so nothing is reordered or lost, and a lost key release would
+	// leave the camera moving. Consecutive cursor events collapse, positions being absolute.
+	std::mutex overflow_mutex;
+	std::vector<InputEvent> overflow;
+	std::atomic<bool> overflowing{ false };
+	// Time of the oldest event the last update() applied, negative if it applied none
+	double oldest_event_time = -1;
 
 	glm::mat4 viewMatrix;
 	glm::mat4 projectionMatrix;
@@ -85,8 +100,6 @@ struct Camera {
 		glfwGetWindowSize(window, &window_width, &window_height);
 		cursor_x = ((double)window_width) / 2;
 		cursor_y = ((double)window_height) / 2;
-		next_cursor_x = cursor_x;
-		next_cursor_y = cursor_y;
 
 		glfwSetCursorPos(window, cursor_x, cursor_y);
 
@@ -97,6 +110,8 @@ struct Camera {
 		keyMap[PYO_KEY_A].data = 128 | ((uint8_t)KeyBinds::left + 1);
 
 		keyMap[PYO_KEY_ESCAPE].data = 1;
+		// Toggle hi-z occlusion culling
+		keyMap[PYO_KEY_H].data = 2;
 
 		glfwSetKeyCallback(window, &Camera::key_callback_thunk);
 
@@ -114,12 +129,26 @@ struct Camera {
 	~Camera() {
 
 	}
+	void queue(const InputEvent& event) {
+		if (!overflowing.load(std::memory_order_acquire) && events.push(event))
+			return;
+		std::lock_guard lock{ overflow_mutex };
+		// update() may have taken the overflow since
+		if (!overflowing.load(std::memory_order_relaxed) && events.push(event))
+			return;
+		if (event.type == InputEvent::Cursor && !overflow.empty() && overflow.back().type == InputEvent::Cursor)
+			overflow.back() = event;
+		else
+			overflow.push_back(event);
+		overflowing.store(true, std::memory_order_release);
+	}
+
 	void focus_callback(GLFWwindow* window, int focused) {
 		if (focused == GLFW_TRUE) {
 			//std::cout << "Focused" << std::endl;
-			glfwGetCursorPos(window, &cursor_x, &cursor_y);
-			next_cursor_x = cursor_x;
-			next_cursor_y = cursor_y;
+			InputEvent event{ glfwGetTime(), InputEvent::Focus };
+			glfwGetCursorPos(window, &event.x, &event.y);
+			queue(event);
 		}
 	}
 	
@@ -177,56 +206,16 @@ struct Camera {
 		// filter out unbound keys
 		if (keydata.data == 0)
 			return;
-		/*
-		* unset, unpressed, unreleased      (000)->
-		* Pressed : set, pressed, unreleased (110)
-		* Released: ?
-
-		* unset, unpressed, released   (001)-> ?
-		* 
-		* unset, pressed, unreleased   (010)-> ?
-		* 
-		* unset, pressed, released     (011)-> ?
-		* 
-		* set, unpressed, unreleased   (100)-> ?
-		* Pressed : ?
-		* Released: unset, unpressed, unreleased (000)
-		* set, unpressed, released     (101)-> ?
-		* 
-		* set, pressed, unreleased     (110)-> ?
-		* Pressed : ?
-		* Released: set, pressed, released (111)
-		* 
-		* set, pressed, released       (111)-> ?
-		* Pressed : set, pressed, unreleased (110)
-		* Released: ?
-		* 
-		*/
-
 		bool type = keydata.getType();
 		if (type == 1) {// timed key
-			KeyBinds binding = (KeyBinds)(keydata.getEventId() - 1);
-
-			bool state = key_states[binding];
-			bool pressed = key_states[binding];
-
-			if (baction) { // GLFW_PRESS
-				key_states[binding] = true;
-				key_pressed[binding] = true;
-				key_released[binding] = false;
-			}
-			else { // GLFW_RELEASE
-
-				if (pressed) {
-					key_released[binding] = true;
-				}
-				else {
-					key_states[binding] = false;
-				}
-			}
+			queue({ glfwGetTime(), InputEvent::Key, (uint8_t)(keydata.getEventId() - 1), baction });
 		}
-		else {
-			triggers[(keydata.getEventId() - 1)] = true;
+		else if (baction) {
+			uint8_t trigger = keydata.getEventId() - 1;
+			// Escape also ends the event loop, which may be waiting on a thread that never calls update()
+			if (trigger == 0)
+				glfwSetWindowShouldClose(window, GLFW_TRUE);
+			queue({ glfwGetTime(), InputEvent::Trigger, trigger, true });
 		}
 
 	}
@@ -234,8 +223,7 @@ struct Camera {
 	void cursor_position_callback(GLFWwindow* window, double x, double y)
 	{
 		//std::cout << "Cursor x: " << x << '\n' << "Cursor y: " << y << std::endl;
-		next_cursor_x = x;
-		next_cursor_y = y;
+		queue({ glfwGetTime(), InputEvent::Cursor, 0, false, x, y });
 	}
 	static void focus_callback_thunk(GLFWwindow* window, int focused) {
 		relthis::relthis(glfwGetWindowUserPointer(window))->focus_callback(window, focused);
@@ -253,36 +241,83 @@ struct Camera {
 
 
 
-	void update() {
-		const double curTime = glfwGetTime();
-		const double deltaTime = curTime - prevTime;
-		prevTime = curTime;
+	/// Places the camera without going through input, for scripted camera paths
+	void look_at(glm::vec3 eye, glm::vec3 target) {
+		position = eye;
+		direction = glm::normalize(target - eye);
+		horizontalAngle = (float)atan2(direction.x, direction.z);
+		verticalAngle = (float)asin(direction.y);
+		right = glm::vec3(
+			sin(horizontalAngle - PI / 2.0f),
+			0,
+			cos(horizontalAngle - PI / 2.0f)
+		);
+		up = glm::cross(right, direction);
 
-		double delta_cursor_x = (next_cursor_x - cursor_x) ;
-		double delta_cursor_y = (next_cursor_y - cursor_y) ;
+		projectionMatrix = glm::perspective(glm::radians(FoV), (float)window_width / (float)window_height, 0.1f, 100.0f);
+		viewMatrix = glm::lookAt(position, position + direction, up);
+	}
 
-		cursor_x = next_cursor_x;
-		cursor_y = next_cursor_y;
+	/// Applies one queued event
+	void apply(const InputEvent& event) {
+		switch (event.type) {
+		case InputEvent::Key:
+			key_states[event.binding] = event.down;
+			break;
+		case InputEvent::Trigger:
+			triggers[event.binding] = true;
+			break;
+		case InputEvent::Cursor:
+			update_view_from_cursor_delta(0, event.x - cursor_x, event.y - cursor_y);
+			cursor_x = event.x;
+			cursor_y = event.y;
+			break;
+		case InputEvent::Focus:
+			cursor_x = event.x;
+			cursor_y = event.y;
+			break;
+		}
+	}
 
+	void update() {
+		update(glfwGetTime());
+	}
 
-		update_view_from_cursor_delta(deltaTime, delta_cursor_x, delta_cursor_y);
-		update_pos_from_keys(deltaTime);
-		prevTime = curTime;
-		if (key_released[KeyBinds::forward]) {
-			key_states[KeyBinds::forward] = false;
-		}
-		if (key_released[KeyBinds::backward]) {
-			key_states[KeyBinds::backward] = false;
-		}
-		if (key_released[KeyBinds::right]) {
-			key_states[KeyBinds::right] = false;
+	/// Applies the queued events up to curTime in timestamp order, moving with the keys held
+	/// between them, so a key tapped within one frame moves by exactly as long as it was held
+	void update(double curTime) {
+		double time = prevTime;
+		oldest_event_time = -1;
+		auto step = [&](const InputEvent& event) {
+			double event_time = std::clamp(event.time, time, curTime);
+			update_pos_from_keys(event_time - time);
+			time = event_time;
+			apply(event);
+			if (oldest_event_time < 0)
+				oldest_event_time = event.time;
+		};
+		InputEvent event;
+		while (events.pop(event)) {
+			step(event);
 		}
-		if (key_released[KeyBinds::left]) {
-			key_states[KeyBinds::left] = false;
+		if (overflowing.load(std::memory_order_acquire)) {
+			std::vector<InputEvent> late;
+			{
+				// Nothing joins the ring while the overflow is held, and what is in it came first
+				std::lock_guard lock{ overflow_mutex };
+				while (events.pop(event)) {
+					step(event);
+				}
+				late.swap(overflow);
+				overflowing.store(false, std::memory_order_relaxed);
+			}
+			for (const InputEvent& late_event : late) {
+				step(late_event);
+			}
 		}
+		update_pos_from_keys(curTime - time);
+		prevTime = curTime;
 
-		key_released.reset();
-		key_pressed.reset();
 		// Projection matrix : 45 Field of View, 4:3 ratio, display range : 0.1 unit <-> 100 units
 		projectionMatrix = glm::perspective(glm::radians(FoV), 4.0f / 3.0f, 0.1f, 100.0f);
 		// Camera matrix
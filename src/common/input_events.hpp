@@ -0,0 +1,63 @@
+#ifndef INPUT_EVENTS_HPP
+#define INPUT_EVENTS_HPP
+// Timestamped input events, handed from the thread that runs the GLFW event loop to the thread
+// that renders through a lock-free single producer, single consumer ring.
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/// One key, cursor or focus event. time is glfwGetTime() when the callback ran.
+struct InputEvent {
+	enum Type : uint8_t {
+		// binding is pressed (down) or released
+		Key,
+		// trigger fired, triggers fire on press only
+		Trigger,
+		// Cursor moved to x, y
+		Cursor,
+		// Focus was regained with the cursor at x, y
+		Focus,
+	};
+
+	double time;
+	Type type;
+	uint8_t binding;
+	bool down;
+	double x, y;
+};
+
+/// Fixed size ring for exactly one producer and one consumer thread. Each side only writes its
+/// own index, so neither ever waits on the other.
+template<typename T, size_t N>
+	requires((N & (N - 1)) == 0)
+class SpscRing {
+public:
+	/// Producer only. False, and the value dropped, when the ring is full.
+	bool push(const T& value) {
+		size_t tail = write.load(std::memory_order_relaxed);
+		if (tail - read.load(std::memory_order_acquire) == N)
+			return false;
+		slots[tail % N] = value;
+		write.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// Consumer only. False when the ring is empty.
+	bool pop(T& value) {
+		size_t head = read.load(std::memory_order_relaxed);
+		if (head == write.load(std::memory_order_acquire))
+			return false;
+		value = slots[head % N];
+		read.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::array<T, N> slots{};
+	// Apart so the producer and consumer don't share a cache line
+	alignas(64) std::atomic<size_t> write{ 0 };
+	alignas(64) std::atomic<size_t> read{ 0 };
+};
+
+#endif
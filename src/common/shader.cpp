@@ -9,6 +9,9 @@
 #include <fstream>
 #include <algorithm>
 #include <sstream>
+#include <filesystem>
+#include <future>
+#include <map>
 using namespace std;
 
 #include <stdlib.h>
@@ -17,22 +20,184 @@ using namespace std;
 #include <GL/glew.h>
 
 #include "shader.hpp"
+#include "../startup.hpp"
 
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path){
+// Directory of linked program binaries, empty disables the cache
+static std::string ProgramCacheDirectory = "shader_cache";
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+void SetProgramCacheDirectory(const char * directory){
+	ProgramCacheDirectory = directory ? directory : "";
+}
+
+// Sources read ahead by PreloadShaderFiles, keyed by path. Only the main thread touches the
+// future itself.
+static std::shared_future<std::map<std::string, std::string>> PreloadedSources;
+
+void PreloadShaderFiles(const char * const * paths, int count){
+	std::vector<std::string> files(paths, paths + count);
+	PreloadedSources = std::async(std::launch::async, [files]{
+		StartupPhase phase{ "read shader sources", "shaders" };
+		std::map<std::string, std::string> sources;
+		for (const std::string& path : files) {
+			std::ifstream stream(path, std::ios::in);
+			if (stream.is_open()) {
+				std::stringstream sstr;
+				sstr << stream.rdbuf();
+				sources[path] = sstr.str();
+			}
+		}
+		return sources;
+	}).share();
+}
+
+// Source of a shader file, preloaded or read now. Fails if the file can't be opened.
+static bool ReadShaderFile(const char * path, std::string& code){
+	if(PreloadedSources.valid()){
+		const std::map<std::string, std::string>& sources = PreloadedSources.get();
+		auto found = sources.find(path);
+		if(found != sources.end()){
+			code = found->second;
+			return true;
+		}
+	}
+	std::ifstream stream(path, std::ios::in);
+	if(!stream.is_open())
+		return false;
+	std::stringstream sstr;
+	sstr << stream.rdbuf();
+	code = sstr.str();
+	return true;
+}
+
+// Inserts defines after the #version line, which has to stay first. #line keeps compiler
+// messages pointing at the lines of the file.
+static void InsertDefines(std::string& code, const char * defines){
+	if(defines == NULL || *defines == '\0')
+		return;
+	size_t VersionEnd = 0;
+	if(code.compare(0, 8, "#version") == 0){
+		VersionEnd = code.find('\n');
+		VersionEnd = VersionEnd == std::string::npos ? code.size() : VersionEnd + 1;
+	}
+	std::string Inserted = defines;
+	if(Inserted.back() != '\n')
+		Inserted += '\n';
+	Inserted += "#line " + std::to_string(VersionEnd == 0 ? 1 : 2) + "\n";
+	if(VersionEnd == code.size() && VersionEnd > 0 && code.back() != '\n')
+		Inserted.insert(0, "\n");
+	code.insert(VersionEnd, Inserted);
+}
+
+// FNV-1a, only used to name cache entries
+static uint64_t HashString(uint64_t hash, const std::string& str){
+	for (unsigned char c : str) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	// Separator so that ("ab", "c") and ("a", "bc") differ
+	hash ^= 0xff;
+	hash *= 1099511628211ull;
+	return hash;
+}
+
+// Cache entry for the given sources on the current driver. Binaries are only valid for the
+// driver that produced them, so the vendor, renderer and version strings are part of the key.
+static std::string ProgramCachePath(const std::vector<std::string>& sources){
+	uint64_t hash = 14695981039346656037ull;
+	for (const std::string& source : sources) {
+		hash = HashString(hash, source);
+	}
+	for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+		const char* str = (const char*)glGetString(name);
+		hash = HashString(hash, str ? str : "");
+	}
+	char file_name[32];
+	snprintf(file_name, sizeof(file_name), "%016llx.bin", (unsigned long long)hash);
+	return (std::filesystem::path(ProgramCacheDirectory) / file_name).string();
+}
+
+static bool ProgramBinariesSupported(){
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return !ProgramCacheDirectory.empty() && formats > 0;
+}
+
+// Loads a cached binary into ProgramID. Fails on a miss or when the driver rejects the binary.
+static bool LoadProgramBinary(GLuint ProgramID, const std::string& path){
+	std::ifstream file(path, std::ios::in | std::ios::binary | std::ios::ate);
+	if(!file.is_open())
+		return false;
+
+	// The blob is whatever follows the format
+	std::streamoff FileSize = file.tellg();
+	if(FileSize <= (std::streamoff)sizeof(GLenum))
+		return false;
+	file.seekg(0);
+
+	GLenum BinaryFormat = 0;
+	file.read((char*)&BinaryFormat, sizeof(BinaryFormat));
+	std::vector<char> Binary((size_t)FileSize - sizeof(BinaryFormat));
+	file.read(Binary.data(), (std::streamsize)Binary.size());
+	if(file.fail())
+		return false;
+
+	glProgramBinary(ProgramID, BinaryFormat, Binary.data(), (GLsizei)Binary.size());
+	GLint Result = GL_FALSE;
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	return Result == GL_TRUE;
+}
+
+static void SaveProgramBinary(GLuint ProgramID, const std::string& path){
+	GLint BinaryLength = 0;
+	glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &BinaryLength);
+	if(BinaryLength <= 0)
+		return;
+
+	std::vector<char> Binary(BinaryLength);
+	GLenum BinaryFormat = 0;
+	glGetProgramBinary(ProgramID, BinaryLength, NULL, &BinaryFormat, Binary.data());
+
+	std::error_code ec;
+	std::filesystem::create_directories(ProgramCacheDirectory, ec);
+	std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	if(!file.is_open()){
+		printf("Can't write program cache %s\n", path.c_str());
+		return;
+	}
+	file.write((const char*)&BinaryFormat, sizeof(BinaryFormat));
+	file.write(Binary.data(), Binary.size());
+}
+
+// Tries the binary cache for the program built from sources. Returns 0 on a miss, in which case
+// the caller compiles and links as usual and then calls StoreCachedProgram.
+static GLuint LoadCachedProgram(const std::vector<std::string>& sources, std::string& cache_path){
+	cache_path.clear();
+	if(!ProgramBinariesSupported())
+		return 0;
+
+	cache_path = ProgramCachePath(sources);
+	GLuint ProgramID = glCreateProgram();
+	if(LoadProgramBinary(ProgramID, cache_path)){
+		printf("Loaded cached program : %s\n", cache_path.c_str());
+		return ProgramID;
+	}
+	glDeleteProgram(ProgramID);
+	return 0;
+}
+
+static void StoreCachedProgram(GLuint ProgramID, const std::string& cache_path){
+	GLint Result = GL_FALSE;
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	if(!cache_path.empty() && Result == GL_TRUE)
+		SaveProgramBinary(ProgramID, cache_path);
+}
+
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path, const char * defines){
+	StartupPhase phase{ vertex_file_path };
 
 	// Read the Vertex Shader code from the file
 	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open()){
-		std::stringstream sstr;
-		sstr << VertexShaderStream.rdbuf();
-		VertexShaderCode = sstr.str();
-		VertexShaderStream.close();
-	}else{
+	if(!ReadShaderFile(vertex_file_path, VertexShaderCode)){
 		printf("Impossible to open %s. Are you in the right directory ? Don't forget to read the FAQ !\n", vertex_file_path);
 		getchar();
 		return 0;
@@ -40,13 +205,18 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 
 	// Read the Fragment Shader code from the file
 	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::stringstream sstr;
-		sstr << FragmentShaderStream.rdbuf();
-		FragmentShaderCode = sstr.str();
-		FragmentShaderStream.close();
-	}
+	ReadShaderFile(fragment_file_path, FragmentShaderCode);
+
+	InsertDefines(VertexShaderCode, defines);
+	InsertDefines(FragmentShaderCode, defines);
+
+	std::string CachePath;
+	if(GLuint CachedProgramID = LoadCachedProgram({ VertexShaderCode, FragmentShaderCode }, CachePath))
+		return CachedProgramID;
+
+	// Create the shaders
+	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
 
 	GLint Result = GL_FALSE;
 	int InfoLogLength;
@@ -91,6 +261,7 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	GLuint ProgramID = glCreateProgram();
 	glAttachShader(ProgramID, VertexShaderID);
 	glAttachShader(ProgramID, FragmentShaderID);
+	glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(ProgramID);
 
 	// Check the program
@@ -109,7 +280,63 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	glDeleteShader(VertexShaderID);
 	glDeleteShader(FragmentShaderID);
 
+	StoreCachedProgram(ProgramID, CachePath);
 	return ProgramID;
 }
 
+GLuint LoadComputeShader(const char * compute_file_path){
+	StartupPhase phase{ compute_file_path };
+
+	// Read the Compute Shader code from the file
+	std::string ComputeShaderCode;
+	if(!ReadShaderFile(compute_file_path, ComputeShaderCode)){
+		printf("Impossible to open %s. Are you in the right directory ?\n", compute_file_path);
+		return 0;
+	}
+
+	std::string CachePath;
+	if(GLuint CachedProgramID = LoadCachedProgram({ ComputeShaderCode }, CachePath))
+		return CachedProgramID;
+
+	GLuint ComputeShaderID = glCreateShader(GL_COMPUTE_SHADER);
+
+	GLint Result = GL_FALSE;
+	int InfoLogLength;
+
+	// Compile Compute Shader
+	printf("Compiling shader : %s\n", compute_file_path);
+	char const * ComputeSourcePointer = ComputeShaderCode.c_str();
+	glShaderSource(ComputeShaderID, 1, &ComputeSourcePointer , NULL);
+	glCompileShader(ComputeShaderID);
 
+	// Check Compute Shader
+	glGetShaderiv(ComputeShaderID, GL_COMPILE_STATUS, &Result);
+	glGetShaderiv(ComputeShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	if ( InfoLogLength > 0 ){
+		std::vector<char> ComputeShaderErrorMessage(InfoLogLength+1);
+		glGetShaderInfoLog(ComputeShaderID, InfoLogLength, NULL, &ComputeShaderErrorMessage[0]);
+		printf("%s\n", &ComputeShaderErrorMessage[0]);
+	}
+
+	// Link the program
+	printf("Linking program\n");
+	GLuint ProgramID = glCreateProgram();
+	glAttachShader(ProgramID, ComputeShaderID);
+	glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(ProgramID);
+
+	// Check the program
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	if ( InfoLogLength > 0 ){
+		std::vector<char> ProgramErrorMessage(InfoLogLength+1);
+		glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+		printf("%s\n", &ProgramErrorMessage[0]);
+	}
+
+	glDetachShader(ProgramID, ComputeShaderID);
+	glDeleteShader(ComputeShaderID);
+
+	StoreCachedProgram(ProgramID, CachePath);
+	return ProgramID;
+}
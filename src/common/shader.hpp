@@ -4,6 +4,16 @@
 #ifndef SHADER_HPP
 #define SHADER_HPP
 
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path);
+// defines, "#define NAME value" lines, are inserted into both sources right after #version
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path, const char * defines = NULL);
+GLuint LoadComputeShader(const char * compute_file_path);
+
+// Linked programs are cached as driver binaries in this directory (default "shader_cache"),
+// NULL or "" disables the cache
+void SetProgramCacheDirectory(const char * directory);
+
+// Starts reading the given shader files on a background thread. LoadShaders and LoadComputeShader
+// take a preloaded file's source from there instead of reading it themselves.
+void PreloadShaderFiles(const char * const * paths, int count);
 
 #endif
@@ -0,0 +1,273 @@
+#pragma once
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gl_objects.hpp"
+
+/// CPU copy of one sub object, with indices relative to its first vertex
+struct MeshData {
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> normals;
+	std::vector<GLuint> indices;
+};
+
+/// Pre-transformed vertex of baked geometry
+struct BakedVertex {
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec3 color;
+};
+
+/// Everything a dead pipe draws, in world space
+struct FreezeJob {
+	size_t pipe_id;
+	glm::vec3 color;
+	std::vector<glm::mat4> pipes;
+	std::vector<glm::mat4> balls;
+};
+
+/// Geometry to append to one region. Indices already account for what earlier chunks put in
+/// the region, so chunks must be appended in the order they were produced.
+struct RegionChunk {
+	size_t region;
+	std::vector<BakedVertex> vertices;
+	std::vector<GLuint> indices;
+};
+
+struct FreezeResult {
+	size_t pipe_id;
+	std::vector<RegionChunk> chunks;
+};
+
+/// Background worker that turns dead pipes into merged, pre-transformed geometry bucketed by
+/// spatial region. Only touches CPU memory, the GL upload happens in BakedScene on the GL thread.
+class PipeFreezer {
+public:
+	// Edge length of a region in grid cells
+	static constexpr unsigned REGION_SIZE = 8;
+
+	PipeFreezer(glm::uvec3 bounds, MeshData pipe_mesh, MeshData ball_mesh) :
+		regions_dim{ (bounds + glm::uvec3(REGION_SIZE - 1)) / REGION_SIZE },
+		pipe_mesh{ std::move(pipe_mesh) }, ball_mesh{ std::move(ball_mesh) },
+		region_vertices(region_count(), 0),
+		worker{ &PipeFreezer::work, this } {
+	}
+
+	~PipeFreezer() {
+		{
+			std::lock_guard lock{ mutex };
+			stop = true;
+		}
+		cv.notify_one();
+		worker.join();
+	}
+
+	size_t region_count() const {
+		return (size_t)regions_dim.x * regions_dim.y * regions_dim.z;
+	}
+
+	void freeze(FreezeJob&& job) {
+		{
+			std::lock_guard lock{ mutex };
+			jobs.push_back(std::move(job));
+		}
+		cv.notify_one();
+	}
+
+	/// Empties every region for a new generation. Only valid once every frozen pipe has been
+	/// polled, the worker is idle then.
+	void reset() {
+		std::lock_guard lock{ mutex };
+		std::fill(region_vertices.begin(), region_vertices.end(), 0);
+	}
+
+	/// Finished jobs, in submission order
+	std::vector<FreezeResult> poll() {
+		std::lock_guard lock{ mutex };
+		std::vector<FreezeResult> finished;
+		finished.swap(results);
+		return finished;
+	}
+
+private:
+	glm::uvec3 regions_dim;
+	MeshData pipe_mesh;
+	MeshData ball_mesh;
+	// Vertices handed out per region so far, only touched by the worker
+	std::vector<size_t> region_vertices;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<FreezeJob> jobs;
+	std::vector<FreezeResult> results;
+	bool stop = false;
+	std::thread worker;
+
+	size_t region_of(const glm::mat4& M) const {
+		glm::uvec3 cell = glm::uvec3(glm::max(glm::vec3(M[3]) + 0.5f, glm::vec3(0))) / REGION_SIZE;
+		cell = glm::min(cell, regions_dim - 1u);
+		return (size_t)cell.z * regions_dim.x * regions_dim.y + (size_t)cell.y * regions_dim.x + cell.x;
+	}
+
+	void bake(const MeshData& mesh, const glm::mat4& M, const glm::vec3& color, RegionChunk& chunk) {
+		glm::mat3 normal_matrix = glm::transpose(glm::inverse(glm::mat3(M)));
+		GLuint base = (GLuint)(region_vertices[chunk.region] + chunk.vertices.size());
+		for (size_t v = 0; v < mesh.positions.size(); ++v) {
+			chunk.vertices.push_back({ glm::vec3(M * glm::vec4(mesh.positions[v], 1)), glm::normalize(normal_matrix * mesh.normals[v]), color });
+		}
+		for (GLuint index : mesh.indices) {
+			chunk.indices.push_back(base + index);
+		}
+	}
+
+	FreezeResult bake(const FreezeJob& job) {
+		FreezeResult result{ job.pipe_id };
+		std::vector<RegionChunk*> by_region(region_count(), nullptr);
+		result.chunks.reserve(region_count());
+
+		auto chunk_for = [&](const glm::mat4& M) -> RegionChunk& {
+			size_t region = region_of(M);
+			if (by_region[region] == nullptr) {
+				by_region[region] = &result.chunks.emplace_back(RegionChunk{ region });
+			}
+			return *by_region[region];
+		};
+		for (const glm::mat4& M : job.pipes) {
+			bake(pipe_mesh, M, job.color, chunk_for(M));
+		}
+		for (const glm::mat4& M : job.balls) {
+			bake(ball_mesh, M, job.color, chunk_for(M));
+		}
+		for (const RegionChunk& chunk : result.chunks) {
+			region_vertices[chunk.region] += chunk.vertices.size();
+		}
+		return result;
+	}
+
+	void work() {
+		std::unique_lock lock{ mutex };
+		while (true) {
+			cv.wait(lock, [this] { return stop || !jobs.empty(); });
+			if (stop)
+				return;
+
+			FreezeJob job = std::move(jobs.front());
+			jobs.pop_front();
+			lock.unlock();
+			FreezeResult result = bake(job);
+			lock.lock();
+			results.push_back(std::move(result));
+		}
+	}
+};
+
+/// Baked geometry of one region, grown by appending chunks
+struct BakedRegion {
+	GLuint buffers[2]{ 0, 0 };
+	size_t vertex_count = 0;
+	size_t vertex_capacity = 0;
+	size_t index_count = 0;
+	size_t index_capacity = 0;
+
+	BakedRegion() = default;
+	BakedRegion(const BakedRegion&) = delete;
+	BakedRegion& operator=(const BakedRegion&) = delete;
+
+	~BakedRegion() {
+		glDeleteBuffers(2, buffers);
+	}
+
+	GLuint VBO() const {
+		return buffers[0];
+	}
+	GLuint IBO() const {
+		return buffers[1];
+	}
+
+	static void reserve(GLuint& buffer, size_t used, size_t& capacity, size_t needed) {
+		if (needed <= capacity)
+			return;
+		size_t new_capacity = std::max<size_t>(needed, capacity * 2);
+		GLuint new_buffer;
+		glCreateBuffers(1, &new_buffer);
+		glNamedBufferStorage(new_buffer, (GLsizeiptr)new_capacity, nullptr, GL_DYNAMIC_STORAGE_BIT);
+		if (used) {
+			glCopyNamedBufferSubData(buffer, new_buffer, 0, 0, (GLsizeiptr)used);
+		}
+		glDeleteBuffers(1, &buffer);
+		buffer = new_buffer;
+		capacity = new_capacity;
+	}
+
+	void append(const RegionChunk& chunk) {
+		size_t vertex_bytes = vertex_count * sizeof(BakedVertex);
+		size_t index_bytes = index_count * sizeof(GLuint);
+		size_t vertex_bytes_capacity = vertex_capacity * sizeof(BakedVertex);
+		size_t index_bytes_capacity = index_capacity * sizeof(GLuint);
+
+		reserve(buffers[0], vertex_bytes, vertex_bytes_capacity, vertex_bytes + chunk.vertices.size() * sizeof(BakedVertex));
+		reserve(buffers[1], index_bytes, index_bytes_capacity, index_bytes + chunk.indices.size() * sizeof(GLuint));
+		vertex_capacity = vertex_bytes_capacity / sizeof(BakedVertex);
+		index_capacity = index_bytes_capacity / sizeof(GLuint);
+
+		glNamedBufferSubData(VBO(), (GLintptr)vertex_bytes, (GLsizeiptr)(chunk.vertices.size() * sizeof(BakedVertex)), chunk.vertices.data());
+		glNamedBufferSubData(IBO(), (GLintptr)index_bytes, (GLsizeiptr)(chunk.indices.size() * sizeof(GLuint)), chunk.indices.data());
+		vertex_count += chunk.vertices.size();
+		index_count += chunk.indices.size();
+	}
+};
+
+/// Static geometry of every frozen pipe, drawn with one draw call per region
+struct BakedScene {
+	std::vector<BakedRegion> regions;
+	VertexArrays<1> vertex_arrays;
+
+	BakedScene(size_t region_count) : regions(region_count) {
+		GLuint vao = vertex_array();
+		glEnableVertexArrayAttrib(vao, 0);
+		glEnableVertexArrayAttrib(vao, 1);
+		glEnableVertexArrayAttrib(vao, 2);
+		glVertexArrayAttribFormat(vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof(BakedVertex, position));
+		glVertexArrayAttribFormat(vao, 1, 3, GL_FLOAT, GL_FALSE, offsetof(BakedVertex, normal));
+		glVertexArrayAttribFormat(vao, 2, 3, GL_FLOAT, GL_FALSE, offsetof(BakedVertex, color));
+		glVertexArrayAttribBinding(vao, 0, 0);
+		glVertexArrayAttribBinding(vao, 1, 0);
+		glVertexArrayAttribBinding(vao, 2, 0);
+	}
+
+	GLuint vertex_array() {
+		return vertex_arrays.vertex_arrays[0];
+	}
+
+	/// Drops all geometry but keeps the buffers for the next generation
+	void clear() {
+		for (BakedRegion& region : regions) {
+			region.vertex_count = 0;
+			region.index_count = 0;
+		}
+	}
+
+	void upload(const FreezeResult& result) {
+		for (const RegionChunk& chunk : result.chunks) {
+			regions[chunk.region].append(chunk);
+		}
+	}
+
+	/// Expects the baked program to be in use
+	void draw() {
+		glBindVertexArray(vertex_array());
+		for (const BakedRegion& region : regions) {
+			if (region.index_count == 0)
+				continue;
+			glVertexArrayVertexBuffer(vertex_array(), 0, region.VBO(), 0, sizeof(BakedVertex));
+			glVertexArrayElementBuffer(vertex_array(), region.IBO());
+			glDrawElements(GL_TRIANGLES, (GLsizei)region.index_count, GL_UNSIGNED_INT, nullptr);
+		}
+	}
+};
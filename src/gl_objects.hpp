@@ -0,0 +1,99 @@
+#pragma once
+#include <GL/glew.h>
+#include <exception>
+
+template<size_t N>
+struct GLBuffers {
+	GLuint buffers[N];
+
+	GLBuffers() {
+		glCreateBuffers(N, buffers);
+	}
+	/*
+	GLBuffers(const GLBuffers& other) = delete; // copy constructor
+	GLBuffers& operator=(const GLBuffers& that) = delete;
+	
+	GLBuffers(GLBuffers&& other) {
+	
+	}
+	GLBuffers& operator=(GLBuffers&& that) {
+
+	}
+	*/
+	~GLBuffers() {
+		glDeleteBuffers(N, buffers);
+	}
+};
+class gl_error : std::exception {};
+
+struct GLMapedBuffer {
+	GLuint buffer;
+	void* data;
+	GLMapedBuffer(GLuint buffer, GLintptr offset, GLsizeiptr length, GLbitfield access) : buffer(buffer) {
+		data = glMapNamedBufferRange(buffer, offset, length, access);
+		if (data == NULL) {
+			throw gl_error();
+		}
+	}
+	~GLMapedBuffer() {
+		glUnmapNamedBuffer(buffer);
+	}
+};
+
+template<size_t N>
+struct VertexArrays {
+	GLuint vertex_arrays[N];
+
+	VertexArrays() {
+		glCreateVertexArrays(N, vertex_arrays);
+	}
+
+	~VertexArrays() {
+		glDeleteVertexArrays(N, vertex_arrays);
+	}
+};
+
+template<size_t N>
+struct GLTextures {
+	GLuint textures[N];
+
+	GLTextures(GLenum target) {
+		glCreateTextures(target, N, textures);
+	}
+
+	~GLTextures() {
+		glDeleteTextures(N, textures);
+	}
+};
+
+template<size_t N>
+struct GLFramebuffers {
+	GLuint framebuffers[N];
+
+	GLFramebuffers() {
+		glCreateFramebuffers(N, framebuffers);
+	}
+
+	~GLFramebuffers() {
+		glDeleteFramebuffers(N, framebuffers);
+	}
+};
+
+template<size_t N>
+struct GLQueries {
+	GLuint queries[N];
+
+	GLQueries(GLenum target) {
+		glCreateQueries(target, N, queries);
+	}
+
+	~GLQueries() {
+		glDeleteQueries(N, queries);
+	}
+};
+
+struct BufferStorageHelper{
+	BufferStorageHelper(GLuint buffer, size_t size) {
+		glNamedBufferStorage(buffer, (GLsizeiptr)size, nullptr, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT);
+	}
+};
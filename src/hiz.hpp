@@ -0,0 +1,330 @@
+#pragma once
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "common/shader.hpp"
+#include "gl_objects.hpp"
+
+struct DrawElementsIndirectCommand {
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+};
+
+/// Hierarchical depth pyramid. Built from the depth buffer at the end of a frame by HiZBuilder and
+/// consumed by the culling pass of the next one.
+struct HiZPyramid {
+	// 0: single sampled depth copy, 1: R32F pyramid
+	GLuint textures[2]{ 0, 0 };
+	GLFramebuffers<1> framebuffers;
+
+	int width = 0;
+	int height = 0;
+	int levels = 0;
+	// Only true once a full pyramid has been built
+	bool valid = false;
+	// View projection of the frame the pyramid was built from
+	glm::mat4 VP{ 1 };
+
+	HiZPyramid() = default;
+	HiZPyramid(const HiZPyramid&) = delete;
+	HiZPyramid& operator=(const HiZPyramid&) = delete;
+
+	~HiZPyramid() {
+		glDeleteTextures(2, textures);
+	}
+
+	GLuint depth() const {
+		return textures[0];
+	}
+	GLuint pyramid() const {
+		return textures[1];
+	}
+	GLuint framebuffer() const {
+		return framebuffers.framebuffers[0];
+	}
+
+	void allocate(int w, int h) {
+		glDeleteTextures(2, textures);
+		width = w;
+		height = h;
+		levels = 1 + (int)std::floor(std::log2((double)std::max(w, h)));
+
+		glCreateTextures(GL_TEXTURE_2D, 2, textures);
+		// Must match the format of the read framebuffer for the multisample resolve in glBlitFramebuffer
+		glTextureStorage2D(depth(), 1, GL_DEPTH24_STENCIL8, w, h);
+		glTextureParameteri(depth(), GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTextureParameteri(depth(), GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+		glTextureStorage2D(pyramid(), levels, GL_R32F, w, h);
+		glTextureParameteri(pyramid(), GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTextureParameteri(pyramid(), GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTextureParameteri(pyramid(), GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTextureParameteri(pyramid(), GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+		glNamedFramebufferTexture(framebuffer(), GL_DEPTH_STENCIL_ATTACHMENT, depth(), 0);
+		valid = false;
+	}
+};
+
+/// Reduction program of HiZPyramid, one for any number of pyramids
+struct HiZBuilder {
+	GLuint program;
+	GLint src_level_id;
+	GLint reduce_id;
+
+	HiZBuilder() : program(LoadComputeShader("HiZDownsample.computeshader")) {
+		src_level_id = glGetUniformLocation(program, "src_level");
+		reduce_id = glGetUniformLocation(program, "reduce");
+	}
+
+	~HiZBuilder() {
+		glDeleteProgram(program);
+	}
+
+	/// Resolves the depth of read_framebuffer and reduces it into hiz.
+	void build(HiZPyramid& hiz, GLuint read_framebuffer, int w, int h, const glm::mat4& frame_VP) {
+		if (w != hiz.width || h != hiz.height) {
+			hiz.allocate(w, h);
+		}
+
+		glBlitNamedFramebuffer(read_framebuffer, hiz.framebuffer(), 0, 0, w, h, 0, 0, w, h, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+		glUseProgram(program);
+		glUniform1i(reduce_id, GL_FALSE);
+		glUniform1i(src_level_id, 0);
+		glBindTextureUnit(0, hiz.depth());
+		glBindImageTexture(0, hiz.pyramid(), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		glDispatchCompute((w + 7) / 8, (h + 7) / 8, 1);
+
+		glUniform1i(reduce_id, GL_TRUE);
+		glBindTextureUnit(0, hiz.pyramid());
+		int level_w = w;
+		int level_h = h;
+		for (int level = 1; level < hiz.levels; ++level) {
+			glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+			level_w = std::max(1, level_w / 2);
+			level_h = std::max(1, level_h / 2);
+			glUniform1i(src_level_id, level - 1);
+			glBindImageTexture(0, hiz.pyramid(), level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+			glDispatchCompute((level_w + 7) / 8, (level_h + 7) / 8, 1);
+		}
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+		hiz.VP = frame_VP;
+		hiz.valid = true;
+	}
+};
+
+// Must match MAX_LODS in HiZCull.computeshader
+constexpr size_t MAX_LODS = 4;
+
+/// Culled instance as written by HiZCull.computeshader, std430 layout
+struct VisibleInstance {
+	glm::mat4 M;
+	// Index into the palette uniform block
+	GLuint palette;
+	GLuint padding[3];
+};
+
+/// Compacted output of the culling pass, shared by every instance buffer culled into it.
+/// Holds the surviving instances bucketed by level of detail and one indirect command per mesh
+/// and level drawn from it, so everything culled into it is drawn with a single multi draw.
+struct CulledInstances {
+	static constexpr size_t MESH_COUNT = 2;
+	static constexpr size_t COMMAND_COUNT = MESH_COUNT * MAX_LODS;
+
+	// 0: visible instances, 1: indirect commands
+	GLuint buffers[2]{ 0, 0 };
+	// Instances per level of detail
+	size_t capacity = 0;
+
+	CulledInstances(size_t capacity) {
+		glCreateBuffers(1, &buffers[1]);
+		glNamedBufferStorage(commands(), (GLsizeiptr)(COMMAND_COUNT * sizeof(DrawElementsIndirectCommand)), nullptr, GL_DYNAMIC_STORAGE_BIT);
+		reserve(capacity);
+	}
+
+	CulledInstances(const CulledInstances&) = delete;
+	CulledInstances& operator=(const CulledInstances&) = delete;
+
+	~CulledInstances() {
+		glDeleteBuffers(2, buffers);
+	}
+
+	GLuint visible() const {
+		return buffers[0];
+	}
+	GLuint commands() const {
+		return buffers[1];
+	}
+
+	/// Makes room for instances per level of detail. Growing drops the contents, which the culling
+	/// pass rewrites every frame anyway.
+	void reserve(size_t instances) {
+		if (instances <= capacity)
+			return;
+		capacity = std::max(instances, capacity * 2);
+		glDeleteBuffers(1, &buffers[0]);
+		glCreateBuffers(1, &buffers[0]);
+		glNamedBufferStorage(visible(), (GLsizeiptr)(MAX_LODS * capacity * sizeof(VisibleInstance)), nullptr, 0);
+	}
+
+	/// First command of a mesh, followed by one command per level of detail
+	static constexpr GLuint command(size_t mesh, size_t lod = 0) {
+		return (GLuint)(mesh * MAX_LODS + lod);
+	}
+};
+
+/// Frustum and Hi-Z occlusion test of instance ranges, run as a compute pass before drawing.
+struct InstanceCuller {
+	GLuint program;
+	GLint VP_id;
+	GLint hiz_VP_id;
+	GLint viewport_id;
+	GLint hiz_levels_id;
+	GLint occlusion_id;
+	GLint instance_offset_id;
+	GLint instance_count_id;
+	GLint visible_offset_id;
+	GLint lod_stride_id;
+	GLint command_id;
+	GLint radius_id;
+	GLint palette_id;
+	GLint camera_position_id;
+	GLint lod_count_id;
+	GLint lod_first_id;
+	GLint lod_distance_id;
+	GLint lod_hysteresis_id;
+
+	bool occlusion = true;
+	// Switch distances between consecutive levels of detail
+	float lod_distance[MAX_LODS - 1]{ 12.0f, 24.0f, 48.0f };
+	float lod_hysteresis = 0.1f;
+
+	InstanceCuller() : program(LoadComputeShader("HiZCull.computeshader")) {
+		VP_id = glGetUniformLocation(program, "VP");
+		hiz_VP_id = glGetUniformLocation(program, "hiz_VP");
+		viewport_id = glGetUniformLocation(program, "viewport");
+		hiz_levels_id = glGetUniformLocation(program, "hiz_levels");
+		occlusion_id = glGetUniformLocation(program, "occlusion");
+		instance_offset_id = glGetUniformLocation(program, "instance_offset");
+		instance_count_id = glGetUniformLocation(program, "instance_count");
+		visible_offset_id = glGetUniformLocation(program, "visible_offset");
+		lod_stride_id = glGetUniformLocation(program, "lod_stride");
+		command_id = glGetUniformLocation(program, "command");
+		radius_id = glGetUniformLocation(program, "radius");
+		palette_id = glGetUniformLocation(program, "palette");
+		camera_position_id = glGetUniformLocation(program, "camera_position");
+		lod_count_id = glGetUniformLocation(program, "lod_count");
+		lod_first_id = glGetUniformLocation(program, "lod_first");
+		lod_distance_id = glGetUniformLocation(program, "lod_distance");
+		lod_hysteresis_id = glGetUniformLocation(program, "lod_hysteresis");
+	}
+
+	~InstanceCuller() {
+		glDeleteProgram(program);
+	}
+
+	void begin(const HiZPyramid& hiz, const glm::mat4& VP, const glm::vec3& camera_position, size_t lod_count) {
+		// Instance data is written through persistent non-coherent mappings
+		glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+
+		glUseProgram(program);
+		glUniformMatrix4fv(VP_id, 1, GL_FALSE, &VP[0][0]);
+		glUniformMatrix4fv(hiz_VP_id, 1, GL_FALSE, &hiz.VP[0][0]);
+		glUniform2f(viewport_id, (float)hiz.width, (float)hiz.height);
+		glUniform1i(hiz_levels_id, hiz.valid ? hiz.levels : 0);
+		glUniform1i(occlusion_id, occlusion);
+		glUniform3f(camera_position_id, camera_position.x, camera_position.y, camera_position.z);
+		glUniform1ui(lod_count_id, (GLuint)std::min(lod_count, MAX_LODS));
+		glUniform1fv(lod_distance_id, MAX_LODS - 1, lod_distance);
+		glUniform1f(lod_hysteresis_id, lod_hysteresis);
+		glBindTextureUnit(0, hiz.pyramid());
+	}
+
+	/// Resets the indirect commands of out. Must be called before any cull() into it this frame.
+	void reset(CulledInstances& out, const DrawElementsIndirectCommand (&commands)[CulledInstances::COMMAND_COUNT]) {
+		glNamedBufferSubData(out.commands(), 0, sizeof(commands), commands);
+	}
+
+	/// Appends the visible instances of one range to out. lod_state holds a level per instance of
+	/// the instances buffer, palette is written with every instance of the range. Levels more
+	/// detailed than lod_first are not drawn, for meshes that are still streaming in.
+	void cull(GLuint instances, GLuint lod_state, CulledInstances& out, GLuint command, size_t instance_offset, size_t instance_count,
+		size_t visible_offset, float radius, GLuint palette, size_t lod_first = 0) {
+		if (instance_count == 0)
+			return;
+
+		glUniform1ui(instance_offset_id, (GLuint)instance_offset);
+		glUniform1ui(instance_count_id, (GLuint)instance_count);
+		glUniform1ui(visible_offset_id, (GLuint)visible_offset);
+		glUniform1ui(lod_stride_id, (GLuint)out.capacity);
+		glUniform1ui(command_id, command);
+		glUniform1f(radius_id, radius);
+		glUniform1ui(palette_id, palette);
+		glUniform1ui(lod_first_id, (GLuint)lod_first);
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instances);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, out.visible());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, out.commands());
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, lod_state);
+		glDispatchCompute((GLuint)((instance_count + 63) / 64), 1, 1);
+	}
+
+	void end() {
+		glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+	}
+};
+
+/// Fragment shader invocation and submitted triangle counts from pipeline statistics queries.
+/// Results are read back a few frames late so the query never stalls the pipeline.
+struct PipelineStatistics {
+	static constexpr size_t RING = 4;
+
+	GLQueries<RING> fragment_queries{ GL_FRAGMENT_SHADER_INVOCATIONS };
+	GLQueries<RING> primitive_queries{ GL_PRIMITIVES_SUBMITTED };
+	GLQueries<RING> vertex_queries{ GL_VERTEX_SHADER_INVOCATIONS };
+	size_t frame = 0;
+	GLuint64 fragments = 0;
+	GLuint64 triangles = 0;
+	// Vertices that missed the post-transform cache, see jpraw_opt
+	GLuint64 vertices = 0;
+	// Whether the last end() read a new frame's results
+	bool collected = false;
+
+	void begin() {
+		glBeginQuery(GL_FRAGMENT_SHADER_INVOCATIONS, fragment_queries.queries[frame % RING]);
+		glBeginQuery(GL_PRIMITIVES_SUBMITTED, primitive_queries.queries[frame % RING]);
+		glBeginQuery(GL_VERTEX_SHADER_INVOCATIONS, vertex_queries.queries[frame % RING]);
+	}
+
+	static bool collect(GLuint query, GLuint64& result) {
+		GLint available = GL_FALSE;
+		glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &result);
+		}
+		return available;
+	}
+
+	void end() {
+		glEndQuery(GL_FRAGMENT_SHADER_INVOCATIONS);
+		glEndQuery(GL_PRIMITIVES_SUBMITTED);
+		glEndQuery(GL_VERTEX_SHADER_INVOCATIONS);
+		++frame;
+
+		collected = false;
+		if (frame < RING)
+			return;
+		// Oldest queries still in flight
+		collected = collect(fragment_queries.queries[frame % RING], fragments);
+		collected &= collect(primitive_queries.queries[frame % RING], triangles);
+		collected &= collect(vertex_queries.queries[frame % RING], vertices);
+	}
+};
@@ -0,0 +1,274 @@
+#pragma once
+// Load time conversion of .jpraw sections into what the renderer draws: float attributes and the
+// narrowest index type that holds every index. Files that are already float with 16 or 32 bit
+// indices pass through as spans of the mapping, everything else is converted chunk by chunk while
+// the next chunk is being paged in.
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include "pyo_rawobj.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#ifndef GL_PIPES_SSE
+#define GL_PIPES_SSE 1
+#endif
+#include <immintrin.h>
+#endif
+
+/// Rounds every double to the nearest float, same as static_cast<float>
+inline void narrow_doubles(const double* in, size_t count, float* out) {
+	size_t i = 0;
+#ifdef GL_PIPES_SSE
+	for (; i + 4 <= count; i += 4) {
+		__m128 low = _mm_cvtpd_ps(_mm_loadu_pd(in + i));
+		__m128 high = _mm_cvtpd_ps(_mm_loadu_pd(in + i + 2));
+		_mm_storeu_ps(out + i, _mm_movelh_ps(low, high));
+	}
+#endif
+	for (; i < count; ++i) {
+		out[i] = (float)in[i];
+	}
+}
+
+/// Largest of count indices of index_size bytes each, unaligned
+inline uint64_t max_index(const std::byte* in, size_t index_size, size_t count) {
+	uint64_t result = 0;
+	size_t i = 0;
+	switch (index_size) {
+	case 1:
+		for (; i < count; ++i)
+			result = std::max<uint64_t>(result, (uint8_t)in[i]);
+		break;
+	case 2:
+		for (; i < count; ++i) {
+			uint16_t index;
+			memcpy(&index, in + i * 2, 2);
+			result = std::max<uint64_t>(result, index);
+		}
+		break;
+	case 4: {
+#ifdef GL_PIPES_SSE
+		// SSE2 only has signed compares, flip the sign bit to compare unsigned
+		const __m128i bias = _mm_set1_epi32(INT32_MIN);
+		__m128i biased_max = bias;
+		for (; i + 4 <= count; i += 4) {
+			__m128i value = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + i * 4)), bias);
+			__m128i greater = _mm_cmpgt_epi32(value, biased_max);
+			biased_max = _mm_or_si128(_mm_and_si128(greater, value), _mm_andnot_si128(greater, biased_max));
+		}
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i*)lanes, _mm_xor_si128(biased_max, bias));
+		for (uint32_t lane : lanes)
+			result = std::max<uint64_t>(result, lane);
+#endif
+		for (; i < count; ++i) {
+			uint32_t index;
+			memcpy(&index, in + i * 4, 4);
+			result = std::max<uint64_t>(result, index);
+		}
+		break;
+	}
+	case 8:
+		for (; i < count; ++i) {
+			uint64_t index;
+			memcpy(&index, in + i * 8, 8);
+			result = std::max(result, index);
+		}
+		break;
+	default:
+		throw std::invalid_argument("Unsupported index size");
+	}
+	return result;
+}
+
+/// Repacks count indices of in_size bytes to out_size bytes. Every index must fit out_size.
+inline void repack_indices(const std::byte* in, size_t in_size, size_t count, std::byte* out, size_t out_size) {
+	size_t i = 0;
+#ifdef GL_PIPES_SSE
+	if (in_size == 4 && out_size == 2) {
+		// packs_epi32 saturates signed, so shift into signed range and back
+		const __m128i bias32 = _mm_set1_epi32(0x8000);
+		const __m128i bias16 = _mm_set1_epi16(INT16_MIN);
+		for (; i + 8 <= count; i += 8) {
+			__m128i low = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(in + i * 4)), bias32);
+			__m128i high = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(in + i * 4 + 16)), bias32);
+			_mm_storeu_si128((__m128i*)(out + i * 2), _mm_xor_si128(_mm_packs_epi32(low, high), bias16));
+		}
+	}
+	else if (in_size == 8 && out_size == 4) {
+		// Low halves of four little endian 64 bit values
+		for (; i + 4 <= count; i += 4) {
+			__m128 low = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(in + i * 8)));
+			__m128 high = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(in + i * 8 + 16)));
+			_mm_storeu_ps((float*)(out + i * 4), _mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0)));
+		}
+	}
+	else if (in_size == 1 && out_size == 2) {
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 16 <= count; i += 16) {
+			__m128i bytes = _mm_loadu_si128((const __m128i*)(in + i));
+			_mm_storeu_si128((__m128i*)(out + i * 2), _mm_unpacklo_epi8(bytes, zero));
+			_mm_storeu_si128((__m128i*)(out + i * 2 + 16), _mm_unpackhi_epi8(bytes, zero));
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		// Little endian, the low bytes come first
+		uint64_t index = 0;
+		memcpy(&index, in + i * in_size, in_size);
+		memcpy(out + i * out_size, &index, out_size);
+	}
+}
+
+/// Vertex arrays and indices of a RawobjectReader in GL ready form. Converted sections keep the
+/// file's order, so offsets into them follow from the file offsets.
+struct ConvertedRawobject {
+	// Bytes converted per step, the next step is prefetched meanwhile
+	static constexpr size_t CHUNK_SIZE = 256 * 1024;
+
+	const RawobjectReader& reader;
+	// Floats, or the 16 bit elements of quantised files, laid out like the file's arrays section
+	std::span<const std::byte> arrays;
+	// 16 or 32 bit indices, laid out like the file's index section
+	std::span<const std::byte> indices;
+	size_t index_size = 0;
+
+	ConvertedRawobject(const RawobjectReader& reader) : reader{ reader } {
+		convert_arrays();
+		if (reader.header.indexed()) {
+			convert_indices();
+		}
+	}
+
+	ConvertedRawobject(const ConvertedRawobject&) = delete;
+	ConvertedRawobject& operator=(const ConvertedRawobject&) = delete;
+
+	/// Whether the file could be used as is
+	bool zero_copy() const {
+		return owned_arrays.empty() && owned_indices.empty();
+	}
+
+	/// Offset into arrays of a file offset in the arrays section
+	size_t arrays_offset(size_t file_offset) const {
+		return converted_size(file_offset - reader.arrays_start);
+	}
+
+	/// Size in arrays of a number of bytes of the file's arrays section
+	size_t converted_size(size_t file_size) const {
+		return reader.sizeof_element_t == sizeof(double) ? file_size / 2 : file_size;
+	}
+
+	/// Index of the first index of a sub object, as used by draw commands
+	size_t first_index(size_t subobject) const {
+		return (reader.sub_offsets[subobject].triangles_start - reader.index_start) / reader.sizeof_index_t;
+	}
+
+	/// Index of the first vertex of a sub object in the whole vertex array
+	size_t first_vertex(size_t subobject) const {
+		return (reader.sub_offsets[subobject].verticies_start - reader.offsets.verticies_start) / reader.position_step();
+	}
+
+	/// One attribute of count vertices, file_step bytes apart in the file, planar or interleaved
+	template<typename T>
+	std::vector<T> gather(size_t file_start, size_t file_step, size_t count) const {
+		std::vector<T> values(count);
+		const std::byte* first = arrays.data() + arrays_offset(file_start);
+		size_t step = converted_size(file_step);
+		for (size_t v = 0; v < count; ++v) {
+			memcpy(&values[v], first + v * step, sizeof(T));
+		}
+		return values;
+	}
+
+	template<typename T>
+	std::vector<T> verticies(size_t subobject) const {
+		return gather<T>(reader.sub_offsets[subobject].verticies_start, reader.position_step(), reader.obj_counts[subobject].verticies);
+	}
+
+	template<typename T>
+	std::vector<T> normals(size_t subobject) const {
+		return gather<T>(reader.sub_offsets[subobject].normals_start, reader.normal_step(), reader.obj_counts[subobject].verticies);
+	}
+
+	template<typename T>
+	std::vector<T> uvs(size_t subobject) const {
+		return gather<T>(reader.sub_offsets[subobject].uvs_start, reader.uv_step(), reader.obj_counts[subobject].verticies);
+	}
+
+	/// T must match index_size
+	template<typename T>
+	std::span<const T> triangles(size_t subobject) const {
+		if (sizeof(T) != index_size) {
+			throw std::invalid_argument("Index type does not match the converted indices");
+		}
+		return { reinterpret_cast<const T*>(indices.data()) + first_index(subobject), reader.obj_counts[subobject].triangles * 3 };
+	}
+
+private:
+	std::vector<std::byte> owned_arrays;
+	std::vector<std::byte> owned_indices;
+
+	/// Calls convert(first, count) over [start, start + count * element_size) in CHUNK_SIZE steps,
+	/// asking for the following step to be paged in before converting the current one
+	template<typename F>
+	void streamed(size_t start, size_t count, size_t element_size, F&& convert) {
+		size_t per_chunk = std::max<size_t>(1, CHUNK_SIZE / element_size);
+		for (size_t first = 0; first < count; first += per_chunk) {
+			size_t n = std::min(per_chunk, count - first);
+			size_t next = start + (first + n) * element_size;
+			reader.file.advise(next, std::min(next + CHUNK_SIZE, start + count * element_size), MappedFile::Advice::WillNeed);
+			convert(first, n);
+		}
+	}
+
+	void convert_arrays() {
+		std::span<const std::byte> source = reader.arrays();
+		if (reader.sizeof_element_t != sizeof(double)) {
+			arrays = source;
+			return;
+		}
+		// Double sections are multiples of 8 bytes, so there is no padding to skip
+		size_t count = source.size() / sizeof(double);
+		owned_arrays.resize(count * sizeof(float));
+		const double* in = reinterpret_cast<const double*>(source.data());
+		float* out = reinterpret_cast<float*>(owned_arrays.data());
+		streamed(reader.arrays_start, count, sizeof(double), [&](size_t first, size_t n) {
+			narrow_doubles(in + first, n, out + first);
+		});
+		arrays = owned_arrays;
+	}
+
+	void convert_indices() {
+		size_t in_size = reader.sizeof_index_t;
+		size_t count = reader.counts.triangles * 3;
+		const std::byte* in = reader.indices().data();
+
+		uint64_t largest = 0;
+		if (in_size > 2) {
+			streamed(reader.index_start, count, in_size, [&](size_t first, size_t n) {
+				largest = std::max(largest, max_index(in + first * in_size, in_size, n));
+			});
+		}
+		if (largest > std::numeric_limits<uint32_t>::max()) {
+			throw std::invalid_argument("Index does not fit 32 bits");
+		}
+		// 8 bit indices are widened, hardware handles them poorly
+		index_size = largest > std::numeric_limits<uint16_t>::max() ? 4 : 2;
+
+		if (in_size == index_size) {
+			indices = reader.indices();
+			return;
+		}
+		owned_indices.resize(count * index_size);
+		streamed(reader.index_start, count, in_size, [&](size_t first, size_t n) {
+			repack_indices(in + first * in_size, in_size, n, owned_indices.data() + first * index_size, index_size);
+		});
+		indices = owned_indices;
+	}
+};
@@ -7,13 +7,34 @@
 // Include GLFW
 #include <GLFW/glfw3.h>
 #include <stdexcept>
+#include <chrono>
+#include <cstddef>
+#include <future>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <thread>
 
 #include "common/shader.hpp"
 //#include <common/texture.hpp>
 #include "common/controls.hpp"
 #include "pyoUtils.hpp"
 #include "pyo_rawobj.hpp"
+#include "jpraw_convert.hpp"
+#include "quantise.hpp"
 #include "world.hpp"
+#include "gl_objects.hpp"
+#include "hiz.hpp"
+#include "benchmark.hpp"
+#include "profiler.hpp"
+#include "freezer.hpp"
+#include "resolution.hpp"
+#include "transforms.hpp"
+#include "pipe_render_data.hpp"
+#include "startup.hpp"
+#include "streaming.hpp"
+#include "pacing.hpp"
+#include "capture.hpp"
 #include <stddef.h>
 
 constexpr float PIPE_SCALE = 0.15f;
@@ -39,6 +60,7 @@ constexpr float BALL_SCALE = 0.3f;
 class GLEWTrap {
 public:
 	GLEWTrap() {
+		StartupPhase phase{ "glew" };
 		// Initialize GLEW
 		glewExperimental = true; // Needed for core profile
 		if (glewInit() != GLEW_OK) {
@@ -46,9 +68,82 @@ public:
 		}
 	}
 };
+GLFWwindow* window;
+
+struct AppConfig {
+	// Render offscreen into an FBO from a hidden context and report frame times instead of opening a window
+	bool headless = false;
+	int width = 1024;
+	int height = 768;
+	unsigned seed = std::random_device{}();
+
+	size_t frames = 1000;
+	// World updates happen once every tick_frames frames when headless, instead of once a second
+	size_t tick_frames = 10;
+	// Where the headless frame time report goes, "-" for stdout
+	std::string benchmark_path = "benchmark.json";
+	// Chrome trace output, only written when built with GL_PIPES_PROFILER
+	std::string trace_path = "trace.json";
+	// Linked program binaries are cached here, empty to always compile
+	std::string shader_cache = "shader_cache";
+	// Ball and pipe meshes, as { ball, pipe } pairs per level of detail
+	std::string mesh_path = "tubes.jpraw";
+
+	// Dynamic resolution: GPU frame time to hold and the range the render scale may move in
+	double target_ms = 16.0;
+	float min_scale = 0.5f;
+	float max_scale = 1.0f;
+	// Render at this scale and never adapt, 0 to adapt
+	float fixed_scale = 0;
+
+	// Frames to cross-fade over when a finished world starts over, 0 to cut
+	size_t fade_frames = 60;
+
+	// Read and convert the mesh and read shader sources on loader threads while the window and
+	// context are created, instead of one after the other
+	bool async_load = true;
+	// Startup timeline as a Chrome trace, written once the first frame is done, empty to skip
+	std::string startup_trace_path;
+	// Mesh bytes uploaded per frame, coarsest level of detail first, 0 to upload them all before
+	// the first frame
+	size_t stream_kib = 1024;
+	// Run GLFW's event loop on the main thread and render on a thread of its own, so events are
+	// timestamped as they arrive instead of once per frame
+	bool input_thread = true;
+
+	// Frame pacing: frames start target_fps apart, 0 leaves it to swap_interval alone
+	double target_fps = 0;
+	int swap_interval = 1;
+	// How long before a deadline the pacer stops sleeping and spins
+	double pacing_spin_ms = 2.0;
+	// Apply input right before culling instead of at the start of the frame
+	bool late_latch = false;
+	// Present interval statistics as JSON, written on exit, empty to skip
+	std::string pacing_path;
+
+	// Print culling, resolution, input, pacing and capture statistics every second
+	bool stats = false;
+
+	// Windows onto the same world, each with its own camera. Headless runs only draw the first.
+	size_t views = 1;
+	// Each view full screen on a monitor of its own, as far as there are monitors
+	bool fullscreen = false;
+
+	// Record the first view to this file, Y4M if it ends in .y4m, raw RGB24 otherwise, empty to not
+	std::string capture_path;
+	// Frame rate written into a Y4M header, 0 for target_fps, or 60 without one
+	double capture_fps = 0;
+};
+
 class GLFWTrap {
 public:
-	GLFWTrap() {
+	GLFWTrap(const AppConfig& config) {
+		StartupPhase phase{ "glfw init" };
+#ifdef GLFW_PLATFORM_NULL
+		// No display server is needed for a headless run
+		if (config.headless)
+			glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#endif
 		if (!glfwInit())
 		{
 			throw std::runtime_error("Failed to initialize GLFW");
@@ -59,21 +154,37 @@ public:
 	}
 
 };
-GLFWwindow* window;
 
 class Window {
 public:
 	GLFWwindow* window;
 
-	Window(void* container) {
-		glfwWindowHint(GLFW_SAMPLES, 4);
+	/// share is a window whose context shares its objects with this one's, monitor makes the window
+	/// full screen on it
+	Window(void* container, const AppConfig& config, GLFWwindow* share = nullptr, GLFWmonitor* monitor = nullptr) {
+		StartupPhase phase{ "window" };
+		if (config.headless) {
+			// Hidden window with an OSMesa context, which works on Mesa's llvmpipe without a display.
+			// Everything is drawn into an OffscreenTarget so the default framebuffer is never used.
+			glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+			glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+		}
+		// The scene is drawn into a SceneTarget that handles multisampling itself
+		glfwWindowHint(GLFW_SAMPLES, 0);
 		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
 		glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE); // To make MacOS happy; should not be needed
 		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 		
+		int width = config.width;
+		int height = config.height;
+		if (monitor) {
+			const GLFWvidmode* mode = glfwGetVideoMode(monitor);
+			width = mode->width;
+			height = mode->height;
+		}
 		// Open a window and create its OpenGL context
-		window = glfwCreateWindow(1024, 768, "Tutorial 09 - Rendering several models", NULL, NULL);
+		window = glfwCreateWindow(width, height, "Tutorial 09 - Rendering several models", monitor, share);
 		if (window == NULL)
 			throw std::runtime_error("Failed to open GLFW window.If you have an Intel GPU, they are not 3.3 compatible.Try the 2.1 version of the tutorials.");
 		
@@ -93,59 +204,103 @@ public:
 	}
 };
 
-template<size_t N>
-struct GLBuffers {
-	GLuint buffers[N];
 
-	GLBuffers() {
-		glCreateBuffers(N, buffers);
-	}
-	/*
-	GLBuffers(const GLBuffers& other) = delete; // copy constructor
-	GLBuffers& operator=(const GLBuffers& that) = delete;
-	
-	GLBuffers(GLBuffers&& other) {
-	
-	}
-	GLBuffers& operator=(GLBuffers&& that) {
-
-	}
-	*/
-	~GLBuffers() {
-		glDeleteBuffers(N, buffers);
-	}
+/// Sub objects of tubes.jpraw are stored as { ball, pipe } pairs, one pair per level of detail,
+/// most detailed first.
+enum MeshKind {
+	BALL_MESH = 0,
+	PIPE_MESH = 1,
+	MESH_KIND_COUNT = 2
 };
-class gl_error : std::exception {};
 
-struct GLMapedBuffer {
-	GLuint buffer;
-	void* data;
-	GLMapedBuffer(GLuint buffer, GLintptr offset, GLsizeiptr length, GLbitfield access) : buffer(buffer) {
-		data = glMapNamedBufferRange(buffer, offset, length, access);
-		if (data == NULL) {
-			throw gl_error();
-		}
-	}
-	~GLMapedBuffer() {
-		glUnmapNamedBuffer(buffer);
-	}
+/// std140 layout of the MeshQuantisation block of StandardShading.vertexshader, indexed by
+/// gl_DrawID, which is the CulledInstances command of the draw
+struct MeshQuantisationBlock {
+	glm::vec4 position_offset[CulledInstances::COMMAND_COUNT];
+	glm::vec4 position_scale[CulledInstances::COMMAND_COUNT];
+	GLuint octahedral_normals;
+	GLuint padding[3];
 };
+// std140 strides vec4 arrays by 16 bytes and puts the uint right after them
+static_assert(offsetof(MeshQuantisationBlock, position_offset) == 0);
+static_assert(offsetof(MeshQuantisationBlock, position_scale) == CulledInstances::COMMAND_COUNT * 16);
+static_assert(offsetof(MeshQuantisationBlock, octahedral_normals) == CulledInstances::COMMAND_COUNT * 32);
+static_assert(sizeof(MeshQuantisationBlock) == CulledInstances::COMMAND_COUNT * 32 + 16);
+constexpr GLuint MESH_QUANTISATION_BINDING = 2;
+
+/// The part of loading StaticMeshes that needs no context: the mapped and converted file, the CPU
+/// copy of the most detailed ball and pipe and the quantisation block. Built on a loader thread
+/// while the window and context are created, then kept until StaticMeshes has streamed it in.
+struct MeshAsset {
+	RawobjectReader file;
+	// Doubles and 8 or 64 bit indices are narrowed, float files with 16 or 32 bit indices are used as is
+	ConvertedRawobject converted;
+	// Level of detail 0 only, the coarser levels are only ever drawn
+	std::vector<MeshData> subMeshes;
+	std::vector<float> subRadius;
+	MeshQuantisationBlock quantisation{};
+	size_t lodCount;
+
+	MeshAsset(const std::string& path) : file{ path.c_str() }, converted{ file } {
+		if (!file.header.indexed() || !file.header.hasNormal()) {
+			throw std::invalid_argument(path + " must be indexed and have normals");
+		}
+		if (file.header.obj_count % MESH_KIND_COUNT != 0) {
+			throw std::invalid_argument(path + " must hold ball and pipe pairs");
+		}
+		bool quantised = file.header.quantised();
+
+		for (size_t i = 0; i < std::min<size_t>(file.sub_offsets.size(), MESH_KIND_COUNT); ++i) {
+			MeshData& mesh = subMeshes.emplace_back();
+			if (quantised) {
+				for (const QuantisedPosition& position : converted.verticies<QuantisedPosition>(i))
+					mesh.positions.push_back(dequantise_position(position, file.quantisation[i]));
+				for (const OctahedralNormal& normal : converted.normals<OctahedralNormal>(i))
+					mesh.normals.push_back(decode_octahedral(normal));
+			}
+			else {
+				mesh.positions = converted.verticies<glm::vec3>(i);
+				mesh.normals = converted.normals<glm::vec3>(i);
+			}
 
-template<size_t N>
-struct VertexArrays {
-	GLuint vertex_arrays[N];
-
-	VertexArrays() {
-		glGenVertexArrays(N, vertex_arrays);
-	}
+			// Indices in the file address the whole vertex array
+			GLuint base_vertex = (GLuint)converted.first_vertex(i);
+			auto rebase = [&](auto indices) {
+				for (GLuint index : indices) {
+					mesh.indices.push_back(index - base_vertex);
+				}
+			};
+			if (converted.index_size == sizeof(GLushort))
+				rebase(converted.triangles<GLushort>(i));
+			else
+				rebase(converted.triangles<GLuint>(i));
+
+			float radius = 0;
+			for (const glm::vec3& position : mesh.positions) {
+				radius = std::max(radius, glm::length(position));
+			}
+			subRadius.push_back(radius);
+		}
 
-	~VertexArrays() {
-		glDeleteVertexArrays(N, vertex_arrays);
+		lodCount = std::min<size_t>(file.header.obj_count / MESH_KIND_COUNT, MAX_LODS);
+		quantisation.octahedral_normals = quantised;
+		for (size_t lod = 0; lod < lodCount; ++lod) {
+			for (MeshKind kind : { PIPE_MESH, BALL_MESH }) {
+				GLuint command = CulledInstances::command(kind, lod);
+				quantisation.position_scale[command] = glm::vec4(1);
+				if (quantised) {
+					// StaticMeshes::subobject
+					const Quantisation& q = file.quantisation[lod * MESH_KIND_COUNT + kind];
+					quantisation.position_offset[command] = glm::vec4(q.offset[0], q.offset[1], q.offset[2], 0);
+					quantisation.position_scale[command] = glm::vec4(q.scale[0], q.scale[1], q.scale[2], 0);
+				}
+			}
+		}
 	}
 };
 
 struct StaticMeshes {
-	GLBuffers<2> buffers;
+	GLBuffers<3> buffers;
 	//size_t instance_count;
 
 	size_t verticies_size;
@@ -155,6 +310,12 @@ struct StaticMeshes {
 	size_t vertices_offset;
 	size_t normals_offset;
 	size_t uvs_offset;
+	// Bytes per vertex of the position and normal arrays in the VBO
+	size_t position_stride;
+	size_t normal_stride;
+	// Bytes per vertex record when positions and normals are interleaved, 0 when planar
+	size_t vertex_stride;
+	bool quantised;
 
 	size_t VBO_size;
 	size_t IBO_size;
@@ -168,8 +329,27 @@ struct StaticMeshes {
 	//GLMapedBuffer MInstanceBuffer;
 	*/
 	size_t numElements;
+	// GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, whichever the converted indices are
+	GLenum indexType;
 	std::vector<size_t> numSubElements;
+	// First index of each sub object
 	std::vector<size_t> subOffsets;
+	// Bounding sphere radius of the level 0 sub objects around their origin
+	std::vector<float> subRadius;
+	// CPU copy of the level 0 sub objects, for baking
+	std::vector<MeshData> subMeshes;
+	size_t lodCount;
+
+	// Streams asset into VBO and IBO, coarsest level first; both are released once everything is
+	// resident
+	std::unique_ptr<MeshAsset> asset;
+	std::unique_ptr<StreamingUploader> uploader;
+	// Process start to construction, for the startup timeline
+	double stream_start_ms;
+
+	static constexpr size_t subobject(MeshKind kind, size_t lod) {
+		return lod * MESH_KIND_COUNT + kind;
+	}
 
 	VertexArrays<1> vertex_arrays;
 
@@ -185,55 +365,81 @@ struct StaticMeshes {
 		return buffers.buffers[1];
 	}
 
-	/*(constexpr GLuint InstanceBuffer() const {
+	/// MeshQuantisationBlock, identity for float files
+	constexpr GLuint QuantisationUBO() const {
 		return buffers.buffers[2];
-	}*/
+	}
 
-	StaticMeshes() : buffers{}{
-		
-		RawobjectReader monkey{ "tubes.jpraw" };
-		assert(monkey.sizeof_index_t == 2);
-		assert(monkey.sizeof_element_t == 4);
-		assert(monkey.header.indexed());
-		assert(monkey.header.hasNormal());
-		//assert(monkey.header.hasUV());
+	void bind_quantisation() const {
+		glBindBufferBase(GL_UNIFORM_BUFFER, MESH_QUANTISATION_BINDING, QuantisationUBO());
+	}
 
+	/*(constexpr GLuint InstanceBuffer() const {
+		return buffers.buffers[2];
+	}*/
 
-		verticies_size = monkey.offsets.verticies_end - monkey.offsets.verticies_start;
+	/// Takes the CPU copies of loaded and queues its sub objects for stream(), through staging
+	/// slots of slot_size bytes
+	StaticMeshes(std::unique_ptr<MeshAsset> loaded, size_t slot_size) : buffers{}, asset{ std::move(loaded) } {
+		StartupPhase phase{ "allocate meshes" };
+		stream_start_ms = ms_since_process_start();
+		const RawobjectReader& monkey = asset->file;
+		const ConvertedRawobject& converted = asset->converted;
+		indexType = converted.index_size == sizeof(GLushort) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+		quantised = monkey.header.quantised();
+		position_stride = quantised ? sizeof(QuantisedPosition) : sizeof(glm::vec3);
+		normal_stride = quantised ? sizeof(OctahedralNormal) : sizeof(glm::vec3);
+		vertex_stride = converted.converted_size(monkey.vertex_stride);
+
+		verticies_size = converted.arrays_offset(monkey.offsets.verticies_end) - converted.arrays_offset(monkey.offsets.verticies_start);
 		//uvs_size = monkey.offsets.uvs_end - monkey.offsets.uvs_start;
-		normals_size = monkey.offsets.normals_end - monkey.offsets.normals_start;
+		normals_size = converted.arrays_offset(monkey.offsets.normals_end) - converted.arrays_offset(monkey.offsets.normals_start);
 
 		vertices_offset = 0;
-		normals_offset = monkey.offsets.normals_start - monkey.offsets.verticies_start;
+		normals_offset = converted.arrays_offset(monkey.offsets.normals_start) - converted.arrays_offset(monkey.offsets.verticies_start);
 		//uvs_offset = monkey.offsets.uvs_start - monkey.offsets.verticies_start;
 
 
-		VBO_size = monkey.arrays_end - monkey.arrays_start;
-		IBO_size = monkey.index_end - monkey.index_start;
+		VBO_size = converted.arrays.size();
+		IBO_size = converted.indices.size();
 
 		numElements = (monkey.counts.triangles);
 
-		glNamedBufferStorage(VBO(), VBO_size, nullptr, GL_MAP_WRITE_BIT);
-		glNamedBufferStorage(IBO(), IBO_size, nullptr, GL_MAP_WRITE_BIT);
-
-		GLMapedBuffer MVBO(VBO(), 0, VBO_size, GL_MAP_WRITE_BIT);
-		GLMapedBuffer MIBO(IBO(), 0, IBO_size, GL_MAP_WRITE_BIT);
-		//GLMapedBuffer MInstanceBuffer();
-
-		monkey.file.tseek((long)monkey.index_start, SEEK_SET);
-		monkey.file.tread(MIBO.data, 1, IBO_size);
+		// Filled by stream(), straight from the file mapping when nothing had to be converted
+		glNamedBufferStorage(VBO(), VBO_size, nullptr, 0);
+		glNamedBufferStorage(IBO(), IBO_size, nullptr, 0);
 
-
-		monkey.file.tseek((long)monkey.arrays_start, SEEK_SET);
-		monkey.file.tread(MVBO.data, 1, VBO_size);
-		
 		//numSubElements.resize(monkey.header.obj_count);
 		for (auto count : monkey.obj_counts) {
 			numSubElements.push_back(count.triangles);
 		}
 
-		for (const auto& offset : monkey.sub_offsets) {
-			subOffsets.push_back(offset.triangles_start - monkey.index_start);
+		for (size_t i = 0; i < monkey.sub_offsets.size(); ++i) {
+			subOffsets.push_back(converted.first_index(i));
+		}
+
+		subMeshes = std::move(asset->subMeshes);
+		subRadius = std::move(asset->subRadius);
+		lodCount = asset->lodCount;
+		glNamedBufferStorage(QuantisationUBO(), sizeof(asset->quantisation), &asset->quantisation, 0);
+
+		uploader = std::make_unique<StreamingUploader>(slot_size, monkey.header.obj_count, converted.zero_copy() ? &monkey.file : nullptr);
+		for (size_t lod = lodCount; lod-- > 0;) {
+			for (MeshKind kind : { PIPE_MESH, BALL_MESH }) {
+				size_t sub = subobject(kind, lod);
+				const Subobject& offsets = monkey.sub_offsets[sub];
+				size_t first = converted.first_index(sub) * converted.index_size;
+				uploader->add(converted.indices.data() + first, IBO(), first, numSubElements[sub] * 3 * converted.index_size, sub);
+				// Records hold everything when interleaved, otherwise positions and normals are
+				// separate ranges; uvs are never drawn
+				auto add_vertices = [&](size_t start, size_t end) {
+					size_t offset = converted.arrays_offset(start);
+					uploader->add(converted.arrays.data() + offset, VBO(), offset, converted.converted_size(end - start), sub);
+				};
+				add_vertices(offsets.verticies_start, offsets.verticies_end);
+				if (!vertex_stride)
+					add_vertices(offsets.normals_start, offsets.normals_end);
+			}
 		}
 
 		glBindVertexArray(vertex_array());
@@ -251,26 +457,27 @@ struct StaticMeshes {
 
 		//glEnableVertexAttribArray(2);
 
-		// 1st attribute buffer : verticies
-		glVertexAttribPointer(
-			0,								  // attribute
-			3,								  // size
-			GL_FLOAT,						  // type
-			GL_FALSE,						  // normalized?
-			0,								  // stride
-			(void*)vertices_offset            // array buffer offset
-		);
-
-		// 2rd attribute buffer : normals
-		glVertexAttribPointer(
-			1,                                // attribute
-			3,                                // size
-			GL_FLOAT,                         // type
-			GL_FALSE,                         // normalized?
-			0,                                // stride
-			(void*)normals_offset             // array buffer offset
-		);
+		// 1st attribute : verticies, unorm16 in [0, 1] when quantised, see MeshQuantisationBlock
+		// 2nd attribute : normals, octahedral snorm16 pairs when quantised
+		GLuint vao = vertex_array();
+		if (vertex_stride) {
+			// One stream, a vertex fetch touches a single record
+			glVertexArrayAttribFormat(vao, 0, 3, quantised ? GL_UNSIGNED_SHORT : GL_FLOAT, quantised, (GLuint)vertices_offset);
+			glVertexArrayAttribFormat(vao, 1, quantised ? 2 : 3, quantised ? GL_SHORT : GL_FLOAT, quantised, (GLuint)normals_offset);
+			glVertexArrayAttribBinding(vao, 0, 0);
+			glVertexArrayAttribBinding(vao, 1, 0);
+			glVertexArrayVertexBuffer(vao, 0, VBO(), 0, (GLsizei)vertex_stride);
+		}
+		else {
+			glVertexArrayAttribFormat(vao, 0, 3, quantised ? GL_UNSIGNED_SHORT : GL_FLOAT, quantised, 0);
+			glVertexArrayAttribFormat(vao, 1, quantised ? 2 : 3, quantised ? GL_SHORT : GL_FLOAT, quantised, 0);
+			glVertexArrayAttribBinding(vao, 0, 0);
+			glVertexArrayAttribBinding(vao, 1, 1);
+			glVertexArrayVertexBuffer(vao, 0, VBO(), (GLintptr)vertices_offset, (GLsizei)position_stride);
+			glVertexArrayVertexBuffer(vao, 1, VBO(), (GLintptr)normals_offset, (GLsizei)normal_stride);
+		}
 
+		// Culled VisibleInstance records
 		//glBindBuffer(GL_ARRAY_BUFFER, InstanceBuffer());
 		glVertexAttribFormat(2, 4, GL_FLOAT, GL_FALSE, 0);
 		glVertexAttribFormat(3, 4, GL_FLOAT, GL_FALSE, sizeof(float) * 4);
@@ -281,6 +488,11 @@ struct StaticMeshes {
 		glVertexAttribBinding(3, 2);
 		glVertexAttribBinding(4, 2);
 		glVertexAttribBinding(5, 2);
+
+		// Palette index of the instance's pipe
+		glEnableVertexAttribArray(6);
+		glVertexAttribIFormat(6, 1, GL_UNSIGNED_INT, offsetof(VisibleInstance, palette));
+		glVertexAttribBinding(6, 2);
 		
 		glVertexBindingDivisor(2, 1);
 
@@ -307,44 +519,120 @@ struct StaticMeshes {
 	}
 
 
+	/// Uploads up to budget bytes of what isn't resident yet, everything if budget is 0
+	void stream(size_t budget) {
+		if (!uploader)
+			return;
+		if (budget == 0)
+			uploader->finish();
+		else
+			uploader->pump(budget);
+		if (uploader->complete()) {
+			StartupTimeline::get().record("stream meshes", "main", stream_start_ms, ms_since_process_start());
+			uploader.reset();
+			asset.reset();
+		}
+	}
+
+	/// Whether a sub object can be drawn
+	bool resident(size_t sub) const {
+		return !uploader || uploader->complete(sub);
+	}
+
+	/// Most detailed level of kind from which every coarser level is resident, lodCount if none is
+	size_t first_resident_lod(MeshKind kind) const {
+		size_t lod = lodCount;
+		while (lod > 0 && resident(subobject(kind, lod - 1)))
+			--lod;
+		return lod;
+	}
+
+	/// Fraction of the mesh bytes uploaded
+	double progress() const {
+		return uploader ? uploader->progress() : 1.0;
+	}
+
 	~StaticMeshes() {
 	}
 };
 
 struct Uniforms {
-	
-	GLuint PerspectiveID;
-	GLuint ViewMatrixID;
-	GLuint ColorID;
 
 	// Get a handle for our "myTextureSampler" uniform
 	GLuint TextureID;
 
-	// Get a handle for our "LightPosition" uniform
-	GLuint LightID;
-
 	Uniforms(GLuint programID) {
-		PerspectiveID = glGetUniformLocation(programID, "P");
-		ViewMatrixID = glGetUniformLocation(programID, "V");
-		ColorID = glGetUniformLocation(programID, "pipe_color");
-
-
 		// Get a handle for our "myTextureSampler" uniform
 		TextureID = glGetUniformLocation(programID, "myTextureSampler");
+	}
+};
+
+/// std140 layout of the FrameUniforms block every program declares at FRAME_UNIFORMS_BINDING
+struct FrameUniformBlock {
+	glm::mat4 VP;
+	glm::vec4 LightPosition_worldspace;
+	glm::vec4 EyePosition_worldspace;
+};
+constexpr GLuint FRAME_UNIFORMS_BINDING = 0;
+
+/// Camera and light, uploaded once per frame instead of per program and per draw
+struct FrameUniforms {
+	GLBuffers<1> buffer;
 
-		// Get a handle for our "LightPosition" uniform
-		LightID = glGetUniformLocation(programID, "LightPosition_worldspace");
+	FrameUniforms() {
+		glNamedBufferStorage(buffer.buffers[0], sizeof(FrameUniformBlock), nullptr, GL_DYNAMIC_STORAGE_BIT);
+	}
 
+	void update(const FrameUniformBlock& block) {
+		glNamedBufferSubData(buffer.buffers[0], 0, sizeof(FrameUniformBlock), &block);
+		glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, buffer.buffers[0]);
+	}
+};
+
+// Must match the Palette block of StandardShading.vertexshader
+constexpr size_t MAX_PALETTE = 256;
+constexpr GLuint PALETTE_BINDING = 1;
+
+/// Pipe colours as a std140 uniform block indexed by the palette index of each instance, so
+/// instances of every pipe can share one draw
+struct PipePalette {
+	GLBuffers<1> buffer;
+
+	std::vector<glm::vec4> padded;
+
+	PipePalette(const std::vector<glm::vec3>& colors) : padded(colors.size()) {
+		if (colors.size() > MAX_PALETTE) {
+			throw std::invalid_argument("More pipe colours than palette entries");
+		}
+		glNamedBufferStorage(buffer.buffers[0], (GLsizeiptr)(MAX_PALETTE * sizeof(glm::vec4)), nullptr, GL_DYNAMIC_STORAGE_BIT);
+		update(colors);
+	}
+
+	void update(const std::vector<glm::vec3>& colors) {
+		for (size_t i = 0; i < padded.size(); ++i) {
+			padded[i] = glm::vec4(colors[i], 1);
+		}
+		glNamedBufferSubData(buffer.buffers[0], 0, (GLsizeiptr)(padded.size() * sizeof(glm::vec4)), padded.data());
+	}
+
+	void bind() {
+		glBindBufferBase(GL_UNIFORM_BUFFER, PALETTE_BINDING, buffer.buffers[0]);
 	}
 };
 
 struct Program {
 	GLuint programID;
 	Uniforms uniforms;
-	Program() : programID(LoadShaders("StandardShading.vertexshader", "StandardShading.fragmentshader")), uniforms(programID) {
+	Program(const char* vertex_file_path = "StandardShading.vertexshader", const char* fragment_file_path = "StandardShading.fragmentshader") :
+		programID(LoadShaders(vertex_file_path, fragment_file_path, defines().c_str())), uniforms(programID) {
 
 	}
 
+	/// Sizes the shaders share with the C++ side
+	static std::string defines() {
+		return "#define COMMAND_COUNT " + std::to_string(CulledInstances::COMMAND_COUNT) + "\n";
+	}
+
 	void use() {
 		glUseProgram(programID);
 	}
@@ -361,135 +649,201 @@ struct Texture {
 	}
 };
 */
-struct BufferStorageHelper{
-	BufferStorageHelper(GLuint buffer, size_t size) {
-		glNamedBufferStorage(buffer, (GLsizeiptr)size, nullptr, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT);
-	}
+// Every shader file a program is built from, read ahead by PreloadShaderFiles
+constexpr const char* SHADER_FILES[] = {
+	"StandardShading.vertexshader", "StandardShading.fragmentshader", "BakedShading.vertexshader",
+	"HiZDownsample.computeshader", "HiZCull.computeshader", "Fullscreen.vertexshader", "PostProcess.fragmentshader",
 };
 
-struct PipeRenderData {
-	size_t numBalls = 0;
-	size_t numPipes = 0;
-	size_t buffer_size;
-	GLBuffers<1> buffer;
-	BufferStorageHelper _helper;
-	GLMapedBuffer mbuffer;
-	void* nextBall;
-	void* nextPipe;
-	PipeRenderData(size_t buffer_size) : buffer_size{ buffer_size }, _helper{ buffer.buffers[0], buffer_size * sizeof(glm::mat4)},
-		mbuffer{ buffer.buffers[0], 0, (GLsizeiptr)(buffer_size*sizeof(glm::mat4)), GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_FLUSH_EXPLICIT_BIT} {
-		nextPipe = mbuffer.data;
-		nextBall = (char*)mbuffer.data + ((buffer_size - 1) * sizeof(glm::mat4));
-
+/// File reads started at process start, before there is a window. App collects them once it has
+/// a context to upload into. Without async_load they run when collected, in constructor order.
+struct AssetLoads {
+	std::future<std::unique_ptr<MeshAsset>> meshes;
 
+	AssetLoads(const AppConfig& config) {
+		std::launch policy = config.async_load ? std::launch::async : std::launch::deferred;
+		if (config.async_load) {
+			PreloadShaderFiles(SHADER_FILES, (int)std::size(SHADER_FILES));
+		}
+		meshes = std::async(policy, [path = config.mesh_path, thread = config.async_load ? "meshes" : "main"] {
+			StartupPhase phase{ "load " + path, thread };
+			return std::make_unique<MeshAsset>(path);
+		});
 	}
 
-	
-	void addPipe(glm::vec3 center, Direction dir) {
-		if (nextBall < nextPipe) {
-			// todo, reallocate
-			throw std::runtime_error("out of buffer space");
-		}
-		glm::mat4 M = glm::translate(glm::identity<glm::mat4>(), center);
+	/// Waits for the mesh loader, rethrowing whatever it threw
+	std::unique_ptr<MeshAsset> take_meshes() {
+		StartupPhase phase{ "wait for meshes" };
+		return meshes.get();
+	}
+};
 
-		switch (dir) {
-		case Direction::North:
-		case Direction::South:
-			M = glm::rotate(M, glm::radians<float>(90), glm::vec3{ 1, 0, 0 });
-			break;
-		case Direction::East:
-		case Direction::West:
-			M = glm::rotate(M, glm::radians<float>(90), glm::vec3{ 0, 0, 1 });
-			break;
-		case Direction::Up:
-		case Direction::Down:
-			break;
+// Size of the pipe volume and the most pipes in it, which pick the integer types of its cells
+using WorldBounds = GridBounds<20, 20, 20, 4>;
 
-		default:
-			unreachable();
+/// One viewpoint onto the shared world. Every view is culled and drawn in the primary context,
+/// which owns the meshes, instance buffers, programs and baked scene, so a view only holds what
+/// depends on its camera. A secondary view's window has a context of its own, sharing objects
+/// with the primary one, that only blits the finished frame out of output and presents it.
+struct View {
+	// Null for the primary view, whose window App creates before GLEW
+	std::unique_ptr<Window> own_window;
+	GLFWwindow* window;
+	Camera<relative_this(View, camera)> camera;
+	HiZPyramid hiz;
+	// Visible instances of every live pipe from this camera
+	CulledInstances culled;
+	PipelineStatistics statistics;
+	SceneTarget scene;
+	ResolutionController resolution;
+	// Only feeds the resolution controller, samples aren't kept
+	FrameTimer timer;
+	// Frames left in the cross-fade from the last generation, and its render scale
+	size_t fade_remaining = 0;
+	glm::vec2 fade_uv_scale{ 1 };
+	// Written by the event loop, glfwGetFramebufferSize may only be called on the main thread
+	std::atomic<int> framebuffer_width{ 0 };
+	std::atomic<int> framebuffer_height{ 0 };
+
+	// Secondary views only: the finished frame, a renderbuffer shared with the view's context, and
+	// how often it has been reallocated
+	std::optional<OffscreenTarget> output;
+	size_t output_generation = 0;
+	// Read framebuffer over output in the view's own context, created there since framebuffers
+	// aren't shared. Not deleted here, destroying the window's context frees it.
+	GLuint present_framebuffer = 0;
+	size_t present_generation = 0;
+
+	/// capacity is the initial instance capacity of culled
+	View(const AppConfig& config, size_t capacity, GLFWwindow* window, std::unique_ptr<Window> own = nullptr, GLuint present_framebuffer = 0) :
+		own_window{ std::move(own) }, window{ window }, camera{ window }, culled{ capacity }, present_framebuffer{ present_framebuffer } {
+		timer.record = false;
+		resolution.target_ms = config.target_ms;
+		resolution.min_scale = config.min_scale;
+		resolution.max_scale = config.max_scale;
+		if (config.fixed_scale > 0) {
+			resolution.adaptive = false;
+			resolution.scale = config.fixed_scale;
+		}
+		else {
+			resolution.scale = config.max_scale;
 		}
-		M = glm::scale(M, glm::vec3{1,  6.6667f, 1 });
-
 
-		memcpy(nextPipe, &M, sizeof(glm::mat4));
-		glFlushMappedBufferRange(buffer.buffers[0], numPipes * sizeof(glm::mat4), sizeof(glm::mat4));
-		++numPipes;
-		nextPipe = (void*)((char*)nextPipe + sizeof(glm::mat4));
-	}
-	GLsizeiptr ball_offset() {
-		return (buffer_size - numBalls) * sizeof(glm::mat4);
+		glfwSetWindowUserPointer(window, this);
+		int width, height;
+		glfwGetFramebufferSize(window, &width, &height);
+		framebuffer_width = width;
+		framebuffer_height = height;
+		glfwSetFramebufferSizeCallback(window, [](GLFWwindow* window, int width, int height) {
+			View* view = static_cast<View*>(glfwGetWindowUserPointer(window));
+			view->framebuffer_width = width;
+			view->framebuffer_height = height;
+		});
 	}
-	void addBend(glm::vec3 center, Direction start, Direction end) {
 
+	bool primary() const {
+		return own_window == nullptr;
 	}
 
-	void addFirstPipe(glm::vec3 center, Direction dir) {
-
+	/// Framebuffer to draw the finished frame into, in the primary context
+	GLuint target(int width, int height) {
+		if (primary())
+			return 0;
+		if (!output || output->width != width || output->height != height) {
+			output.reset();
+			output.emplace(width, height);
+			++output_generation;
+		}
+		return output->framebuffer();
 	}
 
-	void addBall(glm::vec3 center) {
-		if (nextBall < nextPipe) {
-			// todo, reallocate
-			throw std::runtime_error("out of buffer space");
+	/// Copies output to the window and swaps, with the view's context current. rendered is a fence
+	/// after the primary context drew output.
+	void present(GLsync rendered) {
+		if (!output)
+			return;
+		if (present_generation != output_generation) {
+			glNamedFramebufferRenderbuffer(present_framebuffer, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, output->renderbuffers[0]);
+			present_generation = output_generation;
 		}
-		glm::mat4 M = glm::translate(glm::identity<glm::mat4>(), center);
-		memcpy(nextBall, &M, sizeof(glm::mat4));
-		glFlushMappedBufferRange(buffer.buffers[0], (char*)nextBall - (char*)mbuffer.data, sizeof(glm::mat4));
-		nextBall = (void*)((char*)nextBall - sizeof(glm::mat4));
-		++numBalls;
+		glWaitSync(rendered, 0, GL_TIMEOUT_IGNORED);
+		glBlitNamedFramebuffer(present_framebuffer, 0, 0, 0, output->width, output->height, 0, 0, output->width, output->height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glfwSwapBuffers(window);
 	}
-
 };
+
 class App {
 public:
+	using RenderData = PipeRenderData<WorldBounds>;
 	static constexpr size_t BUFFER_INIT_SIZE = 128;
-	PipeUpdateData update_data;
+	// Staging slot size of mesh streaming
+	static constexpr size_t STREAM_SLOT_SIZE = 256 * 1024;
+	AppConfig config;
+	PipeUpdateData<WorldBounds> update_data;
+	// Straight sections a pipe gained this tick, written to its buffer in one batch
+	std::vector<SegmentInstance> new_segments;
 	GLFWTrap glfw_trap;
 	Window window;
 	GLEWTrap glew_trap;
-	Camera<relative_this(App, camera)> camera;
 	Program program;
+	Program baked_program;
 	//Texture texture;
 	StaticMeshes meshes;
-	World world{ 20, 20, 20, 4 };
-	std::vector< PipeRenderData> pipe_render_data;
-	std::vector<glm::mat4> pipe_data;
+	HiZBuilder hiz_builder;
+	InstanceCuller culler;
+	PostProcess post_process;
+	FrameUniforms frame_uniforms;
+	glm::vec3 light_position{ 4, 4, 4 };
+	World<WorldBounds> world;
+	PipePalette palette;
+	PipeFreezer freezer;
+	BakedScene baked;
+	// Process start to the first frame being finished, 0 until then
+	double startup_ms = 0;
+	// Process start to the end of the constructor
+	double constructed_ms = 0;
+	// The primary view, drawn into window, then one per extra window
+	std::vector<std::unique_ptr<View>> views;
+	// Indexed by pipe id, null once the pipe has been frozen into baked
+	std::vector<std::unique_ptr<RenderData>> pipe_render_data;
+	// Render data of frozen pipes, reused for new pipes
+	std::vector<std::unique_ptr<RenderData>> render_pool;
+	// Set once the event loop is done, for a render thread
+	std::atomic<bool> stop_rendering{ false };
+	InputLatency input_latency;
+	FramePacer pacer{ config.target_fps, config.pacing_spin_ms };
+	// Refresh the camera in draw_frame, right before it is used
+	bool latch_camera = false;
+	// Null unless capturing
+	std::unique_ptr<FrameCapture> capture;
 	void setupInput() {
 		// Ensure we can capture the escape key being pressed below
 		//glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
 		// Hide the mouse and enable unlimited mouvement
-		glfwSetWindowUserPointer(window, this);
 		//glfwPollEvents();
 
-
-	}
-
-	void make_ball_joint(size_t pipe_id, glm::uvec3 node){
-		/*
-		PipeRenderData prd = pipe_render_data[pipe_id];
-		size_t lower_bound;
-		if (pipe_id == 0) {
-			lower_bound = 1;
-		}
-		else {
-			lower_bound = pipe_render_data[pipe_id - 1].base - (pipe_render_data[pipe_id - 1].numPipes + 1);
-		}
-
-		size_t tail = prd.base - prd.numBalls;
-		if (tail == lower_bound) {
-			/// todo, realloc
-			throw std::runtime_error("can't allocate new pipe ball");
+		// Each view points its window at itself, for its camera and size callbacks
+		views.push_back(std::make_unique<View>(config, BUFFER_INIT_SIZE, window));
+		if (config.headless)
+			return;
+		int monitor_count = 0;
+		GLFWmonitor** monitors = glfwGetMonitors(&monitor_count);
+		for (size_t i = 1; i < config.views; ++i) {
+			GLFWmonitor* monitor = config.fullscreen && i < (size_t)monitor_count ? monitors[i] : nullptr;
+			auto own = std::make_unique<Window>(nullptr, config, window, monitor);
+			if (!config.fullscreen && i < (size_t)monitor_count) {
+				int x, y, width, height;
+				glfwGetMonitorWorkarea(monitors[i], &x, &y, &width, &height);
+				glfwSetWindowPos(*own, x, y);
+			}
+			// Only the primary window waits for vertical blank, or every view would wait in turn
+			glfwSwapInterval(0);
+			GLuint present_framebuffer;
+			glCreateFramebuffers(1, &present_framebuffer);
+			glfwMakeContextCurrent(window);
+			GLFWwindow* view_window = *own;
+			views.push_back(std::make_unique<View>(config, BUFFER_INIT_SIZE, view_window, std::move(own), present_framebuffer));
 		}
-		prd.numBalls += 1;
-		tail -= 1;
-		glm::mat4 pos = glm::translate(glm::mat4(), glm::vec3(node));
-		memcpy((char*)meshes.MInstanceBuffer.data + (tail * sizeof(glm::mat4)), &pos, sizeof(glm::mat4));
-		glFlushMappedBufferRange(meshes.InstanceBuffer(), (tail * sizeof(glm::mat4)), sizeof(glm::mat4));
-		*/
-	}
-	void make_pipe_section(size_t pipe_id, Direction dir, glm::uvec3 node) {
-		PipeRenderData prd = pipe_render_data[pipe_id];
-		size_t upper_bound;
 	}
 
 	void setupGL() {
@@ -504,142 +858,596 @@ public:
 		// Cull triangles which normal is not towards the camera
 		glEnable(GL_CULL_FACE);
 	}
-	App() : glfw_trap{}, window{ this }, glew_trap{}, camera{ window }, program{}, meshes{ }, pipe_data{ 100 }{
+	App(const AppConfig& config, AssetLoads& loads) : config{ config }, glfw_trap{ config },
+		window{ this, config, nullptr, config.fullscreen && !config.headless ? glfwGetPrimaryMonitor() : nullptr }, glew_trap{}, program{}, baked_program{ "BakedShading.vertexshader", "StandardShading.fragmentshader" }, meshes{ loads.take_meshes(), STREAM_SLOT_SIZE },
+		world{ config.seed }, palette{ world.colors },
+		freezer{ world.bounds, meshes.subMeshes[StaticMeshes::subobject(PIPE_MESH, 0)], meshes.subMeshes[StaticMeshes::subobject(BALL_MESH, 0)] },
+		baked{ freezer.region_count() } {
 		// Initialise GLFW
 		pipe_render_data.reserve(world.max_pipes);
 		setupInput();
 		setupGL();
+
+		if (config.stream_kib == 0) {
+			meshes.stream(0);
+		}
+		if (!config.capture_path.empty()) {
+			double fps = config.capture_fps > 0 ? config.capture_fps : config.target_fps > 0 ? config.target_fps : 60;
+			capture = std::make_unique<FrameCapture>(config.capture_path, fps);
+		}
+		constructed_ms = ms_since_process_start();
 	}
 	void update_world() {
+		PROFILE_ZONE("update_world");
 		if (!world.is_gen_complete()) {
 			for (int i = 0; i < world.pipe_count(); ++i) {
 				if (!world.is_pipe_alive(i))
 					continue;
 				world.pipe_update(update_data, i);
+				RenderData& prd = *pipe_render_data[i];
+				new_segments.clear();
 
 				switch (update_data.type) {
 				case PipeUpdataType::NOP:
 					break;
 				case PipeUpdataType::PIPE_STRAIGHT:{
-					PipeStraightData& straightData = update_data.data.pipeStraightData;
-					pipe_render_data[i].addPipe(straightData.current_node, straightData.current_dir);
+					auto& straightData = update_data.data.pipeStraightData;
+					new_segments.push_back({ RenderData::cell_center(straightData.current_node), straightData.current_dir });
 					break;
 				}
 				case PipeUpdataType::PIPE_BEND: {
-					PipeBendData& bendData = update_data.data.pipeBendData;
-					pipe_render_data[i].addBall(bendData.last_node);
-					pipe_render_data[i].addPipe(bendData.current_node, bendData.current_dir);
+					auto& bendData = update_data.data.pipeBendData;
+					prd.addBall(bendData.last_node);
+					new_segments.push_back({ RenderData::cell_center(bendData.current_node), bendData.current_dir });
 					break;
 				}
 				case PipeUpdataType::FIRST_PIPE: {
-					PipeStraightData& straightData = update_data.data.pipeStraightData;
-					pipe_render_data[i].addFirstPipe(straightData.current_node, straightData.current_dir);
+					auto& straightData = update_data.data.pipeStraightData;
+					prd.addFirstPipe(straightData.current_node, straightData.current_dir);
 					break;
 				}
 				default:
 					unreachable();
 
 				}
+				if (!new_segments.empty()) {
+					prd.addPipes(new_segments);
+				}
+
+				// Dead pipes never change again, keep drawing the instances until the baked copy is uploaded
+				if (!world.is_pipe_alive(i)) {
+					freezer.freeze({ (size_t)i, world.colors[i], prd.pipe_transforms(), prd.ball_transforms() });
+				}
 			}
 		}
 
 		if (world.pipe_count() < 2 &&  world.chance(world.new_pipe_chance)) {
 			world.new_pipe(update_data);
 			if (update_data.type == PipeUpdataType::NEW) {
-				NewPipeData& newData = update_data.data.newPipeData;
-				pipe_render_data.emplace_back(BUFFER_INIT_SIZE);
-				pipe_render_data.back().addBall(newData.start_node);
+				auto& newData = update_data.data.newPipeData;
+				if (render_pool.empty()) {
+					pipe_render_data.push_back(std::make_unique<RenderData>(BUFFER_INIT_SIZE, views.size()));
+				}
+				else {
+					pipe_render_data.push_back(std::move(render_pool.back()));
+					render_pool.pop_back();
+				}
+				pipe_render_data.back()->addBall(newData.start_node);
 			}
 			else {
 				unreachable();
 			}
 		}
 	}
-	void run() {
-		/*
-		glm::mat4 pos[3];
-		pos[0] = glm::mat4{ {1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 1, 2, 1} };
+	/// Every pipe died and has been baked
+	bool generation_complete() {
+		if (world.pipe_count() == 0 || !world.is_gen_complete())
+			return false;
+		return std::all_of(pipe_render_data.begin(), pipe_render_data.end(), [](const auto& prd) { return !prd; });
+	}
 
-		pos[1] = glm::mat4{ {1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1} };
-		pos[2] = glm::mat4{ {1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 1, -2, 1} };
-		pos[2] = glm::rotate(pos[2], glm::radians<float>(90), glm::vec3{ 1, 0, 0 });
-		*/
-		//memcpy(meshes.MInstanceBuffer.data, pos, 3 * sizeof(glm::mat4));
-		//glFlushMappedBufferRange(meshes.InstanceBuffer(), 0, sizeof(glm::mat4));
+	/// Clears the world and the baked scene for a new generation. Everything is reset in place,
+	/// instance buffers are already back in render_pool, so a new generation allocates nothing.
+	void start_generation() {
+		PROFILE_ZONE("start generation");
+		if (config.fade_frames) {
+			for (const std::unique_ptr<View>& view : views) {
+				SceneTarget& scene = view->scene;
+				if (scene.width == 0)
+					continue;
+				scene.capture();
+				view->fade_remaining = config.fade_frames;
+				view->fade_uv_scale = glm::vec2(view->resolution.scaled(scene.width), view->resolution.scaled(scene.height)) / glm::vec2(scene.width, scene.height);
+			}
+		}
+		world.reset();
+		palette.update(world.colors);
+		freezer.reset();
+		baked.clear();
+		pipe_render_data.clear();
+	}
 
-		program.use();
-		//glActiveTexture(GL_TEXTURE0);
-		//glBindTexture(GL_TEXTURE_2D, texture.texture);
-		// Set our "myTextureSampler" sampler to use Texture Unit 0
-		//glUniform1i(program.uniforms.TextureID, 0);
-
-		// set the light position
-		glm::vec3 lightPos = glm::vec3(4, 4, 4);
-		glUniform3f(program.uniforms.LightID, lightPos.x, lightPos.y, lightPos.z);
-		//glBindVertexBuffer(2, prd.buffer.buffers[0], 0, sizeof(float) * 16);
-		double prevTime = glfwGetTime();
-		do {
+	/// Uploads pipes the freezer finished and returns their render data to the pool
+	void upload_frozen() {
+		PROFILE_ZONE("upload frozen");
+		for (const FreezeResult& result : freezer.poll()) {
+			baked.upload(result);
+			std::unique_ptr<RenderData>& prd = pipe_render_data[result.pipe_id];
+			prd->reset();
+			render_pool.push_back(std::move(prd));
+		}
+	}
+
+	/// Work on the shared objects, once a frame ahead of every view's draws
+	void update_shared() {
+		upload_frozen();
+		// Uploads go ahead of this frame's draws, so whatever they complete is drawn already
+		meshes.stream(config.stream_kib * 1024);
+	}
+
+	/// Culls every pipe's instances against the frustum and the previous frame's depth pyramid of
+	/// view, bucketing the survivors by level of detail
+	void cull_instances(View& view, size_t view_index, const glm::mat4& VP) {
+		PROFILE_ZONE("cull");
+		PROFILE_GPU_ZONE("cull");
+		size_t total_pipes = 0;
+		size_t total_balls = 0;
+		for (const std::unique_ptr<RenderData>& prd : pipe_render_data) {
+			if (prd) {
+				total_pipes += prd->numPipes;
+				total_balls += prd->numBalls;
+			}
+		}
+		CulledInstances& culled = view.culled;
+		culled.reserve(total_pipes + total_balls);
+
+		DrawElementsIndirectCommand commands[CulledInstances::COMMAND_COUNT]{};
+		for (size_t lod = 0; lod < meshes.lodCount; ++lod) {
+			for (MeshKind kind : { PIPE_MESH, BALL_MESH }) {
+				size_t sub = StaticMeshes::subobject(kind, lod);
+				DrawElementsIndirectCommand& command = commands[CulledInstances::command(kind, lod)];
+				command.count = (GLuint)(meshes.numSubElements[sub] * 3);
+				command.firstIndex = (GLuint)meshes.subOffsets[sub];
+				// Pipes of every pipe then balls of every pipe, once per level
+				command.baseInstance = (GLuint)(lod * culled.capacity + (kind == BALL_MESH ? total_pipes : 0));
+			}
+		}
+
+		// Kinds without a resident level are skipped until one arrives
+		size_t pipe_first = meshes.first_resident_lod(PIPE_MESH);
+		size_t ball_first = meshes.first_resident_lod(BALL_MESH);
+		culler.begin(view.hiz, VP, view.camera.position, meshes.lodCount);
+		culler.reset(culled, commands);
+		for (size_t pipe_id = 0; pipe_id < pipe_render_data.size(); ++pipe_id) {
+			if (!pipe_render_data[pipe_id])
+				continue;
+			RenderData& prd = *pipe_render_data[pipe_id];
+			if (pipe_first < meshes.lodCount)
+				culler.cull(prd.buffer, prd.lod_state(view_index), culled, CulledInstances::command(PIPE_MESH), 0, prd.numPipes, 0, meshes.subRadius[PIPE_MESH], (GLuint)pipe_id, pipe_first);
+			if (ball_first < meshes.lodCount)
+				culler.cull(prd.buffer, prd.lod_state(view_index), culled, CulledInstances::command(BALL_MESH), prd.buffer_size - prd.numBalls, prd.numBalls,
+					total_pipes, meshes.subRadius[BALL_MESH], (GLuint)pipe_id, ball_first);
+		}
+		culler.end();
+	}
+
+	/// Shared work, then every view in turn, then a new generation if this one is done. Secondary
+	/// views are left in their output targets for present_views().
+	void draw_frame(GLuint framebuffer, int width, int height) {
+		update_shared();
+		for (size_t i = 0; i < views.size(); ++i) {
+			View& view = *views[i];
+			if (view.primary()) {
+				draw_view(view, i, framebuffer, width, height);
+				continue;
+			}
+			int view_width = view.framebuffer_width;
+			int view_height = view.framebuffer_height;
+			// Minimised
+			if (view_width == 0 || view_height == 0)
+				continue;
+			draw_view(view, i, view.target(view_width, view_height), view_width, view_height);
+		}
 
+		// After every view has drawn the finished world, so each one's cross-fade starts from it
+		if (generation_complete()) {
+			start_generation();
+		}
+	}
 
-			// Clear the screen
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	/// Culls, draws the pipes into the view's scene target at its render scale, builds its depth
+	/// pyramid for the next frame and upscales the scene into framebuffer
+	void draw_view(View& view, size_t view_index, GLuint framebuffer, int width, int height) {
+		view.timer.begin();
+		if (latch_camera) {
+			PROFILE_ZONE("camera.update");
+			view.camera.update();
+		}
+		glm::mat4 ModelMatrix = glm::mat4(1.0);
+		glm::mat4 MVP = view.camera.projectionMatrix * view.camera.viewMatrix * ModelMatrix;
+
+		SceneTarget& scene = view.scene;
+		if (scene.width != width || scene.height != height) {
+			scene.allocate(width, height);
+			// The captured frame is gone
+			view.fade_remaining = 0;
+		}
+		int scene_w = view.resolution.scaled(width);
+		int scene_h = view.resolution.scaled(height);
+		bool msaa = view.resolution.msaa();
+		GLuint scene_framebuffer = msaa ? scene.msaa_framebuffer() : scene.framebuffer();
+
+		cull_instances(view, view_index, MVP);
+		draw_pipes(view, scene_framebuffer, scene_w, scene_h);
+		build_hiz(view, scene_framebuffer, scene_w, scene_h);
+		present(view, msaa, scene_w, scene_h, framebuffer, width, height);
+		view.timer.end();
+		if (view.timer.collected) {
+			view.resolution.update(view.timer.latest_gpu_ms);
+		}
+	}
 
+	void present(View& view, bool msaa, int scene_w, int scene_h, GLuint framebuffer, int width, int height) {
+		PROFILE_ZONE("post process");
+		PROFILE_GPU_ZONE("post process");
+		if (msaa) {
+			view.scene.resolve(scene_w, scene_h);
+		}
+		float fade = 0;
+		if (view.fade_remaining) {
+			fade = (float)view.fade_remaining / (float)config.fade_frames;
+			--view.fade_remaining;
+		}
+		post_process.draw(view.scene, scene_w, scene_h, !msaa, framebuffer, width, height, fade, view.fade_uv_scale);
+	}
 
-			// Compute the MVP matrix from keyboard and mouse input
-			
-			camera.update();
-			glm::mat4 ModelMatrix = glm::mat4(1.0);
-			glm::mat4 MVP = camera.projectionMatrix * camera.viewMatrix * ModelMatrix;
+	/// Blits and swaps every secondary view, each in its own context, and comes back to the
+	/// primary one. Only the primary window waits for vertical blank.
+	void present_views() {
+		if (views.size() == 1)
+			return;
+		PROFILE_ZONE("present views");
+		// Flushed, or a view's context could wait on a fence the primary one never submits
+		GLsync rendered = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glFlush();
+		for (const std::unique_ptr<View>& view : views) {
+			if (view->primary())
+				continue;
+			glfwMakeContextCurrent(view->window);
+			view->present(rendered);
+		}
+		glfwMakeContextCurrent(window);
+		glDeleteSync(rendered);
+	}
 
-			// in the "MVP" uniform
-			glUniformMatrix4fv(program.uniforms.PerspectiveID, 1, GL_FALSE, &camera.projectionMatrix[0][0]);
-			//glUniformMatrix4fv(program.uniforms.ModelMatrixID, 1, GL_FALSE, &ModelMatrix[0][0]);
-			glUniformMatrix4fv(program.uniforms.ViewMatrixID, 1, GL_FALSE, &camera.viewMatrix[0][0]);
+	void draw_pipes(View& view, GLuint framebuffer, int width, int height) {
+		PROFILE_ZONE("draw loop");
+		PROFILE_GPU_ZONE("draw loop");
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glViewport(0, 0, width, height);
+		// Clear the screen
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+		auto& camera = view.camera;
+		frame_uniforms.update({ camera.projectionMatrix * camera.viewMatrix, glm::vec4(light_position, 1), glm::vec4(camera.position, 1) });
 
-			// Draw the triangles !
-			//glDrawElementsInstancedBaseInstance(GL_TRIANGLES, (GLsizei)(meshes.numSubElements[0] * 3), GL_UNSIGNED_SHORT, (void*)meshes.subOffsets[0], 1, 0);
+		view.statistics.begin();
+		// Frozen pipes, one draw per region
+		baked_program.use();
+		baked.draw();
+
+		program.use();
+		glBindVertexArray(meshes.vertex_array());
+
+		// Instance counts were written by the culling pass, one instanced draw per mesh and level of
+		// detail covering every pipe, whatever the number of pipes
+		palette.bind();
+		meshes.bind_quantisation();
+		glBindVertexBuffer(2, view.culled.visible(), 0, sizeof(VisibleInstance));
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, view.culled.commands());
+		glMultiDrawElementsIndirect(GL_TRIANGLES, meshes.indexType, nullptr, (GLsizei)CulledInstances::COMMAND_COUNT, 0);
+		view.statistics.end();
+	}
+
+	void build_hiz(View& view, GLuint framebuffer, int width, int height) {
+		PROFILE_ZONE("hi-z");
+		PROFILE_GPU_ZONE("hi-z");
+		hiz_builder.build(view.hiz, framebuffer, width, height, view.camera.projectionMatrix * view.camera.viewMatrix);
+	}
+
+	/// Waits for the frames still being read back and written, and reports the capture
+	void finish_capture() {
+		if (!capture)
+			return;
+		capture->finish();
+		std::cout << "capture: " << capture->frames << " frames to " << config.capture_path << ", " << capture->stalls << " stalls, "
+			<< capture->skipped << " skipped for a resize" << std::endl;
+	}
+
+	/// Any window closed, escape closes the window it was pressed in
+	bool should_close() {
+		for (const std::unique_ptr<View>& view : views) {
+			if (glfwWindowShouldClose(view->window))
+				return true;
+		}
+		return false;
+	}
+
+	void run() {
+		if (config.headless) {
+			run_headless();
+			return;
+		}
+		if (!config.input_thread) {
+			render_loop();
+			return;
+		}
+
+		// GLFW events have to be handled on the main thread, so the context moves instead
+		glfwMakeContextCurrent(nullptr);
+		std::exception_ptr error;
+		std::thread renderer([&] {
+			glfwMakeContextCurrent(window);
+			try {
+				render_loop();
+			}
+			catch (...) {
+				error = std::current_exception();
+			}
+			glfwMakeContextCurrent(nullptr);
+			stop_rendering = true;
+			glfwPostEmptyEvent();
+		});
+		while (!stop_rendering && !should_close()) {
+			glfwWaitEvents();
+		}
+		stop_rendering = true;
+		renderer.join();
+		// GL objects are deleted on this thread
+		glfwMakeContextCurrent(window);
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	/// Draws and presents frames until escape or the window is closed. Polls events itself unless
+	/// the main thread runs the event loop.
+	void render_loop() {
+		View& main_view = *views[0];
+		auto& camera = main_view.camera;
+		// The swap interval belongs to the context, which is current here
+		glfwSwapInterval(config.swap_interval);
+		latch_camera = config.late_latch;
+		double prevTime = glfwGetTime();
+		do {
+			{
+				PROFILE_ZONE("pacing");
+				pacer.wait();
+			}
+			// Compute the MVP matrix from keyboard and mouse input, or late in draw_frame
+			if (!latch_camera) {
+				PROFILE_ZONE("camera.update");
+				for (const std::unique_ptr<View>& view : views) {
+					view->camera.update();
+				}
+			}
+			for (const std::unique_ptr<View>& view : views) {
+				if (view->camera.triggers[1]) {
+					view->camera.triggers[1] = false;
+					culler.occlusion = !culler.occlusion;
+				}
+			}
 
 			double curTime = glfwGetTime();
 			if (curTime - prevTime >= 1.0L) {
 				prevTime = curTime;
 				update_world();
-
-			}
-			for (int pipe_id = 0; pipe_id < pipe_render_data.size(); ++pipe_id) {
-				PipeRenderData& prd = pipe_render_data[pipe_id];
-				const glm::vec3& color = world.colors[pipe_id];
-				glUniform3f(program.uniforms.ColorID, color.x, color.y, color.z);
-
-				if (prd.numPipes) {
-					glBindVertexBuffer(2, prd.buffer.buffers[0], 0, sizeof(float) * 16);
-					glDrawElementsInstanced(GL_TRIANGLES, (GLsizei)(meshes.numSubElements[1] * 3), GL_UNSIGNED_SHORT, (void*)meshes.subOffsets[1], prd.numPipes);
-				} 
-				
-				if (prd.numBalls) {
-					glBindVertexBuffer(2, prd.buffer.buffers[0], prd.ball_offset(), sizeof(float) * 16);
-					glDrawElementsInstanced(GL_TRIANGLES, (GLsizei)(meshes.numSubElements[0] * 3), GL_UNSIGNED_SHORT, (void*)meshes.subOffsets[0], prd.numBalls);
+				if (config.stats) {
+					print_stats(main_view);
 				}
+				input_latency.latency_ms.clear();
+				pacer.recent = {};
+			}
+
+			draw_frame(0, main_view.framebuffer_width, main_view.framebuffer_height);
+			present_views();
+			// The back buffer, before the swap leaves it undefined
+			if (capture) {
+				PROFILE_ZONE("capture");
+				capture->read(0, main_view.framebuffer_width, main_view.framebuffer_height);
 			}
-			//glDrawElementsInstanced(GL_TRIANGLES, (GLsizei)(meshes.numSubElements[1] * 3), GL_UNSIGNED_SHORT, (void*)meshes.subOffsets[1], 10);
 
 			// Swap buffers
-			glfwSwapBuffers(window);
-			glfwPollEvents();
+			{
+				PROFILE_ZONE("swap");
+				glfwSwapBuffers(window);
+			}
+			pacer.presented();
+			input_latency.presented(camera.oldest_event_time);
+			if (startup_ms == 0) {
+				first_frame_done();
+			}
+			if (!config.input_thread) {
+				glfwPollEvents();
+			}
+
+		} // Check if the ESC key was pressed or a window was closed
+		while (!camera.triggers[0] && !stop_rendering && !should_close());
+
+		if (!config.pacing_path.empty()) {
+			pacer.write(config.pacing_path);
+		}
+		finish_capture();
+		PROFILE_EXPORT(config.trace_path);
+	}
+
+	/// The --stats line, covering the second since the last one
+	void print_stats(View& view) {
+		PipelineStatistics& statistics = view.statistics;
+		ResolutionController& resolution = view.resolution;
+		std::cout << "fragments: " << statistics.fragments << " triangles: " << statistics.triangles << " (hi-z " << (culler.occlusion ? "on" : "off") << ")"
+			<< " scale: " << resolution.scale << (resolution.msaa() ? " msaa" : " fxaa") << " gpu: " << resolution.smoothed_ms << " ms";
+		if (views.size() > 1)
+			std::cout << " views: " << views.size();
+		if (meshes.progress() < 1)
+			std::cout << " meshes: " << (int)(meshes.progress() * 100) << "%";
+		if (!input_latency.latency_ms.empty())
+			std::cout << " input: " << percentile(input_latency.latency_ms, 50) << "/" << percentile(input_latency.latency_ms, 95) << " ms";
+		std::cout << " interval: " << pacer.recent.mean << " ms jitter: " << pacer.recent.stddev() << " ms";
+		if (capture)
+			std::cout << " captured: " << capture->frames << " (" << capture->stalls << " stalls)";
+		std::cout << std::endl;
+	}
 
-		} // Check if the ESC key was pressed or the window was closed
-		while (!camera.triggers[0] &&
-			glfwWindowShouldClose(window) == 0);
+	/// Waits for the first frame, then reports the startup timeline
+	void first_frame_done() {
+		glFinish();
+		startup_ms = ms_since_process_start();
+		StartupTimeline& timeline = StartupTimeline::get();
+		timeline.record("first frame", "main", constructed_ms, startup_ms);
+		std::cout << "startup: " << startup_ms << " ms to first frame (" << (config.async_load ? "async" : "sync") << " load)" << std::endl;
+		timeline.print(std::cout);
+		if (!config.startup_trace_path.empty()) {
+			timeline.write(config.startup_trace_path);
+		}
+	}
+
+	/// Renders config.frames frames offscreen along a scripted camera path, ticking the world every
+	/// config.tick_frames frames, and writes the frame time percentiles as JSON
+	void run_headless() {
+		OffscreenTarget target{ config.width, config.height };
+		ScriptedCameraPath path{ glm::vec3(world.bounds) };
+		View& view = *views[0];
+		ResolutionController& resolution = view.resolution;
+		PipelineStatistics& statistics = view.statistics;
+		// Frame times including the world tick, the view's own timer only feeds the resolution
+		FrameTimer timer;
+		std::vector<double> scales;
+		std::vector<double> vs_invocations;
+		std::vector<double> triangles;
+
+		for (size_t frame = 0; frame < config.frames; ++frame) {
+			pacer.wait();
+			timer.begin();
+			view.camera.look_at(path.eye(frame), path.target());
+			if (frame % config.tick_frames == 0) {
+				update_world();
+			}
+			draw_frame(target.framebuffer(), target.width, target.height);
+			if (capture) {
+				PROFILE_ZONE("capture");
+				capture->read(target.framebuffer(), target.width, target.height);
+			}
+			scales.push_back(resolution.scale);
+			if (statistics.collected) {
+				vs_invocations.push_back((double)statistics.vertices);
+				triangles.push_back((double)statistics.triangles);
+			}
+			timer.end();
+			// Its glFinish isn't part of the frame
+			if (startup_ms == 0) {
+				first_frame_done();
+			}
+			if (pacer.enabled()) {
+				pacer.presented();
+			}
+		}
+		timer.finish();
+		finish_capture();
+		// Only paced headless runs have intervals worth reporting
+		if (pacer.enabled() && !config.pacing_path.empty()) {
+			pacer.write(config.pacing_path);
+		}
+
+		BenchmarkReport{ config.frames, config.seed, config.width, config.height, startup_ms, scales, vs_invocations, triangles }.write(config.benchmark_path, timer);
+		PROFILE_EXPORT(config.trace_path);
 	}
 };
 
 #include <filesystem>
 
-int main() {
+AppConfig parse_args(int argc, char* argv[]) {
+	AppConfig config;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto value = [&]() -> std::string {
+			if (i + 1 >= argc)
+				throw std::invalid_argument("Missing value for " + arg);
+			return argv[++i];
+		};
+
+		if (arg == "--headless")
+			config.headless = true;
+		else if (arg == "--frames")
+			config.frames = std::stoull(value());
+		else if (arg == "--tick-frames")
+			config.tick_frames = std::max<size_t>(1, std::stoull(value()));
+		else if (arg == "--seed")
+			config.seed = (unsigned)std::stoul(value());
+		else if (arg == "--width")
+			config.width = std::stoi(value());
+		else if (arg == "--height")
+			config.height = std::stoi(value());
+		else if (arg == "--benchmark")
+			config.benchmark_path = value();
+		else if (arg == "--trace")
+			config.trace_path = value();
+		else if (arg == "--shader-cache")
+			config.shader_cache = value();
+		else if (arg == "--target-ms")
+			config.target_ms = std::stod(value());
+		else if (arg == "--min-scale")
+			config.min_scale = std::stof(value());
+		else if (arg == "--max-scale")
+			config.max_scale = std::stof(value());
+		else if (arg == "--fixed-scale")
+			config.fixed_scale = std::stof(value());
+		else if (arg == "--fade-frames")
+			config.fade_frames = std::stoull(value());
+		else if (arg == "--mesh")
+			config.mesh_path = value();
+		else if (arg == "--sync-load")
+			config.async_load = false;
+		else if (arg == "--startup-trace")
+			config.startup_trace_path = value();
+		else if (arg == "--stream-kib")
+			config.stream_kib = std::stoull(value());
+		else if (arg == "--poll-input")
+			config.input_thread = false;
+		else if (arg == "--target-fps")
+			config.target_fps = std::stod(value());
+		else if (arg == "--swap-interval")
+			config.swap_interval = std::stoi(value());
+		else if (arg == "--pacing-spin-ms")
+			config.pacing_spin_ms = std::stod(value());
+		else if (arg == "--late-latch")
+			config.late_latch = true;
+		else if (arg == "--pacing-report")
+			config.pacing_path = value();
+		else if (arg == "--stats")
+			config.stats = true;
+		else if (arg == "--views")
+			config.views = std::max<size_t>(1, std::stoull(value()));
+		else if (arg == "--fullscreen")
+			config.fullscreen = true;
+		else if (arg == "--capture")
+			config.capture_path = value();
+		else if (arg == "--capture-fps")
+			config.capture_fps = std::stod(value());
+		else
+			throw std::invalid_argument("Unknown argument " + arg);
+	}
+	return config;
+}
+
+int main(int argc, char* argv[]) {
 
 	std::cout << std::filesystem::current_path() <<std::endl;
 	try {
-		App app;
+		AppConfig config = parse_args(argc, argv);
+		SetProgramCacheDirectory(config.shader_cache.c_str());
+		AssetLoads loads{ config };
+		App app{ config, loads };
 		app.run();
 	}
 	catch (std::exception& e) {
@@ -0,0 +1,149 @@
+#pragma once
+// Frame pacing: starts frames on a fixed cadence instead of whenever the last swap returned, and
+// measures how evenly frames are actually presented.
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#include <timeapi.h>
+#endif
+
+#include "benchmark.hpp"
+
+/// Count, mean and variance of a stream of samples without keeping them (Welford's method)
+struct RunningStats {
+	size_t count = 0;
+	double mean = 0;
+	double m2 = 0;
+
+	void add(double sample) {
+		++count;
+		double delta = sample - mean;
+		mean += delta / (double)count;
+		m2 += delta * (sample - mean);
+	}
+
+	/// Sample standard deviation
+	double stddev() const {
+		return count > 1 ? std::sqrt(m2 / (double)(count - 1)) : 0;
+	}
+};
+
+/// Sleeps until the next frame deadline, target_hz apart. The OS sleep is only trusted up to
+/// spin_ms before the deadline, the rest is spun, since sleeps overshoot by up to a scheduler tick.
+/// A frame that misses its deadline by more than a period starts the cadence over from now rather
+/// than running frames back to back to catch up.
+class FramePacer {
+public:
+	using clock = std::chrono::steady_clock;
+
+	// 0 leaves pacing to the swap interval
+	double target_hz;
+	double spin_ms;
+
+	// Intervals kept for percentiles, so a long session doesn't grow without bound
+	static constexpr size_t WINDOW = 4096;
+
+	// Time between consecutive presents, the last WINDOW of them in no particular order
+	std::vector<double> interval_ms;
+	// Every interval of the run, and the ones since recent was last cleared
+	RunningStats intervals;
+	RunningStats recent;
+	// Frames started later than a period after their deadline
+	size_t missed = 0;
+
+	FramePacer(double target_hz, double spin_ms) : target_hz{ target_hz }, spin_ms{ spin_ms } {
+#ifdef _WIN32
+		// Sleeps are rounded up to the 15.6 ms timer tick otherwise
+		if (enabled())
+			timeBeginPeriod(1);
+#endif
+	}
+
+	FramePacer(const FramePacer&) = delete;
+	FramePacer& operator=(const FramePacer&) = delete;
+
+	~FramePacer() {
+#ifdef _WIN32
+		if (enabled())
+			timeEndPeriod(1);
+#endif
+	}
+
+	bool enabled() const {
+		return target_hz > 0;
+	}
+
+	double period_ms() const {
+		return enabled() ? 1e3 / target_hz : 0;
+	}
+
+	/// Blocks until this frame's deadline
+	void wait() {
+		if (!enabled())
+			return;
+		clock::duration period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(period_ms()));
+		clock::time_point now = clock::now();
+		if (deadline == clock::time_point{} || now > deadline + period) {
+			if (deadline != clock::time_point{})
+				++missed;
+			deadline = now;
+		}
+		clock::time_point sleep_until = deadline - std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(spin_ms));
+		if (now < sleep_until)
+			std::this_thread::sleep_until(sleep_until);
+		while (clock::now() < deadline) {
+		}
+		deadline += period;
+	}
+
+	/// Call right after the swap
+	void presented() {
+		clock::time_point now = clock::now();
+		if (last_present != clock::time_point{}) {
+			double ms = std::chrono::duration<double, std::milli>(now - last_present).count();
+			intervals.add(ms);
+			recent.add(ms);
+			// Overwrites the oldest once full
+			if (interval_ms.size() < WINDOW)
+				interval_ms.push_back(ms);
+			else
+				interval_ms[(intervals.count - 1) % WINDOW] = ms;
+		}
+		last_present = now;
+	}
+
+	void write(std::ostream& out) const {
+		out << "{\n";
+		out << "\t\"target_hz\": " << target_hz << ",\n";
+		out << "\t\"frames\": " << intervals.count + 1 << ",\n";
+		out << "\t\"missed\": " << missed << ",\n";
+		out << "\t\"interval_mean_ms\": " << intervals.mean << ",\n";
+		out << "\t\"jitter_ms\": " << intervals.stddev() << ",\n";
+		// Of the last WINDOW intervals
+		write_percentiles(out, "interval_ms", interval_ms);
+		out << "\n}\n";
+	}
+
+	/// Writes the interval statistics as JSON, "-" for stdout
+	void write(const std::string& path) const {
+		if (path == "-") {
+			write(std::cout);
+			return;
+		}
+		std::ofstream file(path);
+		if (!file) {
+			throw std::runtime_error("Can't open pacing output " + path);
+		}
+		write(file);
+	}
+
+private:
+	clock::time_point deadline{};
+	clock::time_point last_present{};
+};
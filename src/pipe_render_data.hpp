@@ -0,0 +1,191 @@
+#pragma once
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include "gl_objects.hpp"
+#include "transforms.hpp"
+#include "world.hpp"
+
+/// Instances of one pipe: straight sections fill the buffer from the front, balls from the back.
+/// Grows on demand, and is returned to App::render_pool instead of being deleted once the pipe
+/// has been frozen. The GPU side holds matrices, the CPU copies only the packed cells of Bounds.
+template<typename Bounds>
+struct PipeRenderData {
+	using Coord = typename Bounds::Coord;
+
+	struct Segment {
+		Coord cell;
+		Direction dir;
+	};
+
+	size_t numBalls = 0;
+	size_t numPipes = 0;
+	size_t buffer_size = 0;
+	GLuint buffer = 0;
+	void* data = nullptr;
+	// Level of detail each instance was last drawn with in each view, see InstanceCuller
+	std::vector<GLuint> lod_states;
+	// CPU copies of the instances, used to refill the buffer when growing and for freezing
+	std::vector<Segment> pipe_segments;
+	std::vector<Coord> ball_cells;
+
+	PipeRenderData(size_t buffer_size, size_t views = 1) : lod_states(views, 0) {
+		allocate(buffer_size);
+	}
+
+	PipeRenderData(const PipeRenderData&) = delete;
+	PipeRenderData& operator=(const PipeRenderData&) = delete;
+
+	~PipeRenderData() {
+		release();
+	}
+
+	void release() {
+		if (buffer) {
+			glUnmapNamedBuffer(buffer);
+			glDeleteBuffers(1, &buffer);
+			glDeleteBuffers((GLsizei)lod_states.size(), lod_states.data());
+			buffer = 0;
+			std::fill(lod_states.begin(), lod_states.end(), 0);
+		}
+	}
+
+	void allocate(size_t size) {
+		release();
+		buffer_size = size;
+		glCreateBuffers(1, &buffer);
+		glNamedBufferStorage(buffer, (GLsizeiptr)(buffer_size * sizeof(glm::mat4)), nullptr, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT);
+		data = glMapNamedBufferRange(buffer, 0, (GLsizeiptr)(buffer_size * sizeof(glm::mat4)), GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_FLUSH_EXPLICIT_BIT);
+		if (data == NULL) {
+			throw gl_error();
+		}
+		glCreateBuffers((GLsizei)lod_states.size(), lod_states.data());
+		for (GLuint lod_state : lod_states) {
+			glNamedBufferStorage(lod_state, (GLsizeiptr)(buffer_size * sizeof(GLuint)), nullptr, GL_DYNAMIC_STORAGE_BIT);
+			glClearNamedBufferData(lod_state, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+		}
+	}
+
+	GLuint lod_state(size_t view = 0) const {
+		return lod_states[view];
+	}
+
+	/// Doubles the buffer, rewriting every instance from the CPU copies. Straight sections go
+	/// through the batched writer, and each end of the buffer is flushed once.
+	void grow() {
+		allocate(buffer_size * 2);
+		std::vector<SegmentInstance> segments;
+		segments.reserve(pipe_segments.size());
+		for (const Segment& segment : pipe_segments) {
+			segments.push_back({ cell_center(segment.cell), segment.dir });
+		}
+		write_segment_transforms(segments, (glm::mat4*)data);
+		flush(0, segments.size());
+
+		glm::mat4* balls = (glm::mat4*)data + buffer_size;
+		for (size_t i = 0; i < ball_cells.size(); ++i) {
+			*(balls - 1 - i) = ball_transform(ball_cells[i]);
+		}
+		flush(buffer_size - ball_cells.size(), ball_cells.size());
+	}
+
+	/// Forgets every instance but keeps the buffers, for reuse by another pipe
+	void reset() {
+		numBalls = 0;
+		numPipes = 0;
+		pipe_segments.clear();
+		ball_cells.clear();
+		for (GLuint lod_state : lod_states) {
+			glClearNamedBufferData(lod_state, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+		}
+	}
+
+	void write(size_t index, const glm::mat4& M) {
+		memcpy((char*)data + index * sizeof(glm::mat4), &M, sizeof(glm::mat4));
+		flush(index, 1);
+	}
+
+	/// Makes count instances from first visible to the GPU
+	void flush(size_t first, size_t count) {
+		if (count) {
+			glFlushMappedBufferRange(buffer, (GLintptr)(first * sizeof(glm::mat4)), (GLsizeiptr)(count * sizeof(glm::mat4)));
+		}
+	}
+
+	static glm::vec3 cell_center(Coord cell) {
+		return glm::vec3(glm::uvec3(cell));
+	}
+
+	static glm::mat4 ball_transform(Coord cell) {
+		return glm::translate(glm::identity<glm::mat4>(), cell_center(cell));
+	}
+
+	void addPipe(Coord cell, Direction dir) {
+		if (numPipes + numBalls == buffer_size) {
+			grow();
+		}
+		glm::mat4 M = segment_transform(cell_center(cell), dir);
+
+		write(numPipes, M);
+		pipe_segments.push_back({ cell, dir });
+		++numPipes;
+	}
+
+	/// Appends a batch of straight sections, written to the mapped buffer in one pass
+	void addPipes(std::span<const SegmentInstance> segments) {
+		while (numPipes + numBalls + segments.size() > buffer_size) {
+			grow();
+		}
+		write_segment_transforms(segments, (glm::mat4*)data + numPipes);
+		flush(numPipes, segments.size());
+
+		// Cells are whole and inside Bounds, so packing them loses nothing
+		for (const SegmentInstance& segment : segments) {
+			pipe_segments.push_back({ Coord{ glm::uvec3(segment.cell) }, segment.dir });
+		}
+		numPipes += segments.size();
+	}
+	GLsizeiptr ball_offset() {
+		return (buffer_size - numBalls) * sizeof(glm::mat4);
+	}
+	void addBend(Coord cell, Direction start, Direction end) {
+
+	}
+
+	void addFirstPipe(Coord cell, Direction dir) {
+
+	}
+
+	void addBall(Coord cell) {
+		if (numPipes + numBalls == buffer_size) {
+			grow();
+		}
+		write(buffer_size - 1 - numBalls, ball_transform(cell));
+		ball_cells.push_back(cell);
+		++numBalls;
+	}
+
+	/// Instance matrices of the straight sections, for freezing
+	std::vector<glm::mat4> pipe_transforms() const {
+		std::vector<glm::mat4> transforms;
+		transforms.reserve(pipe_segments.size());
+		for (const Segment& segment : pipe_segments) {
+			transforms.push_back(segment_transform(cell_center(segment.cell), segment.dir));
+		}
+		return transforms;
+	}
+
+	std::vector<glm::mat4> ball_transforms() const {
+		std::vector<glm::mat4> transforms;
+		transforms.reserve(ball_cells.size());
+		for (Coord cell : ball_cells) {
+			transforms.push_back(ball_transform(cell));
+		}
+		return transforms;
+	}
+
+};
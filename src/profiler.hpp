@@ -0,0 +1,210 @@
+#pragma once
+// Scoped CPU zones and GL_TIME_ELAPSED GPU zones exported as Chrome trace-event JSON
+// (load the file in chrome://tracing or https://ui.perfetto.dev).
+//
+// Everything is behind GL_PIPES_PROFILER. Without it the PROFILE_* macros expand to nothing and
+// none of the code below is compiled.
+
+#ifdef GL_PIPES_PROFILER
+#include <GL/glew.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace profiler {
+
+inline int64_t now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Event {
+	// Must point to storage that outlives the profiler, zone names are string literals
+	const char* name;
+	int64_t start_ns;
+	int64_t end_ns;
+};
+
+/// Single writer ring of finished zones. The owning thread publishes with a release store of
+/// head, so the exporter never takes a lock on the hot path.
+struct ThreadBuffer {
+	static constexpr size_t CAPACITY = 1 << 16;
+
+	uint32_t tid;
+	std::string name;
+	std::unique_ptr<Event[]> events{ new Event[CAPACITY] };
+	std::atomic<size_t> head{ 0 };
+
+	ThreadBuffer(uint32_t tid, std::string name) : tid{ tid }, name{ std::move(name) } {}
+
+	void push(const Event& event) {
+		size_t h = head.load(std::memory_order_relaxed);
+		events[h % CAPACITY] = event;
+		head.store(h + 1, std::memory_order_release);
+	}
+};
+
+/// Buffers of every thread that recorded a zone. The mutex is only taken when a thread records
+/// its first zone and when exporting.
+struct Registry {
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+	static Registry& get() {
+		static Registry registry;
+		return registry;
+	}
+
+	ThreadBuffer* add(const char* prefix) {
+		std::lock_guard lock{ mutex };
+		uint32_t tid = (uint32_t)buffers.size();
+		return buffers.emplace_back(std::make_unique<ThreadBuffer>(tid, prefix + std::string(" ") + std::to_string(tid))).get();
+	}
+};
+
+inline ThreadBuffer& thread_buffer() {
+	thread_local ThreadBuffer* buffer = Registry::get().add("cpu");
+	return *buffer;
+}
+
+struct CpuZone {
+	const char* name;
+	int64_t start_ns;
+
+	CpuZone(const char* name) : name{ name }, start_ns{ now_ns() } {}
+	~CpuZone() {
+		thread_buffer().push({ name, start_ns, now_ns() });
+	}
+};
+
+/// Ring of GL_TIME_ELAPSED queries. Results are collected once available, a zone whose slot is
+/// still in flight is dropped rather than waited on. Time elapsed queries can't nest, so GPU
+/// zones must be sequential.
+struct GpuZones {
+	static constexpr size_t RING = 32;
+
+	struct Slot {
+		const char* name = nullptr;
+		int64_t submit_ns = 0;
+		bool pending = false;
+	};
+
+	GLuint queries[RING]{};
+	Slot slots[RING];
+	size_t next = 0;
+	size_t oldest = 0;
+	// Index of the slot of the open zone, RING if none
+	size_t open = RING;
+	ThreadBuffer* buffer = nullptr;
+
+	static GpuZones& get() {
+		static GpuZones zones;
+		return zones;
+	}
+
+	void collect() {
+		while (oldest != next) {
+			Slot& slot = slots[oldest % RING];
+			GLuint query = queries[oldest % RING];
+			GLint available = GL_FALSE;
+			glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				break;
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+			// Placed at submission time, only the duration is measured on the GPU
+			buffer->push({ slot.name, slot.submit_ns, slot.submit_ns + (int64_t)elapsed });
+			slot.pending = false;
+			++oldest;
+		}
+	}
+
+	void begin(const char* name) {
+		if (buffer == nullptr) {
+			glCreateQueries(GL_TIME_ELAPSED, RING, queries);
+			buffer = Registry::get().add("gpu");
+		}
+		collect();
+		if (next - oldest == RING)
+			return;
+
+		open = next % RING;
+		slots[open] = { name, now_ns(), true };
+		glBeginQuery(GL_TIME_ELAPSED, queries[open]);
+		++next;
+	}
+
+	void end() {
+		if (open == RING)
+			return;
+		glEndQuery(GL_TIME_ELAPSED);
+		open = RING;
+	}
+};
+
+struct GpuZone {
+	GpuZone(const char* name) {
+		GpuZones::get().begin(name);
+	}
+	~GpuZone() {
+		GpuZones::get().end();
+	}
+};
+
+inline void write_chrome_trace(const std::string& path) {
+	std::ofstream out(path);
+	if (!out) {
+		throw std::runtime_error("Can't open trace output " + path);
+	}
+
+	Registry& registry = Registry::get();
+	std::lock_guard lock{ registry.mutex };
+
+	// Zones are pushed when they end, inner before outer, so the earliest start can be anywhere
+	int64_t origin = INT64_MAX;
+	for (const auto& buffer : registry.buffers) {
+		size_t head = buffer->head.load(std::memory_order_acquire);
+		size_t first = head > ThreadBuffer::CAPACITY ? head - ThreadBuffer::CAPACITY : 0;
+		for (size_t i = first; i < head; ++i)
+			origin = std::min(origin, buffer->events[i % ThreadBuffer::CAPACITY].start_ns);
+	}
+
+	out << "{\"traceEvents\":[\n";
+	bool first_event = true;
+	for (const auto& buffer : registry.buffers) {
+		out << (first_event ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << buffer->tid
+			<< ",\"args\":{\"name\":\"" << buffer->name << "\"}}";
+		first_event = false;
+
+		size_t head = buffer->head.load(std::memory_order_acquire);
+		size_t first = head > ThreadBuffer::CAPACITY ? head - ThreadBuffer::CAPACITY : 0;
+		for (size_t i = first; i < head; ++i) {
+			const Event& event = buffer->events[i % ThreadBuffer::CAPACITY];
+			out << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << buffer->tid
+				<< ",\"ts\":" << (double)(event.start_ns - origin) / 1e3 << ",\"dur\":" << (double)(event.end_ns - event.start_ns) / 1e3 << "}";
+		}
+	}
+	out << "\n]}\n";
+}
+
+} // namespace profiler
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_ZONE(name) ::profiler::CpuZone PROFILE_CONCAT(_profile_zone_, __LINE__){ name }
+#define PROFILE_GPU_ZONE(name) ::profiler::GpuZone PROFILE_CONCAT(_profile_gpu_zone_, __LINE__){ name }
+#define PROFILE_EXPORT(path) ::profiler::write_chrome_trace(path)
+
+#else
+
+#define PROFILE_ZONE(name)
+#define PROFILE_GPU_ZONE(name)
+#define PROFILE_EXPORT(path)
+
+#endif
@@ -1,4 +1,6 @@
+#pragma once
 #include <bitset>
+#include <cstdint>
 template<typename Container, typename _member_ptr>
 class _relthis
 {
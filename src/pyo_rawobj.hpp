@@ -1,48 +1,81 @@
 #pragma once
 #include <stdint.h>
 #include <stdio.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <stdexcept>
 #include <system_error>
 #include <vector>
 
-#include <limits.h>
-
-#if ULONG_MAX == 0xffffffffUL //32 bit long
-#ifdef _WIN32
-#define fseek64(stream, offset, origin) _fseeki64(stream, offset, origin)
-#define ftell64(stream) _ftelli64(stream)
-#else
-#error "long type is 32 bit. Please define a platfrom depependent fseek64 and ftell64"
-#endif
-#else
-#define fseek64(stream, offset, origin) fseek(stream, offset, origin)
-#define ftell64(stream) ftell(stream)
-#endif
-
-__pragma(pack(push, 1))
+#pragma pack(push, 1)
 struct header_t {
 	uint16_t BOM;
 	uint8_t type;
 	uint8_t flags;
 	uint32_t obj_count;
 
-	bool isFloat(){
+	bool isFloat() const {
 		return flags & 1;
 	}
-	bool hasNormal(){
+	bool hasNormal() const {
 		return flags & 2;
 	}
-	bool hasUV(){
+	bool hasUV() const {
 		return flags & 4;
 	}
-	bool indexed(){
+	bool indexed() const {
 		return flags & 8;
 	}
-	uint8_t indexSize() {
-		return flags >> 4;
+	/// Position, normal and uv of a vertex are stored together, see RawobjectReader::vertex_stride
+	bool interleaved() const {
+		return flags & 64;
+	}
+	/// Meshlet sections follow the vertex arrays, see MeshletRecord
+	bool hasMeshlets() const {
+		return flags & 128;
+	}
+	uint8_t indexSize() const {
+		return (flags >> 4) & 3;
+	}
+	/// Type 1: 16 bit positions with a per sub object offset and scale, octahedral normals
+	bool quantised() const {
+		return type == 1;
 	}
 };
 
-__pragma(pack(pop))
+#pragma pack(pop)
+
+/// Per sub object position decode of quantised files: offset + unorm16 * scale
+struct Quantisation {
+	float offset[3];
+	float scale[3];
+};
+static_assert(sizeof(Quantisation) == 24);
+
+// Meshlet limits, same as the usual mesh shader ones
+constexpr size_t MAX_MESHLET_VERTICES = 64;
+constexpr size_t MAX_MESHLET_TRIANGLES = 124;
+
+/// A cluster of triangles of one sub object, for culling whole clusters before their triangles
+/// are drawn. A meshlet faces away from eye when
+/// dot(center - eye, cone_axis) >= cone_cutoff * length(center - eye) + radius.
+struct MeshletRecord {
+	// First entry in the meshlet vertex section, which holds indices into the whole vertex array
+	uint32_t vertex_offset;
+	// First triangle in the meshlet triangle section, 3 bytes each indexing the meshlet's vertices
+	uint32_t triangle_offset;
+	uint32_t vertex_count;
+	uint32_t triangle_count;
+	// Bounding sphere
+	float center[3];
+	float radius;
+	float cone_axis[3];
+	// 1 when the triangles face too many ways for the cone to ever cull
+	float cone_cutoff;
+};
+static_assert(sizeof(MeshletRecord) == 48);
 
 constexpr uint16_t BOM = (uint16_t('P') << 8) | uint16_t('J');
 constexpr uint16_t ANTI_BOM = (uint16_t('J') << 8) | uint16_t('P');
@@ -51,109 +84,175 @@ static_assert(sizeof(header_t) == 8);
 
 #ifdef _WIN32
 #include <Windows.h>
-
-bool printWin32Error(DWORD errorMessageID, FILE* file) {
-	LPSTR messageBuffer = nullptr;
-	size_t size = FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
-		NULL, errorMessageID, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPSTR)&messageBuffer, 0, NULL);
-	if (messageBuffer == NULL) {
-		fprintf(file, "Error id %ul. Failed to format message", errorMessageID);
-		return false;
-	}
-	else {
-		fwrite(messageBuffer, 1, size, file);
-		LocalFree(messageBuffer);
-		return true;
-	}
-
-}
-
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif // _WIN32
 
+/// Read only mapping of a whole file. Sections are handed out as spans straight into the page
+/// cache, so nothing is copied on the way to the GL buffers.
+struct MappedFile {
+	const std::byte* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
 
-struct CPPFile {
-	FILE* file;
-	CPPFile(const char* path, const char* mode) {
-		file = fopen(path, mode);
+	enum class Advice {
+		// Read front to back once
+		Sequential,
+		// Read soon, start paging in now
+		WillNeed,
+		// Done with it, the pages may be dropped and are read again if touched
+		DontNeed,
+	};
 
-		if (file == NULL) {
+	MappedFile(const char* path) {
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
 			throw std::system_error(GetLastError(), std::system_category());
 		}
-	}
-
-	~CPPFile() {
-		if (fclose(file) == EOF) {
-			printWin32Error(GetLastError(), stderr);
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size)) {
+			DWORD error = GetLastError();
+			CloseHandle(file);
+			throw std::system_error(error, std::system_category());
 		}
-	}
-	size_t read(void* buffer, size_t size, size_t count) noexcept {
-		return fread(buffer, size, count, file);
-	}
-
-	void tread(void* buffer, size_t size, size_t count){
-		if (fread(buffer, size, count, file) != count) {
-			throw std::system_error(GetLastError(), std::system_category());
+		size = (size_t)file_size.QuadPart;
+		if (size == 0)
+			return;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL) {
+			DWORD error = GetLastError();
+			CloseHandle(file);
+			throw std::system_error(error, std::system_category());
 		}
-
-	}
-	template<typename T>
-	size_t read(T* buffer, size_t count) noexcept {
-		return fread(buffer, sizeof(T), count, file);
-	}
-	template<typename T>
-	void tread(T* buffer, size_t count) {
-		if (fread(buffer, sizeof(T), count, file) != count) {
-			throw std::system_error(GetLastError(), std::system_category());
+		data = (const std::byte*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (data == NULL) {
+			DWORD error = GetLastError();
+			CloseHandle(mapping);
+			CloseHandle(file);
+			throw std::system_error(error, std::system_category());
 		}
-	}
-	int64_t tell() noexcept{
-		return ftell64(file);
+#else
+		int fd = open(path, O_RDONLY);
+		if (fd == -1) {
+			throw std::system_error(errno, std::generic_category());
+		}
+		struct stat st;
+		if (fstat(fd, &st) == -1) {
+			int error = errno;
+			close(fd);
+			throw std::system_error(error, std::generic_category());
+		}
+		size = (size_t)st.st_size;
+		if (size == 0) {
+			close(fd);
+			return;
+		}
+		void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		int error = errno;
+		// The mapping keeps its own reference to the file
+		close(fd);
+		if (view == MAP_FAILED) {
+			throw std::system_error(error, std::generic_category());
+		}
+		data = (const std::byte*)view;
+#endif
 	}
 
-	int64_t ttell() {
-		int64_t pos = ftell64(file);
-		if (pos == -1L) {
-			throw std::system_error(GetLastError(), std::system_category());
-		}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
 
-		return pos;
+	~MappedFile() {
+#ifdef _WIN32
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+#else
+		if (data)
+			munmap((void*)data, size);
+#endif
 	}
 
-	int seek(long offset, int origin) noexcept {
-		return fseek64(file, offset, origin);
+	std::span<const std::byte> bytes(size_t start, size_t end) const {
+		if (start > end || end > size) {
+			throw std::out_of_range("Section past the end of the file");
+		}
+		return { data + start, end - start };
 	}
 
-	int tseek(long offset, int origin) {
-		if (fseek64(file, offset, origin) != 0) {
-			throw std::system_error(GetLastError(), std::system_category());
+	/// Access hint for [start, end). Best effort, failures are ignored.
+	void advise(size_t start, size_t end, Advice advice) const {
+		if (data == nullptr || start >= end)
+			return;
+#ifdef _WIN32
+#if _WIN32_WINNT >= 0x0602
+		if (advice == Advice::WillNeed) {
+			WIN32_MEMORY_RANGE_ENTRY range{ (PVOID)(data + start), end - start };
+			PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
 		}
-
-		return 0;
+#endif
+#else
+		// madvise wants a page aligned start
+		size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		size_t aligned = start / page * page;
+		int flag = advice == Advice::Sequential ? MADV_SEQUENTIAL : advice == Advice::WillNeed ? MADV_WILLNEED : MADV_DONTNEED;
+		if (advice == Advice::DontNeed) {
+			// Only whole pages inside the range, the neighbours may still be wanted
+			aligned = (start + page - 1) / page * page;
+			end = end / page * page;
+			if (aligned >= end)
+				return;
+		}
+		madvise((void*)(data + aligned), end - aligned, flag);
+#endif
 	}
-
-
 };
 
+/// Byte ranges of one sub object, or of every sub object for RawobjectReader::offsets. Sections
+/// the file doesn't have stay empty.
 struct Subobject {
-	size_t triangles_start;
-	size_t triangles_end;
+	size_t triangles_start = 0;
+	size_t triangles_end = 0;
 
-	size_t verticies_start;
-	size_t verticies_end;
+	size_t verticies_start = 0;
+	size_t verticies_end = 0;
 
-	size_t normals_start;
-	size_t normals_end;
+	size_t normals_start = 0;
+	size_t normals_end = 0;
 
-	size_t uvs_start;
-	size_t uvs_end;
+	size_t uvs_start = 0;
+	size_t uvs_end = 0;
 
 };
+/// Parses the layout of a JP Rawobject file and exposes its sections as spans of the mapping.
+/// Spans stay valid for the lifetime of the reader.
 struct RawobjectReader {
-	CPPFile file;
+	MappedFile file;
+	// Read position while parsing the header and counts
+	size_t cursor = 0;
 	header_t header;
 	uint8_t sizeof_index_t;
 	uint8_t sizeof_element_t;
 	uint8_t attrib_count;
+	// Bytes per vertex of each attribute
+	uint8_t position_stride;
+	uint8_t normal_stride;
+	uint8_t uv_stride;
+	// Interleaved files: bytes per vertex record, padded to 4, and where normal and uv sit in it
+	uint8_t vertex_stride = 0;
+	uint8_t normal_offset = 0;
+	uint8_t uv_offset = 0;
+	// One per sub object, only in quantised files
+	std::vector<Quantisation> quantisation;
 	struct counts_t {
 		size_t triangles = 0;
 		size_t verticies = 0;
@@ -169,8 +268,27 @@ struct RawobjectReader {
 	size_t arrays_start;
 	size_t arrays_end;
 
-	RawobjectReader(const char* path) : file{ path, "rb" } {
-		file.tread(&header, 1);
+	// Files with meshlets: count and first record of each sub object, and the sections' ranges
+	std::vector<uint32_t> meshlet_counts;
+	std::vector<size_t> first_meshlet;
+	size_t meshlets_start = 0;
+	size_t meshlets_end = 0;
+	size_t meshlet_vertices_start = 0;
+	size_t meshlet_vertices_end = 0;
+	size_t meshlet_triangles_start = 0;
+	size_t meshlet_triangles_end = 0;
+
+	void tread(void* buffer, size_t size) {
+		std::span<const std::byte> source = file.bytes(cursor, cursor + size);
+		memcpy(buffer, source.data(), size);
+		cursor += size;
+	}
+
+	RawobjectReader(const char* path) : file{ path } {
+		if (file.size < sizeof(header)) {
+			throw std::invalid_argument("File is not a JP file");
+		}
+		tread(&header, sizeof(header));
 		if (header.BOM != BOM) {
 			if (header.BOM == ANTI_BOM) {
 				throw std::invalid_argument("File has wrong endianness");
@@ -179,13 +297,24 @@ struct RawobjectReader {
 				throw std::invalid_argument("File is not a JP file");
 			}
 		}
-		if (header.type != 0) {
+		if (header.type != 0 && !header.quantised()) {
 			throw std::invalid_argument("File is not a JP Rawobject file");
 		}
 
 		sizeof_index_t = 1 << header.indexSize();
-		sizeof_element_t = header.isFloat() ? 4 : 8;
 		attrib_count = 1 + header.indexed() + header.hasNormal() + header.hasUV();
+		if (header.quantised()) {
+			// unorm16 positions and uvs, 2 x snorm16 octahedral normals
+			sizeof_element_t = 2;
+			position_stride = 3 * sizeof_element_t;
+			normal_stride = 2 * sizeof_element_t;
+		}
+		else {
+			sizeof_element_t = header.isFloat() ? 4 : 8;
+			position_stride = 3 * sizeof_element_t;
+			normal_stride = 3 * sizeof_element_t;
+		}
+		uv_stride = 2 * sizeof_element_t;
 
 		obj_counts.resize(header.obj_count);
 		sub_offsets.resize(header.obj_count);
@@ -193,15 +322,22 @@ struct RawobjectReader {
 		for (uint32_t i = 0; i < header.obj_count; ++i) {
 			if (header.indexed()) {
 				
-				file.tread((void*)&obj_counts[i].triangles, sizeof_index_t, 1);
+				tread((void*)&obj_counts[i].triangles, sizeof_index_t);
 				counts.triangles += obj_counts[i].triangles;
 			}
-			file.tread((void*)&obj_counts[i].verticies, sizeof_index_t, 1);
+			tread((void*)&obj_counts[i].verticies, sizeof_index_t);
 			counts.verticies += obj_counts[i].verticies;
 		}
-		size_t pos = file.ttell();
+		size_t pos = cursor;
 		pos = (pos + 7ull) & (~7ull); // round up to 8
 
+		if (header.quantised()) {
+			cursor = pos;
+			quantisation.resize(header.obj_count);
+			tread(quantisation.data(), quantisation.size() * sizeof(Quantisation));
+			pos = (cursor + 7ull) & (~7ull); // round up to 8
+		}
+
 		index_start = 0;
 		index_end = 0;
 		if (header.indexed()) {
@@ -225,9 +361,91 @@ struct RawobjectReader {
 		offsets.verticies_start = pos;
 		arrays_start = pos;
 
+		if (header.interleaved()) {
+			// One section of { position, normal, uv } records. Attribute starts point at the
+			// attribute in the first record and ends just past it in the last.
+			normal_offset = position_stride;
+			uv_offset = normal_offset + (header.hasNormal() ? normal_stride : 0);
+			vertex_stride = (uv_offset + (header.hasUV() ? uv_stride : 0) + 3) & ~3;
+			auto attribute_range = [&](size_t record_start, size_t count, uint8_t offset, uint8_t stride, size_t& start, size_t& end) {
+				start = record_start + offset;
+				end = count ? start + (count - 1) * vertex_stride + stride : start;
+			};
+			for (uint32_t i = 0; i < header.obj_count; ++i) {
+				Subobject& sub = sub_offsets[i];
+				sub.verticies_start = pos;
+				if (header.hasNormal())
+					attribute_range(pos, obj_counts[i].verticies, normal_offset, normal_stride, sub.normals_start, sub.normals_end);
+				if (header.hasUV())
+					attribute_range(pos, obj_counts[i].verticies, uv_offset, uv_stride, sub.uvs_start, sub.uvs_end);
+				pos += vertex_stride * obj_counts[i].verticies;
+				sub.verticies_end = pos;
+			}
+			offsets.verticies_end = pos;
+			size_t total_verticies = (pos - arrays_start) / vertex_stride;
+			if (header.hasNormal())
+				attribute_range(arrays_start, total_verticies, normal_offset, normal_stride, offsets.normals_start, offsets.normals_end);
+			if (header.hasUV())
+				attribute_range(arrays_start, total_verticies, uv_offset, uv_stride, offsets.uvs_start, offsets.uvs_end);
+			pos = (pos + 7ull) & (~7ull); // round up to 8
+			arrays_end = pos;
+		}
+		else {
+			planar_arrays(pos);
+		}
+
+		if (header.hasMeshlets()) {
+			meshlet_sections();
+		}
+
+		// Also catches truncated files before any section is touched
+		file.bytes(0, arrays_end);
+		file.advise(index_start, arrays_end, MappedFile::Advice::Sequential);
+		file.advise(index_start, arrays_end, MappedFile::Advice::WillNeed);
+	}
+
+	/// Bytes from one vertex's position to the next's
+	size_t position_step() const {
+		return vertex_stride ? vertex_stride : position_stride;
+	}
+	size_t normal_step() const {
+		return vertex_stride ? vertex_stride : normal_stride;
+	}
+	size_t uv_step() const {
+		return vertex_stride ? vertex_stride : uv_stride;
+	}
+
+	/// u32 meshlet count per sub object, the MeshletRecords of every sub object, u32 meshlet
+	/// vertices and 3 byte meshlet triangles, each section 8 aligned
+	void meshlet_sections() {
+		cursor = arrays_end;
+		meshlet_counts.resize(header.obj_count);
+		tread(meshlet_counts.data(), meshlet_counts.size() * sizeof(uint32_t));
+		size_t total = 0;
+		for (uint32_t count : meshlet_counts) {
+			first_meshlet.push_back(total);
+			total += count;
+		}
+		meshlets_start = (cursor + 7ull) & (~7ull);
+		meshlets_end = meshlets_start + total * sizeof(MeshletRecord);
+
+		size_t vertex_count = 0, triangle_count = 0;
+		for (const MeshletRecord& meshlet : meshlets()) {
+			vertex_count = std::max<size_t>(vertex_count, (size_t)meshlet.vertex_offset + meshlet.vertex_count);
+			triangle_count = std::max<size_t>(triangle_count, (size_t)meshlet.triangle_offset + meshlet.triangle_count);
+		}
+		meshlet_vertices_start = meshlets_end;
+		meshlet_vertices_end = meshlet_vertices_start + vertex_count * sizeof(uint32_t);
+		meshlet_triangles_start = (meshlet_vertices_end + 7ull) & (~7ull);
+		meshlet_triangles_end = meshlet_triangles_start + triangle_count * 3;
+		file.bytes(0, meshlet_triangles_end);
+	}
+
+	/// Lays out one section per attribute, each holding every sub object
+	void planar_arrays(size_t pos) {
 		for (uint32_t i = 0; i < header.obj_count; ++i) {
 			sub_offsets[i].verticies_start = pos;
-			pos += sizeof_element_t * 3 * obj_counts[i].verticies;
+			pos += position_stride * obj_counts[i].verticies;
 			sub_offsets[i].verticies_end = pos;
 		}
 		offsets.verticies_end = pos;
@@ -239,7 +457,7 @@ struct RawobjectReader {
 
 			for (uint32_t i = 0; i < header.obj_count; ++i) {
 				sub_offsets[i].normals_start = pos;
-				pos += sizeof_element_t * 3 * obj_counts[i].verticies;
+				pos += normal_stride * obj_counts[i].verticies;
 				sub_offsets[i].normals_end = pos;
 			}
 			offsets.normals_end = pos;
@@ -251,15 +469,62 @@ struct RawobjectReader {
 			offsets.uvs_start = pos;
 			for (uint32_t i = 0; i < header.obj_count; ++i) {
 				sub_offsets[i].uvs_start = pos;
-				pos += sizeof_element_t * 2 * obj_counts[i].verticies;
+				pos += uv_stride * obj_counts[i].verticies;
 				sub_offsets[i].uvs_end = pos;
 			}
 			offsets.uvs_end = pos;
 			pos = (pos + 7ull) & (~7ull); // round up to 8
 			arrays_end = pos;
 		}
+	}
+
+	/// Indices of every sub object, as uploaded to the element buffer
+	std::span<const std::byte> indices() const {
+		return file.bytes(index_start, index_end);
+	}
+
+	/// Vertex attribute arrays of every sub object, as uploaded to the vertex buffer
+	std::span<const std::byte> arrays() const {
+		return file.bytes(arrays_start, arrays_end);
+	}
+
+	template<typename T>
+	std::span<const T> section(size_t start, size_t end) const {
+		std::span<const std::byte> bytes = file.bytes(start, end);
+		return { reinterpret_cast<const T*>(bytes.data()), bytes.size() / sizeof(T) };
+	}
+
+	template<typename T>
+	std::span<const T> triangles(size_t subobject) const {
+		return section<T>(sub_offsets[subobject].triangles_start, sub_offsets[subobject].triangles_end);
+	}
+
+	/// Planar files only, interleaved attributes aren't contiguous
+	template<typename T>
+	std::span<const T> verticies(size_t subobject) const {
+		return section<T>(sub_offsets[subobject].verticies_start, sub_offsets[subobject].verticies_end);
+	}
+
+	/// Planar files only
+	template<typename T>
+	std::span<const T> normals(size_t subobject) const {
+		return section<T>(sub_offsets[subobject].normals_start, sub_offsets[subobject].normals_end);
+	}
+
+	std::span<const MeshletRecord> meshlets() const {
+		return section<MeshletRecord>(meshlets_start, meshlets_end);
+	}
+
+	std::span<const MeshletRecord> meshlets(size_t subobject) const {
+		return meshlets().subspan(first_meshlet[subobject], meshlet_counts[subobject]);
+	}
+
+	std::span<const uint32_t> meshlet_vertices() const {
+		return section<uint32_t>(meshlet_vertices_start, meshlet_vertices_end);
+	}
 
-		
+	std::span<const uint8_t> meshlet_triangles() const {
+		return section<uint8_t>(meshlet_triangles_start, meshlet_triangles_end);
 	}
 
 	~RawobjectReader() {
@@ -0,0 +1,90 @@
+#pragma once
+// Vertex encodings of quantised .jpraw files. Decoding here matches what the GL does with the
+// normalised attribute formats, so CPU copies of a mesh agree with what is drawn.
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <span>
+
+#include "pyo_rawobj.hpp"
+
+/// 3 x unorm16, see Quantisation
+struct QuantisedPosition {
+	uint16_t x, y, z;
+};
+static_assert(sizeof(QuantisedPosition) == 6);
+
+/// Unit vector projected on the octahedron and unfolded onto a square, 2 x snorm16
+struct OctahedralNormal {
+	int16_t x, y;
+};
+static_assert(sizeof(OctahedralNormal) == 4);
+
+/// Offset and scale that map the bounding box of positions onto [0, 1]^3
+inline Quantisation bounds_quantisation(std::span<const glm::vec3> positions) {
+	glm::vec3 low(0), high(0);
+	if (!positions.empty()) {
+		low = high = positions[0];
+	}
+	for (const glm::vec3& p : positions) {
+		low = glm::min(low, p);
+		high = glm::max(high, p);
+	}
+	Quantisation q;
+	for (int c = 0; c < 3; ++c) {
+		q.offset[c] = low[c];
+		q.scale[c] = high[c] - low[c];
+	}
+	return q;
+}
+
+inline uint16_t unorm16(float v) {
+	return (uint16_t)std::lround(std::clamp(v, 0.0f, 1.0f) * 65535.0f);
+}
+
+inline int16_t snorm16(float v) {
+	return (int16_t)std::lround(std::clamp(v, -1.0f, 1.0f) * 32767.0f);
+}
+
+inline float from_snorm16(int16_t v) {
+	return std::max(v / 32767.0f, -1.0f);
+}
+
+inline QuantisedPosition quantise_position(const glm::vec3& p, const Quantisation& q) {
+	uint16_t c[3];
+	for (int i = 0; i < 3; ++i) {
+		// Flat axes decode to the offset whatever is stored
+		c[i] = q.scale[i] > 0 ? unorm16((p[i] - q.offset[i]) / q.scale[i]) : 0;
+	}
+	return { c[0], c[1], c[2] };
+}
+
+inline glm::vec3 dequantise_position(const QuantisedPosition& p, const Quantisation& q) {
+	return glm::vec3(q.offset[0] + p.x / 65535.0f * q.scale[0], q.offset[1] + p.y / 65535.0f * q.scale[1], q.offset[2] + p.z / 65535.0f * q.scale[2]);
+}
+
+inline OctahedralNormal encode_octahedral(const glm::vec3& n) {
+	float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	if (l1 == 0)
+		return { 0, 0 };
+	float x = n.x / l1, y = n.y / l1;
+	if (n.z < 0) {
+		// Fold the lower half over the diagonals
+		float folded_x = (1 - std::abs(y)) * (x >= 0 ? 1.0f : -1.0f);
+		float folded_y = (1 - std::abs(x)) * (y >= 0 ? 1.0f : -1.0f);
+		x = folded_x;
+		y = folded_y;
+	}
+	return { snorm16(x), snorm16(y) };
+}
+
+/// Same as octahedral_decode in StandardShading.vertexshader
+inline glm::vec3 decode_octahedral(const OctahedralNormal& e) {
+	glm::vec3 n(from_snorm16(e.x), from_snorm16(e.y), 0);
+	n.z = 1 - std::abs(n.x) - std::abs(n.y);
+	float t = std::max(-n.z, 0.0f);
+	n.x += n.x >= 0 ? -t : t;
+	n.y += n.y >= 0 ? -t : t;
+	return glm::normalize(n);
+}
@@ -0,0 +1,183 @@
+#pragma once
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "gl_objects.hpp"
+#include "common/shader.hpp"
+
+/// Offscreen scene colour and depth at output resolution. Scaled frames only render into the
+/// bottom left corner of it, so changing the scale never reallocates. The multisampled pair is
+/// used at high scales and resolved into the single sampled colour for the post pass.
+struct SceneTarget {
+	static constexpr int MSAA_SAMPLES = 4;
+
+	// 0: single sampled colour, sampled by the post pass, 1: copy of an earlier frame to fade from
+	GLuint textures[2]{ 0, 0 };
+	// 0: single sampled depth, 1: multisampled colour, 2: multisampled depth
+	GLuint renderbuffers[3]{ 0, 0, 0 };
+	// 0: single sampled, 1: multisampled
+	GLFramebuffers<2> framebuffers;
+	int width = 0;
+	int height = 0;
+
+	~SceneTarget() {
+		glDeleteTextures(2, textures);
+		glDeleteRenderbuffers(3, renderbuffers);
+	}
+
+	GLuint color() const {
+		return textures[0];
+	}
+	GLuint previous() const {
+		return textures[1];
+	}
+	GLuint framebuffer() const {
+		return framebuffers.framebuffers[0];
+	}
+	GLuint msaa_framebuffer() const {
+		return framebuffers.framebuffers[1];
+	}
+
+	void allocate(int w, int h) {
+		glDeleteTextures(2, textures);
+		glDeleteRenderbuffers(3, renderbuffers);
+		width = w;
+		height = h;
+
+		glCreateTextures(GL_TEXTURE_2D, 2, textures);
+		for (GLuint texture : textures) {
+			glTextureStorage2D(texture, 1, GL_RGBA8, w, h);
+			glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTextureParameteri(texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTextureParameteri(texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		}
+
+		glCreateRenderbuffers(3, renderbuffers);
+		// D24S8 everywhere, the hi-z resolve blits depth from whichever framebuffer was drawn to
+		glNamedRenderbufferStorage(renderbuffers[0], GL_DEPTH24_STENCIL8, w, h);
+		glNamedRenderbufferStorageMultisample(renderbuffers[1], MSAA_SAMPLES, GL_RGBA8, w, h);
+		glNamedRenderbufferStorageMultisample(renderbuffers[2], MSAA_SAMPLES, GL_DEPTH24_STENCIL8, w, h);
+
+		glNamedFramebufferTexture(framebuffer(), GL_COLOR_ATTACHMENT0, color(), 0);
+		glNamedFramebufferRenderbuffer(framebuffer(), GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[0]);
+		glNamedFramebufferRenderbuffer(msaa_framebuffer(), GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[1]);
+		glNamedFramebufferRenderbuffer(msaa_framebuffer(), GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[2]);
+
+		if (glCheckNamedFramebufferStatus(framebuffer(), GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE ||
+			glCheckNamedFramebufferStatus(msaa_framebuffer(), GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			throw std::runtime_error("Scene framebuffer is incomplete");
+		}
+	}
+
+	/// Resolves the multisampled colour of the w x h corner into color()
+	void resolve(int w, int h) {
+		glBlitNamedFramebuffer(msaa_framebuffer(), framebuffer(), 0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
+
+	/// Keeps the current colour in previous(), after the post pass has read it
+	void capture() {
+		glCopyImageSubData(color(), GL_TEXTURE_2D, 0, 0, 0, 0, previous(), GL_TEXTURE_2D, 0, 0, 0, 0, width, height, 1);
+	}
+};
+
+/// Picks the render scale that holds a GPU frame time. GPU time is taken to grow with the pixel
+/// count, so the scale moves by the square root of target / measured. All fields are public and
+/// printed once a second for tuning.
+struct ResolutionController {
+	// GPU frame time to hold, in milliseconds
+	double target_ms = 16.0;
+	float min_scale = 0.5f;
+	float max_scale = 1.0f;
+	// At or above this scale the scene is drawn with MSAA, below it single sampled with FXAA
+	float msaa_scale = 1.0f;
+	// Only scale up once under target by this factor, so the controller doesn't oscillate
+	double headroom = 0.8;
+	// Weight of the newest sample in smoothed_ms
+	double smoothing = 0.1;
+	// Frames to hold a scale before changing it again, longer than the frame timer's latency
+	size_t cooldown = 8;
+	// Scales are rounded to multiples of 1 / quantum
+	float quantum = 32;
+	bool adaptive = true;
+
+	float scale = 1.0f;
+	double smoothed_ms = 0;
+	size_t frames_since_change = 0;
+
+	void update(double gpu_ms) {
+		smoothed_ms = smoothed_ms == 0 ? gpu_ms : smoothed_ms + (gpu_ms - smoothed_ms) * smoothing;
+		++frames_since_change;
+		if (!adaptive || frames_since_change < cooldown || smoothed_ms <= 0)
+			return;
+
+		float wanted = scale;
+		float ratio = (float)std::sqrt(target_ms / smoothed_ms);
+		if (smoothed_ms > target_ms) {
+			wanted = scale * ratio;
+		}
+		else if (smoothed_ms < target_ms * headroom) {
+			// Grow gently, a jump straight to the estimate overshoots when MSAA turns back on
+			wanted = std::min(scale * ratio, scale + 2 / quantum);
+		}
+		wanted = std::clamp(std::round(wanted * quantum) / quantum, min_scale, max_scale);
+		if (wanted != scale) {
+			scale = wanted;
+			frames_since_change = 0;
+		}
+	}
+
+	bool msaa() const {
+		return scale >= msaa_scale;
+	}
+
+	int scaled(int size) const {
+		return std::max(1, (int)std::lround(size * scale));
+	}
+};
+
+/// Upscales the rendered corner of a SceneTarget to the output, with FXAA when the scene was
+/// single sampled, and optionally fades from a captured earlier frame
+struct PostProcess {
+	GLuint program;
+	GLint uv_scale_id;
+	GLint fxaa_id;
+	GLint fade_id;
+	GLint previous_uv_scale_id;
+	// The fullscreen triangle is generated from gl_VertexID, but core profile needs a VAO bound
+	VertexArrays<1> vertex_arrays;
+
+	PostProcess() : program(LoadShaders("Fullscreen.vertexshader", "PostProcess.fragmentshader")) {
+		uv_scale_id = glGetUniformLocation(program, "uv_scale");
+		fxaa_id = glGetUniformLocation(program, "fxaa");
+		fade_id = glGetUniformLocation(program, "fade");
+		previous_uv_scale_id = glGetUniformLocation(program, "previous_uv_scale");
+	}
+
+	~PostProcess() {
+		glDeleteProgram(program);
+	}
+
+	/// fade is the weight of SceneTarget::previous(), whose rendered corner was previous_uv_scale
+	void draw(const SceneTarget& scene, int scene_w, int scene_h, bool fxaa, GLuint framebuffer, int width, int height,
+		float fade = 0, glm::vec2 previous_uv_scale = glm::vec2(1)) {
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glViewport(0, 0, width, height);
+		glDisable(GL_DEPTH_TEST);
+
+		glUseProgram(program);
+		glUniform2f(uv_scale_id, (float)scene_w / scene.width, (float)scene_h / scene.height);
+		glUniform1i(fxaa_id, fxaa);
+		glUniform1f(fade_id, fade);
+		glUniform2f(previous_uv_scale_id, previous_uv_scale.x, previous_uv_scale.y);
+		glBindTextureUnit(0, scene.color());
+		glBindTextureUnit(1, scene.previous());
+		glBindVertexArray(vertex_arrays.vertex_arrays[0]);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+
+		glEnable(GL_DEPTH_TEST);
+	}
+};
@@ -0,0 +1,126 @@
+#pragma once
+// Timeline of what happens between process start and the first finished frame, on every thread
+// that takes part. Unlike the profiler it is always compiled in: phases are recorded once per run,
+// so it costs nothing worth a build flag.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Taken during static initialisation, as close to process start as we get portably. Inline so
+// every translation unit measures from the same point.
+inline const std::chrono::steady_clock::time_point process_start = std::chrono::steady_clock::now();
+
+/// Milliseconds from process start to now, used to measure time to first frame
+inline double ms_since_process_start() {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - process_start).count();
+}
+
+class StartupTimeline {
+public:
+	struct Phase {
+		std::string name;
+		// Thread the phase ran on, "main" or a loader
+		std::string thread;
+		double start_ms;
+		double end_ms;
+	};
+
+	static StartupTimeline& get() {
+		static StartupTimeline timeline;
+		return timeline;
+	}
+
+	void record(const std::string& name, const std::string& thread, double start_ms, double end_ms) {
+		std::lock_guard lock{ mutex };
+		phases.push_back({ name, thread, start_ms, end_ms });
+	}
+
+	std::vector<Phase> sorted() {
+		std::lock_guard lock{ mutex };
+		std::vector<Phase> result = phases;
+		std::stable_sort(result.begin(), result.end(), [](const Phase& a, const Phase& b) {
+			return a.start_ms < b.start_ms;
+		});
+		return result;
+	}
+
+	/// One line per phase, in start order
+	void print(std::ostream& out) {
+		out << std::fixed << std::setprecision(1);
+		for (const Phase& phase : sorted()) {
+			out << "  " << std::setw(8) << phase.start_ms << std::setw(8) << phase.end_ms << " ms  "
+				<< std::left << std::setw(8) << phase.thread << std::right << phase.name << "\n";
+		}
+		out << std::defaultfloat;
+	}
+
+	/// Chrome trace-event JSON, same format as the profiler's, with process start at 0
+	void write(const std::string& path) {
+		std::ofstream out(path);
+		if (!out) {
+			throw std::runtime_error("Can't open startup trace output " + path);
+		}
+		std::vector<Phase> all = sorted();
+		std::vector<std::string> threads;
+		for (const Phase& phase : all) {
+			if (std::find(threads.begin(), threads.end(), phase.thread) == threads.end())
+				threads.push_back(phase.thread);
+		}
+
+		out << "{\"traceEvents\":[\n";
+		for (size_t tid = 0; tid < threads.size(); ++tid) {
+			out << (tid ? ",\n" : "") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << tid
+				<< ",\"args\":{\"name\":\"" << escape(threads[tid]) << "\"}}";
+		}
+		for (const Phase& phase : all) {
+			size_t tid = std::find(threads.begin(), threads.end(), phase.thread) - threads.begin();
+			out << ",\n{\"name\":\"" << escape(phase.name) << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid
+				<< ",\"ts\":" << phase.start_ms * 1e3 << ",\"dur\":" << (phase.end_ms - phase.start_ms) * 1e3 << "}";
+		}
+		out << "\n]}\n";
+	}
+
+private:
+	std::mutex mutex;
+	std::vector<Phase> phases;
+
+	/// JSON string contents of str. Phase names hold file paths, and Windows ones have backslashes.
+	static std::string escape(const std::string& str) {
+		std::string escaped;
+		escaped.reserve(str.size());
+		for (char c : str) {
+			if (c == '"' || c == '\\') {
+				escaped += '\\';
+				escaped += c;
+			}
+			else if ((unsigned char)c < 0x20) {
+				char code[8];
+				snprintf(code, sizeof(code), "\\u%04x", (unsigned)c);
+				escaped += code;
+			}
+			else {
+				escaped += c;
+			}
+		}
+		return escaped;
+	}
+};
+
+/// Records its own lifetime as a phase of the startup timeline
+struct StartupPhase {
+	std::string name;
+	std::string thread;
+	double start_ms;
+
+	StartupPhase(std::string name, std::string thread = "main") : name{ std::move(name) }, thread{ std::move(thread) }, start_ms{ ms_since_process_start() } {}
+	~StartupPhase() {
+		StartupTimeline::get().record(name, thread, start_ms, ms_since_process_start());
+	}
+};
@@ -0,0 +1,160 @@
+#pragma once
+// Incremental uploads into GL buffers through a small persistently mapped staging ring, so large
+// assets are copied a bounded number of bytes per frame instead of in one blocking call.
+#include <GL/glew.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "gl_objects.hpp"
+#include "pyo_rawobj.hpp"
+
+/// Staging buffer split into SLOTS slots. A slot is reused once the GPU has finished the copy out
+/// of it, which a fence per slot tells without stalling.
+struct StagingRing {
+	static constexpr size_t SLOTS = 4;
+
+	GLBuffers<1> buffer;
+	std::byte* mapped = nullptr;
+	size_t slot_size;
+	GLsync fences[SLOTS]{};
+	size_t next = 0;
+
+	StagingRing(size_t slot_size) : slot_size{ slot_size } {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glNamedBufferStorage(buffer.buffers[0], (GLsizeiptr)(SLOTS * slot_size), nullptr, flags);
+		mapped = (std::byte*)glMapNamedBufferRange(buffer.buffers[0], 0, (GLsizeiptr)(SLOTS * slot_size), flags);
+	}
+
+	StagingRing(const StagingRing&) = delete;
+	StagingRing& operator=(const StagingRing&) = delete;
+
+	~StagingRing() {
+		for (GLsync fence : fences) {
+			if (fence)
+				glDeleteSync(fence);
+		}
+		glUnmapNamedBuffer(buffer.buffers[0]);
+	}
+
+	/// Mapped memory of the next slot, null while the GPU may still be copying out of it
+	std::byte* acquire() {
+		GLsync& fence = fences[next];
+		if (fence) {
+			GLenum status = glClientWaitSync(fence, 0, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+				return nullptr;
+			glDeleteSync(fence);
+			fence = nullptr;
+		}
+		return mapped + next * slot_size;
+	}
+
+	/// Copies the first size bytes of the acquired slot to destination and moves on. The mapping is
+	/// coherent, so the copy sees what was just written.
+	void submit(GLuint destination, size_t offset, size_t size) {
+		glCopyNamedBufferSubData(buffer.buffers[0], destination, (GLintptr)(next * slot_size), (GLintptr)offset, (GLsizeiptr)size);
+		fences[next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		next = (next + 1) % SLOTS;
+	}
+};
+
+/// Queue of copies from CPU memory into GL buffers, drained through a StagingRing by pump().
+/// Copies are grouped, for example by sub object; GL runs commands in order, so a group is usable
+/// by any draw issued after its last copy has been submitted.
+class StreamingUploader {
+public:
+	struct Copy {
+		const std::byte* source;
+		GLuint destination;
+		size_t offset;
+		size_t size;
+		size_t group;
+	};
+
+	size_t bytes_total = 0;
+	size_t bytes_submitted = 0;
+
+	/// Sources inside file's mapping are paged in just ahead of the copy and dropped after it, so
+	/// only about a slot of the file is resident at a time
+	StreamingUploader(size_t slot_size, size_t group_count, const MappedFile* file = nullptr) :
+		ring{ slot_size }, remaining(group_count, 0), file{ file } {}
+
+	/// Copies run in the order they were added
+	void add(const std::byte* source, GLuint destination, size_t offset, size_t size, size_t group) {
+		if (size == 0)
+			return;
+		copies.push_back({ source, destination, offset, size, group });
+		remaining[group] += size;
+		bytes_total += size;
+	}
+
+	/// Submits up to budget bytes, fewer if every staging slot is still in use. Returns the bytes
+	/// submitted.
+	size_t pump(size_t budget) {
+		size_t submitted = 0;
+		while (current < copies.size() && submitted < budget) {
+			std::byte* slot = ring.acquire();
+			if (slot == nullptr)
+				break;
+			Copy& copy = copies[current];
+			size_t size = std::min({ copy.size - done, ring.slot_size, budget - submitted });
+			const std::byte* source = copy.source + done;
+			advise(source + size, std::min(ring.slot_size, copy.size - done - size), MappedFile::Advice::WillNeed);
+			memcpy(slot, source, size);
+			advise(source, size, MappedFile::Advice::DontNeed);
+			ring.submit(copy.destination, copy.offset + done, size);
+
+			done += size;
+			submitted += size;
+			remaining[copy.group] -= size;
+			if (done == copy.size) {
+				++current;
+				done = 0;
+			}
+		}
+		bytes_submitted += submitted;
+		return submitted;
+	}
+
+	/// Blocks until everything has been submitted
+	void finish() {
+		while (!complete()) {
+			if (pump(SIZE_MAX) == 0) {
+				// Every slot is in flight, wait for the oldest
+				glClientWaitSync(ring.fences[ring.next], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			}
+		}
+	}
+
+	bool complete(size_t group) const {
+		return remaining[group] == 0;
+	}
+
+	bool complete() const {
+		return current == copies.size();
+	}
+
+	/// Fraction of the bytes submitted so far
+	double progress() const {
+		return bytes_total ? (double)bytes_submitted / (double)bytes_total : 1.0;
+	}
+
+private:
+	StagingRing ring;
+	std::vector<Copy> copies;
+	// Bytes left to submit per group
+	std::vector<size_t> remaining;
+	const MappedFile* file;
+	// First copy not fully submitted, and how much of it is
+	size_t current = 0;
+	size_t done = 0;
+
+	void advise(const std::byte* start, size_t size, MappedFile::Advice advice) const {
+		if (file == nullptr || size == 0 || start < file->data || start + size > file->data + file->size)
+			return;
+		file->advise((size_t)(start - file->data), (size_t)(start - file->data) + size, advice);
+	}
+};
@@ -0,0 +1,354 @@
+#pragma once
+// Decoded .jpraw sub objects and a writer for the float and quantised formats, for the offline
+// tools. The renderer only ever reads.
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../pyo_rawobj.hpp"
+#include "../jpraw_convert.hpp"
+#include "../quantise.hpp"
+#include "meshlets.hpp"
+
+/// One sub object with indices relative to its own vertices
+struct MeshObject {
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> normals;
+	std::vector<glm::vec2> uvs;
+	std::vector<uint32_t> indices;
+	// Empty unless built with build_meshlets or read from a file that has them
+	Meshlets meshlets;
+};
+
+/// Every sub object of an indexed file of any format, as floats
+inline std::vector<MeshObject> read_objects(const RawobjectReader& reader) {
+	if (!reader.header.indexed()) {
+		throw std::invalid_argument("File has no indices");
+	}
+	ConvertedRawobject converted{ reader };
+	std::vector<MeshObject> objects(reader.header.obj_count);
+	for (size_t i = 0; i < objects.size(); ++i) {
+		MeshObject& object = objects[i];
+		if (reader.header.quantised()) {
+			for (const QuantisedPosition& p : converted.verticies<QuantisedPosition>(i))
+				object.positions.push_back(dequantise_position(p, reader.quantisation[i]));
+			if (reader.header.hasNormal()) {
+				for (const OctahedralNormal& n : converted.normals<OctahedralNormal>(i))
+					object.normals.push_back(decode_octahedral(n));
+			}
+			if (reader.header.hasUV()) {
+				for (const std::array<uint16_t, 2>& uv : converted.uvs<std::array<uint16_t, 2>>(i))
+					object.uvs.emplace_back(uv[0] / 65535.0f, uv[1] / 65535.0f);
+			}
+		}
+		else {
+			object.positions = converted.verticies<glm::vec3>(i);
+			if (reader.header.hasNormal())
+				object.normals = converted.normals<glm::vec3>(i);
+			if (reader.header.hasUV())
+				object.uvs = converted.uvs<glm::vec2>(i);
+		}
+
+		uint32_t first_vertex = (uint32_t)converted.first_vertex(i);
+		auto rebase = [&](auto indices) {
+			for (uint32_t index : indices)
+				object.indices.push_back(index - first_vertex);
+		};
+		if (converted.index_size == sizeof(uint16_t))
+			rebase(converted.triangles<uint16_t>(i));
+		else
+			rebase(converted.triangles<uint32_t>(i));
+
+		if (reader.header.hasMeshlets()) {
+			std::span<const MeshletRecord> records = reader.meshlets(i);
+			for (const MeshletRecord& record : records) {
+				MeshletRecord& meshlet = object.meshlets.records.emplace_back(record);
+				meshlet.vertex_offset = (uint32_t)object.meshlets.vertices.size();
+				meshlet.triangle_offset = (uint32_t)(object.meshlets.triangles.size() / 3);
+				for (uint32_t v : reader.meshlet_vertices().subspan(record.vertex_offset, record.vertex_count))
+					object.meshlets.vertices.push_back(v - first_vertex);
+				std::span<const uint8_t> triangles = reader.meshlet_triangles().subspan((size_t)record.triangle_offset * 3, (size_t)record.triangle_count * 3);
+				object.meshlets.triangles.insert(object.meshlets.triangles.end(), triangles.begin(), triangles.end());
+			}
+		}
+	}
+	return objects;
+}
+
+/// Throws unless written, read back through reader, decodes to objects within what the format
+/// can hold. Meshlets must match exactly and stay within max_vertices and max_triangles.
+inline void compare_objects(const std::vector<MeshObject>& objects, const std::vector<MeshObject>& written, const RawobjectReader& reader,
+	size_t max_vertices = MAX_MESHLET_VERTICES, size_t max_triangles = MAX_MESHLET_TRIANGLES) {
+	if (written.size() != objects.size()) {
+		throw std::runtime_error("Wrote " + std::to_string(written.size()) + " sub objects instead of " + std::to_string(objects.size()));
+	}
+	for (size_t i = 0; i < objects.size(); ++i) {
+		const MeshObject& a = objects[i];
+		const MeshObject& b = written[i];
+		std::string name = "sub object " + std::to_string(i);
+		auto fail = [&](const std::string& what) {
+			throw std::runtime_error(name + ": " + what + " differ");
+		};
+		if (a.indices != b.indices)
+			fail("indices");
+		if (a.positions.size() != b.positions.size() || a.normals.size() != b.normals.size() || a.uvs.size() != b.uvs.size())
+			fail("vertex counts");
+
+		// Quantised files hold positions to a step of their box, normals to the octahedral grid
+		glm::vec3 position_error(0);
+		float normal_error = 0, uv_error = 0;
+		if (reader.header.quantised()) {
+			const Quantisation& q = reader.quantisation[i];
+			position_error = glm::vec3(q.scale[0], q.scale[1], q.scale[2]) / 65535.0f;
+			normal_error = 1e-3f;
+			uv_error = 1 / 65535.0f;
+		}
+		for (size_t v = 0; v < a.positions.size(); ++v) {
+			for (int c = 0; c < 3; ++c) {
+				if (std::abs(a.positions[v][c] - b.positions[v][c]) > position_error[c] + std::abs(a.positions[v][c]) * 1e-6f)
+					fail("positions");
+			}
+		}
+		for (size_t v = 0; v < a.normals.size(); ++v) {
+			if (glm::length(a.normals[v] - b.normals[v]) > normal_error + 1e-6f)
+				fail("normals");
+		}
+		for (size_t v = 0; v < a.uvs.size(); ++v) {
+			// Quantised uvs are clamped to [0, 1]
+			for (int c = 0; c < 2; ++c) {
+				float expected = reader.header.quantised() ? std::clamp(a.uvs[v][c], 0.0f, 1.0f) : a.uvs[v][c];
+				if (std::abs(expected - b.uvs[v][c]) > uv_error + 1e-6f)
+					fail("uvs");
+			}
+		}
+
+		if (a.meshlets.records.size() != b.meshlets.records.size() || a.meshlets.vertices != b.meshlets.vertices || a.meshlets.triangles != b.meshlets.triangles)
+			fail("meshlets");
+		if (std::memcmp(a.meshlets.records.data(), b.meshlets.records.data(), a.meshlets.records.size() * sizeof(MeshletRecord)) != 0)
+			fail("meshlet records");
+		// Meshlets are cut from the index list in order, so together they must rebuild it
+		std::vector<uint32_t> rebuilt;
+		for (const MeshletRecord& meshlet : b.meshlets.records) {
+			if (meshlet.vertex_count > max_vertices || meshlet.triangle_count > max_triangles)
+				fail("meshlet sizes");
+			for (size_t k = 0; k < meshlet.triangle_count * 3; ++k) {
+				uint8_t local = b.meshlets.triangles[meshlet.triangle_offset * 3 + k];
+				if (local >= meshlet.vertex_count)
+					fail("meshlet triangles");
+				rebuilt.push_back(b.meshlets.vertices[meshlet.vertex_offset + local]);
+			}
+		}
+		if (!b.meshlets.empty() && rebuilt != b.indices)
+			fail("meshlet triangles");
+	}
+}
+
+struct RawobjectFormat {
+	// 16 bit positions and uvs, octahedral normals
+	bool quantise = false;
+	// One { position, normal, uv } record per vertex instead of a section per attribute
+	bool interleave = false;
+};
+
+/// Builds a file in memory, sections in the order RawobjectReader expects
+class RawobjectWriter {
+public:
+	/// Every object needs normals, or none; same for uvs
+	RawobjectWriter(const std::vector<MeshObject>& objects, RawobjectFormat format) : objects{ objects }, quantise{ format.quantise }, interleave{ format.interleave } {
+		if (objects.empty()) {
+			throw std::invalid_argument("Nothing to write");
+		}
+		normals = !objects[0].normals.empty();
+		uvs = !objects[0].uvs.empty();
+		size_t vertex_count = 0;
+		for (const MeshObject& object : objects) {
+			if (object.normals.empty() == normals || object.uvs.empty() == uvs) {
+				throw std::invalid_argument("Sub objects have different attributes");
+			}
+			vertex_count += object.positions.size();
+			meshlets |= !object.meshlets.empty();
+		}
+		index_size = vertex_count > 0xffff ? 4 : 2;
+	}
+
+	std::vector<std::byte> encode() {
+		bytes.clear();
+		uint8_t index_size_log2 = index_size == 4 ? 2 : 1;
+		header_t header{ BOM, (uint8_t)(quantise ? 1 : 0),
+			(uint8_t)((quantise ? 0 : 1) | (normals ? 2 : 0) | (uvs ? 4 : 0) | 8 | (index_size_log2 << 4) | (interleave ? 64 : 0) | (meshlets ? 128 : 0)), (uint32_t)objects.size() };
+		append(&header, sizeof(header));
+		for (const MeshObject& object : objects) {
+			append_index(object.indices.size() / 3);
+			append_index(object.positions.size());
+		}
+		pad();
+
+		if (quantise) {
+			for (const MeshObject& object : objects) {
+				Quantisation q = bounds_quantisation(object.positions);
+				append(&q, sizeof(q));
+			}
+			pad();
+		}
+
+		// Indices address the whole vertex array
+		size_t first_vertex = 0;
+		for (const MeshObject& object : objects) {
+			for (uint32_t index : object.indices)
+				append_index(first_vertex + index);
+			first_vertex += object.positions.size();
+		}
+		pad();
+
+		if (interleave) {
+			for (const MeshObject& object : objects) {
+				Quantisation q = bounds_quantisation(object.positions);
+				for (size_t v = 0; v < object.positions.size(); ++v) {
+					size_t record = bytes.size();
+					append_position(object.positions[v], q);
+					if (normals)
+						append_normal(object.normals[v]);
+					if (uvs)
+						append_uv(object.uvs[v]);
+					// Records are padded to 4 bytes, same as RawobjectReader::vertex_stride
+					bytes.resize(record + ((bytes.size() - record + 3) & ~size_t(3)));
+				}
+			}
+			pad();
+			append_meshlets();
+			return std::move(bytes);
+		}
+
+		for (const MeshObject& object : objects) {
+			Quantisation q = bounds_quantisation(object.positions);
+			for (const glm::vec3& p : object.positions)
+				append_position(p, q);
+		}
+		pad();
+		if (normals) {
+			for (const MeshObject& object : objects) {
+				for (const glm::vec3& n : object.normals)
+					append_normal(n);
+			}
+			pad();
+		}
+		if (uvs) {
+			for (const MeshObject& object : objects) {
+				for (const glm::vec2& uv : object.uvs)
+					append_uv(uv);
+			}
+			pad();
+		}
+		append_meshlets();
+		return std::move(bytes);
+	}
+
+private:
+	const std::vector<MeshObject>& objects;
+	bool quantise;
+	bool interleave;
+	bool normals;
+	bool uvs;
+	bool meshlets = false;
+	size_t index_size;
+	std::vector<std::byte> bytes;
+
+	void append(const void* data, size_t size) {
+		if (size == 0)
+			return;
+		size_t at = bytes.size();
+		bytes.resize(at + size);
+		memcpy(&bytes[at], data, size);
+	}
+
+	void append_position(const glm::vec3& p, const Quantisation& q) {
+		if (quantise) {
+			QuantisedPosition e = quantise_position(p, q);
+			append(&e, sizeof(e));
+		}
+		else {
+			append(&p, sizeof(p));
+		}
+	}
+
+	void append_normal(const glm::vec3& n) {
+		if (quantise) {
+			OctahedralNormal e = encode_octahedral(n);
+			append(&e, sizeof(e));
+		}
+		else {
+			append(&n, sizeof(n));
+		}
+	}
+
+	void append_uv(const glm::vec2& uv) {
+		if (quantise) {
+			uint16_t e[2]{ unorm16(uv.x), unorm16(uv.y) };
+			append(e, sizeof(e));
+		}
+		else {
+			append(&uv, sizeof(uv));
+		}
+	}
+
+	/// Meshlet sections as RawobjectReader::meshlet_sections reads them, rebased onto the whole file
+	void append_meshlets() {
+		if (!meshlets)
+			return;
+		for (const MeshObject& object : objects) {
+			uint32_t count = (uint32_t)object.meshlets.records.size();
+			append(&count, sizeof(count));
+		}
+		pad();
+		size_t first_entry = 0, first_triangle = 0;
+		for (const MeshObject& object : objects) {
+			for (MeshletRecord record : object.meshlets.records) {
+				record.vertex_offset += (uint32_t)first_entry;
+				record.triangle_offset += (uint32_t)first_triangle;
+				append(&record, sizeof(record));
+			}
+			first_entry += object.meshlets.vertices.size();
+			first_triangle += object.meshlets.triangles.size() / 3;
+		}
+		size_t first_vertex = 0;
+		for (const MeshObject& object : objects) {
+			for (uint32_t v : object.meshlets.vertices) {
+				uint32_t global = (uint32_t)(first_vertex + v);
+				append(&global, sizeof(global));
+			}
+			first_vertex += object.positions.size();
+		}
+		pad();
+		for (const MeshObject& object : objects)
+			append(object.meshlets.triangles.data(), object.meshlets.triangles.size());
+		pad();
+	}
+
+	void append_index(size_t index) {
+		uint32_t value = (uint32_t)index;
+		append(&value, index_size);
+	}
+
+	void pad() {
+		bytes.resize((bytes.size() + 7) & ~size_t(7));
+	}
+};
+
+/// Writes next to path and renames over it, so a failed write leaves the original
+inline void write_file(const std::string& path, const std::vector<std::byte>& bytes) {
+	std::string temporary = path + ".tmp";
+	{
+		std::ofstream file(temporary, std::ios::binary);
+		if (!file.write((const char*)bytes.data(), (std::streamsize)bytes.size())) {
+			throw std::runtime_error("Can't write " + temporary);
+		}
+	}
+	std::filesystem::rename(temporary, path);
+}
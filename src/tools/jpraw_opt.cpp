@@ -0,0 +1,228 @@
+// Reorders the triangles and vertices of every sub object of a .jpraw file for the post-transform
+// vertex cache, overdraw and vertex fetch, and rewrites the file in place.
+//
+//   jpraw_opt <file.jpraw> [--output path] [--cache N] [--no-overdraw]
+//             [--quantise] [--interleave | --planar] [--dry-run]
+//
+// Sections keep their size and position, only their contents are permuted, so any index and
+// element size the reader accepts round trips unchanged. --quantise (16 bit positions, octahedral
+// normals), --interleave (one record per vertex) and --planar (a section per attribute) first
+// rewrite the file in that format, then optimise it.
+
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../pyo_rawobj.hpp"
+#include "mesh_opt.hpp"
+#include "jpraw_io.hpp"
+
+struct OptConfig {
+	std::string input;
+	std::string output;
+	// FIFO size the statistics are simulated with
+	size_t cache_size = 16;
+	bool overdraw = true;
+	bool quantise = false;
+	bool interleave = false;
+	bool planar = false;
+	bool dry_run = false;
+	// Overdraw ordering may cost this much ACMR
+	float overdraw_threshold = 1.05f;
+};
+
+/// Moves each vertex of [start, start + vertex_count * stride) to remap[vertex]
+void permute_vertices(std::vector<std::byte>& bytes, size_t start, size_t vertex_count, size_t stride, const std::vector<uint32_t>& remap) {
+	std::vector<std::byte> old(bytes.begin() + start, bytes.begin() + start + vertex_count * stride);
+	for (size_t v = 0; v < vertex_count; ++v) {
+		memcpy(&bytes[start + remap[v] * stride], &old[v * stride], stride);
+	}
+}
+
+void print_stats(const char* name, const CacheStats& before, const CacheStats& after) {
+	std::cout << std::setw(8) << name << std::setw(10) << before.triangles << std::setw(10) << before.vertices
+		<< std::setw(12) << before.acmr() << std::setw(12) << after.acmr()
+		<< std::setw(12) << before.atvr() << std::setw(12) << after.atvr() << "\n";
+}
+
+void optimize(const OptConfig& config) {
+	std::vector<std::byte> bytes;
+	CacheStats total_before, total_after;
+	std::cout << std::fixed << std::setprecision(3);
+	std::cout << std::setw(8) << "object" << std::setw(10) << "tris" << std::setw(10) << "verts"
+		<< std::setw(12) << "acmr" << std::setw(12) << "acmr opt" << std::setw(12) << "atvr" << std::setw(12) << "atvr opt"
+		<< "  (fifo " << config.cache_size << ")\n";
+	{
+		// The mapping has to be gone before the file is replaced
+		RawobjectReader reader{ config.input.c_str() };
+		if (!reader.header.indexed()) {
+			throw std::invalid_argument(config.input + " has no indices to optimise");
+		}
+		std::span<const std::byte> file = reader.file.bytes(0, reader.file.size);
+		bytes.assign(file.begin(), file.end());
+
+		size_t index_size = reader.sizeof_index_t;
+		size_t element_size = reader.sizeof_element_t;
+		for (size_t i = 0; i < reader.sub_offsets.size(); ++i) {
+			const Subobject& offset = reader.sub_offsets[i];
+			size_t vertex_count = reader.obj_counts[i].verticies;
+			size_t first_vertex = (offset.verticies_start - reader.offsets.verticies_start) / reader.position_step();
+
+			// Indices in the file address the whole vertex array
+			std::vector<uint32_t> indices(reader.obj_counts[i].triangles * 3);
+			for (size_t k = 0; k < indices.size(); ++k) {
+				uint64_t index = 0;
+				memcpy(&index, &bytes[offset.triangles_start + k * index_size], index_size);
+				if (index < first_vertex || index - first_vertex >= vertex_count) {
+					throw std::invalid_argument("Sub object " + std::to_string(i) + " indexes outside its vertices");
+				}
+				indices[k] = (uint32_t)(index - first_vertex);
+			}
+
+			std::vector<glm::vec3> positions(vertex_count);
+			size_t step = reader.position_step();
+			for (size_t v = 0; v < vertex_count && reader.header.quantised(); ++v) {
+				QuantisedPosition position;
+				memcpy(&position, &bytes[offset.verticies_start + v * step], sizeof(position));
+				positions[v] = dequantise_position(position, reader.quantisation[i]);
+			}
+			for (size_t v = 0; v < vertex_count && !reader.header.quantised(); ++v) {
+				for (int c = 0; c < 3; ++c) {
+					const std::byte* element = &bytes[offset.verticies_start + v * step + c * element_size];
+					if (element_size == sizeof(float)) {
+						memcpy(&positions[v][c], element, sizeof(float));
+					}
+					else {
+						double value;
+						memcpy(&value, element, sizeof(double));
+						positions[v][c] = (float)value;
+					}
+				}
+			}
+
+			CacheStats before = simulate_cache(indices, vertex_count, config.cache_size);
+			std::vector<uint32_t> optimized = optimize_vertex_cache(indices, vertex_count);
+			if (config.overdraw) {
+				optimized = optimize_overdraw(optimized, positions, config.cache_size, config.overdraw_threshold);
+			}
+			// Small meshes can already match or beat the greedy order
+			if (simulate_cache(optimized, vertex_count, config.cache_size).misses >= before.misses) {
+				optimized = indices;
+			}
+			std::vector<uint32_t> remap = optimize_vertex_fetch(optimized, vertex_count);
+			CacheStats after = simulate_cache(optimized, vertex_count, config.cache_size);
+
+			for (size_t k = 0; k < optimized.size(); ++k) {
+				uint64_t index = optimized[k] + first_vertex;
+				memcpy(&bytes[offset.triangles_start + k * index_size], &index, index_size);
+			}
+			if (reader.header.interleaved()) {
+				permute_vertices(bytes, offset.verticies_start, vertex_count, reader.vertex_stride, remap);
+			}
+			else {
+				permute_vertices(bytes, offset.verticies_start, vertex_count, reader.position_stride, remap);
+			}
+			if (reader.header.hasNormal() && !reader.header.interleaved())
+				permute_vertices(bytes, offset.normals_start, vertex_count, reader.normal_stride, remap);
+			if (reader.header.hasUV() && !reader.header.interleaved())
+				permute_vertices(bytes, offset.uvs_start, vertex_count, reader.uv_stride, remap);
+
+			print_stats(std::to_string(i).c_str(), before, after);
+			total_before.triangles += before.triangles;
+			total_before.vertices += before.vertices;
+			total_before.misses += before.misses;
+			total_after.triangles += after.triangles;
+			total_after.vertices += after.vertices;
+			total_after.misses += after.misses;
+		}
+	}
+	print_stats("total", total_before, total_after);
+
+	if (config.dry_run)
+		return;
+	write_file(config.output, bytes);
+	std::cout << "wrote " << config.output << std::endl;
+}
+
+/// Rewrites config.input to config.output in the requested format, keeping whatever wasn't asked
+/// to change. Returns the vertex bytes before and after.
+std::pair<size_t, size_t> convert(const OptConfig& config) {
+	std::vector<MeshObject> objects;
+	size_t before;
+	RawobjectFormat format;
+	{
+		RawobjectReader reader{ config.input.c_str() };
+		objects = read_objects(reader);
+		before = reader.arrays_end - reader.arrays_start;
+		format.quantise = config.quantise || reader.header.quantised();
+		format.interleave = config.interleave || (reader.header.interleaved() && !config.planar);
+	}
+	std::vector<std::byte> bytes = RawobjectWriter{ objects, format }.encode();
+	write_file(config.output, bytes);
+	RawobjectReader written{ config.output.c_str() };
+	return { before, written.arrays_end - written.arrays_start };
+}
+
+OptConfig parse_args(int argc, char* argv[]) {
+	OptConfig config;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto value = [&]() -> std::string {
+			if (i + 1 >= argc)
+				throw std::invalid_argument("Missing value for " + arg);
+			return argv[++i];
+		};
+
+		if (arg == "--output")
+			config.output = value();
+		else if (arg == "--cache")
+			config.cache_size = std::max<size_t>(3, std::stoull(value()));
+		else if (arg == "--no-overdraw")
+			config.overdraw = false;
+		else if (arg == "--quantise")
+			config.quantise = true;
+		else if (arg == "--interleave")
+			config.interleave = true;
+		else if (arg == "--planar")
+			config.planar = true;
+		else if (arg == "--dry-run")
+			config.dry_run = true;
+		else if (arg.rfind("--", 0) != 0 && config.input.empty())
+			config.input = arg;
+		else
+			throw std::invalid_argument("Unknown argument " + arg);
+	}
+	if (config.input.empty()) {
+		throw std::invalid_argument("Usage: jpraw_opt <file.jpraw> [--output path] [--cache N] [--no-overdraw] [--quantise] [--interleave | --planar] [--dry-run]");
+	}
+	if (config.interleave && config.planar) {
+		throw std::invalid_argument("--interleave and --planar are exclusive");
+	}
+	if (config.output.empty())
+		config.output = config.input;
+	return config;
+}
+
+int main(int argc, char* argv[]) {
+	try {
+		OptConfig config = parse_args(argc, argv);
+		if (RawobjectReader{ config.input.c_str() }.header.hasMeshlets()) {
+			// Reordering triangles would leave the meshlets pointing at the old ones
+			throw std::invalid_argument(config.input + " has meshlets, repack the source with jpraw_pack --optimise --meshlets instead");
+		}
+		if ((config.quantise || config.interleave || config.planar) && !config.dry_run) {
+			auto [before, after] = convert(config);
+			std::cout << "converted " << config.output << ": vertex arrays " << before << " -> " << after << " bytes\n";
+			config.input = config.output;
+		}
+		optimize(config);
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+// Packs OBJ and PLY meshes into one .jpraw file, one sub object per input object, in argument
+// order. The renderer expects { ball, pipe } pairs per level of detail, most detailed first.
+//
+//   jpraw_pack <input.obj|ply>... --output <file.jpraw> [--quantise] [--interleave] [--optimise]
+//              [--meshlets] [--max-vertices N] [--max-triangles N] [--verify]
+//
+// --optimise reorders triangles and vertices like jpraw_opt. --meshlets adds meshlet sections,
+// built after optimising. --verify reads the written file back and compares it with the inputs.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mesh_import.hpp"
+#include "mesh_opt.hpp"
+#include "jpraw_io.hpp"
+
+struct PackConfig {
+	std::vector<std::string> inputs;
+	std::string output;
+	RawobjectFormat format;
+	bool optimise = false;
+	bool meshlets = false;
+	size_t max_vertices = MAX_MESHLET_VERTICES;
+	size_t max_triangles = MAX_MESHLET_TRIANGLES;
+	bool verify = false;
+};
+
+double ms_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// Cache and fetch order of jpraw_opt, applied to a decoded object
+void optimise_object(MeshObject& object) {
+	std::vector<uint32_t> indices = optimize_vertex_cache(object.indices, object.positions.size());
+	if (simulate_cache(indices, object.positions.size(), 16).misses < simulate_cache(object.indices, object.positions.size(), 16).misses)
+		object.indices = std::move(indices);
+	std::vector<uint32_t> remap = optimize_vertex_fetch(object.indices, object.positions.size());
+	auto permute = [&](auto& attribute) {
+		if (attribute.empty())
+			return;
+		auto old = attribute;
+		for (size_t v = 0; v < old.size(); ++v)
+			attribute[remap[v]] = old[v];
+	};
+	permute(object.positions);
+	permute(object.normals);
+	permute(object.uvs);
+}
+
+void pack(const PackConfig& config) {
+	std::vector<MeshObject> objects;
+	size_t input_bytes = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (const std::string& input : config.inputs) {
+		for (MeshObject& object : import_mesh(input)) {
+			std::cout << input << ": sub object " << objects.size() << ", " << object.indices.size() / 3 << " triangles, "
+				<< object.positions.size() << " vertices" << (object.uvs.empty() ? "" : ", uvs") << "\n";
+			objects.push_back(std::move(object));
+		}
+		input_bytes += (size_t)std::filesystem::file_size(input);
+	}
+	if (objects.empty()) {
+		throw std::invalid_argument("No faces in the inputs");
+	}
+	double import_ms = ms_since(start);
+
+	// Every sub object of a file has the same attributes
+	size_t with_uvs = 0;
+	for (const MeshObject& object : objects)
+		with_uvs += !object.uvs.empty();
+	if (with_uvs != objects.size()) {
+		if (with_uvs)
+			std::cout << "not every sub object has uvs, dropping them from all\n";
+		for (MeshObject& object : objects)
+			object.uvs.clear();
+	}
+
+	start = std::chrono::steady_clock::now();
+	size_t triangles = 0, meshlet_count = 0;
+	for (MeshObject& object : objects) {
+		if (object.positions.size() > UINT32_MAX) {
+			throw std::invalid_argument("Sub object has more than 2^32 vertices");
+		}
+		if (config.optimise)
+			optimise_object(object);
+		if (config.meshlets) {
+			object.meshlets = build_meshlets(object.indices, object.positions, config.max_vertices, config.max_triangles);
+			meshlet_count += object.meshlets.records.size();
+		}
+		triangles += object.indices.size() / 3;
+	}
+	double process_ms = ms_since(start);
+
+	start = std::chrono::steady_clock::now();
+	std::vector<std::byte> bytes = RawobjectWriter{ objects, config.format }.encode();
+	write_file(config.output, bytes);
+	double write_ms = ms_since(start);
+
+	std::cout << std::fixed << std::setprecision(1);
+	std::cout << "wrote " << config.output << ": " << objects.size() << " sub objects, " << triangles << " triangles, ";
+	if (config.meshlets)
+		std::cout << meshlet_count << " meshlets, ";
+	std::cout << bytes.size() << " bytes\n";
+	std::cout << "  import  " << import_ms << " ms (" << input_bytes / 1e3 / std::max(import_ms, 1e-3) << " MB/s, "
+		<< triangles / 1e3 / std::max(import_ms, 1e-3) << " M triangles/s)\n";
+	std::cout << "  process " << process_ms << " ms\n";
+	std::cout << "  write   " << write_ms << " ms" << std::endl;
+
+	if (config.verify) {
+		RawobjectReader reader{ config.output.c_str() };
+		compare_objects(objects, read_objects(reader), reader, config.max_vertices, config.max_triangles);
+		std::cout << "verified " << config.output << std::endl;
+	}
+}
+
+PackConfig parse_args(int argc, char* argv[]) {
+	PackConfig config;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto value = [&]() -> std::string {
+			if (i + 1 >= argc)
+				throw std::invalid_argument("Missing value for " + arg);
+			return argv[++i];
+		};
+
+		if (arg == "--output")
+			config.output = value();
+		else if (arg == "--quantise")
+			config.format.quantise = true;
+		else if (arg == "--interleave")
+			config.format.interleave = true;
+		else if (arg == "--optimise")
+			config.optimise = true;
+		else if (arg == "--meshlets")
+			config.meshlets = true;
+		else if (arg == "--max-vertices")
+			config.max_vertices = std::stoull(value());
+		else if (arg == "--max-triangles")
+			config.max_triangles = std::stoull(value());
+		else if (arg == "--verify")
+			config.verify = true;
+		else if (arg.rfind("--", 0) != 0)
+			config.inputs.push_back(arg);
+		else
+			throw std::invalid_argument("Unknown argument " + arg);
+	}
+	if (config.inputs.empty() || config.output.empty()) {
+		throw std::invalid_argument("Usage: jpraw_pack <input.obj|ply>... --output <file.jpraw> [--quantise] [--interleave] [--optimise] [--meshlets] [--max-vertices N] [--max-triangles N] [--verify]");
+	}
+	// Meshlet triangles index vertices with a byte
+	if (config.max_vertices < 3 || config.max_vertices > 255 || config.max_triangles < 1) {
+		throw std::invalid_argument("Meshlets need 3 to 255 vertices and at least 1 triangle");
+	}
+	return config;
+}
+
+int main(int argc, char* argv[]) {
+	try {
+		pack(parse_args(argc, argv));
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
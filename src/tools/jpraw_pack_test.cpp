@@ -0,0 +1,217 @@
+// Round trip test of jpraw_pack: generates small OBJ and PLY meshes, packs them in every format
+// (float or quantised, planar or interleaved, with or without meshlets), reads each file back with
+// RawobjectReader and compares it with the imported inputs.
+//
+//   jpraw_pack_test <path to jpraw_pack> <scratch directory>
+
+#include <glm/glm.hpp>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "mesh_import.hpp"
+#include "jpraw_io.hpp"
+
+/// A rows x columns quad grid wrapped onto a surface, one vertex per grid point, seams included
+struct GridMesh {
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> normals;
+	std::vector<glm::vec2> uvs;
+	// Quads, counter clockwise, as vertex indices
+	std::vector<std::array<uint32_t, 4>> quads;
+
+	template<typename Surface>
+	GridMesh(size_t rows, size_t columns, Surface surface) {
+		for (size_t r = 0; r <= rows; ++r) {
+			for (size_t c = 0; c <= columns; ++c) {
+				glm::vec2 uv{ (float)c / (float)columns, (float)r / (float)rows };
+				glm::vec3 normal;
+				positions.push_back(surface(uv, normal));
+				normals.push_back(normal);
+				uvs.push_back(uv);
+			}
+		}
+		for (size_t r = 0; r < rows; ++r) {
+			for (size_t c = 0; c < columns; ++c) {
+				uint32_t v = (uint32_t)(r * (columns + 1) + c);
+				quads.push_back({ v, v + 1, v + 1 + (uint32_t)(columns + 1), v + (uint32_t)(columns + 1) });
+			}
+		}
+	}
+};
+
+constexpr float PI = 3.14159265f;
+
+GridMesh sphere(size_t rows, size_t columns, float radius) {
+	return GridMesh{ rows, columns, [&](glm::vec2 uv, glm::vec3& normal) {
+		float theta = uv.y * PI, phi = uv.x * 2 * PI;
+		normal = glm::vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+		return normal * radius;
+	} };
+}
+
+GridMesh cylinder(size_t rows, size_t columns, float radius, float length) {
+	return GridMesh{ rows, columns, [&](glm::vec2 uv, glm::vec3& normal) {
+		float phi = uv.x * 2 * PI;
+		normal = glm::vec3(std::cos(phi), 0, std::sin(phi));
+		return glm::vec3(normal.x * radius, (uv.y - 0.5f) * length, normal.z * radius);
+	} };
+}
+
+GridMesh torus(size_t rows, size_t columns, float major, float minor) {
+	return GridMesh{ rows, columns, [&](glm::vec2 uv, glm::vec3& normal) {
+		float theta = uv.y * 2 * PI, phi = uv.x * 2 * PI;
+		normal = glm::vec3(std::cos(theta) * std::cos(phi), std::sin(theta), std::cos(theta) * std::sin(phi));
+		glm::vec3 center(major * std::cos(phi), 0, major * std::sin(phi));
+		return center + normal * minor;
+	} };
+}
+
+/// One `o` per mesh, faces as v/vt/vn quads so the importer also triangulates
+void write_obj(const std::filesystem::path& path, const std::vector<std::pair<std::string, GridMesh>>& meshes) {
+	std::ofstream out(path);
+	size_t first = 1;
+	for (const auto& [name, mesh] : meshes) {
+		out << "o " << name << "\n";
+		for (const glm::vec3& p : mesh.positions)
+			out << "v " << p.x << " " << p.y << " " << p.z << "\n";
+		for (const glm::vec2& uv : mesh.uvs)
+			out << "vt " << uv.x << " " << uv.y << "\n";
+		for (const glm::vec3& n : mesh.normals)
+			out << "vn " << n.x << " " << n.y << " " << n.z << "\n";
+		for (const auto& quad : mesh.quads) {
+			out << "f";
+			for (uint32_t v : quad)
+				out << " " << first + v << "/" << first + v << "/" << first + v;
+			out << "\n";
+		}
+		first += mesh.positions.size();
+	}
+	if (!out) {
+		throw std::runtime_error("Can't write " + path.string());
+	}
+}
+
+/// Binary little endian, float attributes and uchar/int face lists
+void write_ply(const std::filesystem::path& path, const GridMesh& mesh) {
+	std::ofstream out(path, std::ios::binary);
+	out << "ply\nformat binary_little_endian 1.0\n"
+		<< "element vertex " << mesh.positions.size() << "\n"
+		<< "property float x\nproperty float y\nproperty float z\n"
+		<< "property float nx\nproperty float ny\nproperty float nz\n"
+		<< "property float u\nproperty float v\n"
+		<< "element face " << mesh.quads.size() << "\n"
+		<< "property list uchar int vertex_indices\nend_header\n";
+	for (size_t v = 0; v < mesh.positions.size(); ++v) {
+		float values[8]{ mesh.positions[v].x, mesh.positions[v].y, mesh.positions[v].z,
+			mesh.normals[v].x, mesh.normals[v].y, mesh.normals[v].z, mesh.uvs[v].x, mesh.uvs[v].y };
+		out.write((const char*)values, sizeof(values));
+	}
+	for (const auto& quad : mesh.quads) {
+		uint8_t count = 4;
+		out.write((const char*)&count, 1);
+		for (uint32_t v : quad) {
+			int32_t index = (int32_t)v;
+			out.write((const char*)&index, sizeof(index));
+		}
+	}
+	if (!out) {
+		throw std::runtime_error("Can't write " + path.string());
+	}
+}
+
+struct Case {
+	bool quantise;
+	bool interleave;
+	bool meshlets;
+
+	std::string name() const {
+		return std::string(quantise ? "quantised" : "float") + (interleave ? " interleaved" : " planar") + (meshlets ? " meshlets" : "");
+	}
+};
+
+/// Packs inputs with jpraw_pack as c says, then checks the file against the imported inputs
+void run_case(const std::string& packer, const std::vector<std::filesystem::path>& inputs, const std::filesystem::path& output, const Case& c) {
+	std::string command = "\"" + packer + "\"";
+	for (const std::filesystem::path& input : inputs)
+		command += " \"" + input.string() + "\"";
+	command += " --output \"" + output.string() + "\"";
+	if (c.quantise)
+		command += " --quantise";
+	if (c.interleave)
+		command += " --interleave";
+	if (c.meshlets)
+		command += " --meshlets";
+#ifdef _WIN32
+	// cmd strips the outer quotes of a line that starts with one
+	command = "\"" + command + "\"";
+#endif
+	if (std::system(command.c_str()) != 0) {
+		throw std::runtime_error("jpraw_pack failed: " + command);
+	}
+
+	std::vector<MeshObject> expected;
+	for (const std::filesystem::path& input : inputs) {
+		for (MeshObject& object : import_mesh(input.string())) {
+			if (c.meshlets)
+				object.meshlets = build_meshlets(object.indices, object.positions, MAX_MESHLET_VERTICES, MAX_MESHLET_TRIANGLES);
+			expected.push_back(std::move(object));
+		}
+	}
+
+	RawobjectReader reader{ output.string().c_str() };
+	if (reader.header.quantised() != c.quantise || reader.header.interleaved() != c.interleave || reader.header.hasMeshlets() != c.meshlets) {
+		throw std::runtime_error("Header flags don't match the requested format");
+	}
+	if (!reader.header.hasNormal() || !reader.header.hasUV()) {
+		throw std::runtime_error("Normals or uvs were dropped");
+	}
+	std::vector<MeshObject> written = read_objects(reader);
+	compare_objects(expected, written, reader);
+	if (c.meshlets) {
+		for (const MeshObject& object : written) {
+			if (object.meshlets.empty())
+				throw std::runtime_error("A sub object has no meshlets");
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	if (argc != 3) {
+		std::cerr << "Usage: jpraw_pack_test <path to jpraw_pack> <scratch directory>" << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::string packer = argv[1];
+	std::filesystem::path directory = argv[2];
+	std::vector<std::filesystem::path> inputs{ directory / "meshes.obj", directory / "torus.ply" };
+	try {
+		std::filesystem::create_directories(directory);
+		// More vertices than one meshlet holds, so objects are split
+		write_obj(inputs[0], { { "ball", sphere(16, 24, 0.5f) }, { "pipe", cylinder(4, 16, 0.25f, 1.5f) } });
+		write_ply(inputs[1], torus(12, 20, 2.0f, 0.5f));
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	int failures = 0;
+	for (int bits = 0; bits < 8; ++bits) {
+		Case c{ (bits & 1) != 0, (bits & 2) != 0, (bits & 4) != 0 };
+		try {
+			run_case(packer, inputs, directory / ("case" + std::to_string(bits) + ".jpraw"), c);
+			std::cout << "ok   " << c.name() << std::endl;
+		}
+		catch (std::exception& e) {
+			std::cout << "FAIL " << c.name() << ": " << e.what() << std::endl;
+			++failures;
+		}
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,481 @@
+#pragma once
+// Wavefront OBJ and PLY (ascii and binary) readers producing MeshObjects for RawobjectWriter.
+// Only geometry is read: positions, normals, uvs and faces, which are triangulated as fans.
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "jpraw_io.hpp"
+
+/// Whitespace separated tokens of one line, without allocating
+class LineTokens {
+public:
+	LineTokens(std::string_view line) : rest{ line } {}
+
+	/// Next token, empty at the end of the line
+	std::string_view next() {
+		// find_first_of with a set is several times slower than this on large files
+		size_t start = 0;
+		while (start < rest.size() && is_space(rest[start]))
+			++start;
+		size_t end = start;
+		while (end < rest.size() && !is_space(rest[end]))
+			++end;
+		std::string_view token = rest.substr(start, end - start);
+		rest = rest.substr(end);
+		return token;
+	}
+
+private:
+	std::string_view rest;
+
+	static bool is_space(char c) {
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+};
+
+template<typename T>
+T parse_number(std::string_view token) {
+	T value{};
+	auto [end, error] = std::from_chars(token.data(), token.data() + token.size(), value);
+	if (error != std::errc{} || token.empty()) {
+		throw std::invalid_argument("Bad number '" + std::string(token) + "'");
+	}
+	return value;
+}
+
+/// Area weighted vertex normals, for files without their own
+inline void compute_normals(MeshObject& object) {
+	object.normals.assign(object.positions.size(), glm::vec3(0));
+	for (size_t t = 0; t + 2 < object.indices.size(); t += 3) {
+		uint32_t a = object.indices[t], b = object.indices[t + 1], c = object.indices[t + 2];
+		// Cross product length is twice the area
+		glm::vec3 n = glm::cross(object.positions[b] - object.positions[a], object.positions[c] - object.positions[a]);
+		object.normals[a] += n;
+		object.normals[b] += n;
+		object.normals[c] += n;
+	}
+	for (glm::vec3& n : object.normals) {
+		float length = glm::length(n);
+		n = length > 0 ? n / length : glm::vec3(0, 0, 1);
+	}
+}
+
+inline std::string read_text(std::istream& in) {
+	std::string text;
+	in.seekg(0, std::ios::end);
+	std::streamoff size = in.tellg();
+	in.seekg(0, std::ios::beg);
+	if (size > 0) {
+		text.resize((size_t)size);
+		in.read(text.data(), size);
+		text.resize((size_t)in.gcount());
+		return text;
+	}
+	// Not seekable
+	std::ostringstream buffer;
+	buffer << in.rdbuf();
+	return std::move(buffer).str();
+}
+
+/// One MeshObject per `o` statement, or a single one if there are none. Corners with the same
+/// position, uv and normal indices share a vertex. Objects whose faces all have normals keep
+/// them, others get compute_normals; uvs are kept only when every corner has one.
+inline std::vector<MeshObject> read_obj(std::istream& in) {
+	std::string text = read_text(in);
+	std::vector<glm::vec3> positions, normals;
+	std::vector<glm::vec2> uvs;
+	std::vector<MeshObject> objects;
+
+	struct Corner {
+		int64_t position, uv, normal;
+	};
+	// Corner of each vertex of the current object, and chains of the vertices sharing a
+	// position, which are nearly always short; cheaper than hashing every corner
+	std::vector<Corner> corners;
+	std::vector<uint32_t> first_with_position;
+	std::vector<uint32_t> next_with_position;
+	bool all_uvs = true, all_normals = true;
+	// Normals and uvs of the current object's vertices, decided once the object ends
+	std::vector<glm::vec3> object_normals;
+	std::vector<glm::vec2> object_uvs;
+	MeshObject object;
+
+	auto finish = [&] {
+		if (object.indices.empty())
+			return;
+		if (all_normals)
+			object.normals = std::move(object_normals);
+		else
+			compute_normals(object);
+		if (all_uvs)
+			object.uvs = std::move(object_uvs);
+		objects.push_back(std::move(object));
+		object = {};
+		object_normals.clear();
+		object_uvs.clear();
+		for (const Corner& corner : corners)
+			first_with_position[corner.position] = UINT32_MAX;
+		corners.clear();
+		next_with_position.clear();
+		all_uvs = all_normals = true;
+	};
+
+	// OBJ indices are 1 based, negative ones count back from the last element so far
+	auto resolve = [](std::string_view token, size_t count) -> int64_t {
+		int64_t index = parse_number<int64_t>(token);
+		int64_t resolved = index < 0 ? (int64_t)count + index : index - 1;
+		if (index == 0 || resolved < 0 || resolved >= (int64_t)count) {
+			throw std::invalid_argument("OBJ index " + std::string(token) + " out of range");
+		}
+		return resolved;
+	};
+
+	std::vector<uint32_t> polygon;
+	size_t line_start = 0;
+	while (line_start < text.size()) {
+		size_t line_end = text.find('\n', line_start);
+		if (line_end == std::string::npos)
+			line_end = text.size();
+		LineTokens tokens{ std::string_view(text).substr(line_start, line_end - line_start) };
+		line_start = line_end + 1;
+
+		std::string_view keyword = tokens.next();
+		if (keyword == "v") {
+			glm::vec3& p = positions.emplace_back();
+			for (int c = 0; c < 3; ++c)
+				p[c] = parse_number<float>(tokens.next());
+		}
+		else if (keyword == "vn") {
+			glm::vec3& n = normals.emplace_back();
+			for (int c = 0; c < 3; ++c)
+				n[c] = parse_number<float>(tokens.next());
+		}
+		else if (keyword == "vt") {
+			glm::vec2& uv = uvs.emplace_back();
+			uv.x = parse_number<float>(tokens.next());
+			std::string_view v = tokens.next();
+			uv.y = v.empty() ? 0 : parse_number<float>(v);
+		}
+		else if (keyword == "f") {
+			polygon.clear();
+			for (std::string_view token = tokens.next(); !token.empty(); token = tokens.next()) {
+				// v, v/vt, v//vn or v/vt/vn
+				Corner corner{ -1, -1, -1 };
+				size_t slash = token.find('/');
+				corner.position = resolve(token.substr(0, slash), positions.size());
+				if (slash != std::string_view::npos) {
+					std::string_view rest = token.substr(slash + 1);
+					size_t second = rest.find('/');
+					std::string_view uv = rest.substr(0, second);
+					if (!uv.empty())
+						corner.uv = resolve(uv, uvs.size());
+					if (second != std::string_view::npos)
+						corner.normal = resolve(rest.substr(second + 1), normals.size());
+				}
+				all_uvs &= corner.uv >= 0;
+				all_normals &= corner.normal >= 0;
+
+				if (first_with_position.size() < positions.size())
+					first_with_position.resize(positions.size(), UINT32_MAX);
+				uint32_t vertex = first_with_position[corner.position];
+				while (vertex != UINT32_MAX && (corners[vertex].uv != corner.uv || corners[vertex].normal != corner.normal))
+					vertex = next_with_position[vertex];
+				if (vertex == UINT32_MAX) {
+					vertex = (uint32_t)corners.size();
+					corners.push_back(corner);
+					next_with_position.push_back(first_with_position[corner.position]);
+					first_with_position[corner.position] = vertex;
+					object.positions.push_back(positions[corner.position]);
+					object_normals.push_back(corner.normal >= 0 ? normals[corner.normal] : glm::vec3(0));
+					object_uvs.push_back(corner.uv >= 0 ? uvs[corner.uv] : glm::vec2(0));
+				}
+				polygon.push_back(vertex);
+			}
+			if (polygon.size() < 3) {
+				throw std::invalid_argument("OBJ face with fewer than 3 vertices");
+			}
+			for (size_t k = 1; k + 1 < polygon.size(); ++k) {
+				object.indices.insert(object.indices.end(), { polygon[0], polygon[k], polygon[k + 1] });
+			}
+		}
+		else if (keyword == "o") {
+			finish();
+		}
+		// Groups, materials, smoothing groups, lines and comments carry no geometry we keep
+	}
+	finish();
+	return objects;
+}
+
+/// Reads a PLY file's vertex and face elements. Other elements are skipped.
+class PlyReader {
+public:
+	PlyReader(std::istream& in) : text{ read_text(in) } {
+		parse_header();
+	}
+
+	MeshObject read() {
+		MeshObject object;
+		bool has_normals = false, has_uvs = false;
+		for (Element& element : elements) {
+			if (element.name == "vertex") {
+				int position[3] = { find(element, "x"), find(element, "y"), find(element, "z") };
+				int normal[3] = { find(element, "nx"), find(element, "ny"), find(element, "nz") };
+				int uv[2] = { find(element, "u", "s", "texture_u", "texture_s"), find(element, "v", "t", "texture_v", "texture_t") };
+				if (position[0] < 0 || position[1] < 0 || position[2] < 0) {
+					throw std::invalid_argument("PLY vertices have no x, y and z");
+				}
+				has_normals = normal[0] >= 0 && normal[1] >= 0 && normal[2] >= 0;
+				has_uvs = uv[0] >= 0 && uv[1] >= 0;
+
+				std::vector<double> values(element.properties.size());
+				for (size_t v = 0; v < element.count; ++v) {
+					for (size_t p = 0; p < element.properties.size(); ++p) {
+						if (element.properties[p].list) {
+							skip_list(element.properties[p]);
+							continue;
+						}
+						values[p] = value(element.properties[p].type);
+					}
+					object.positions.emplace_back(values[position[0]], values[position[1]], values[position[2]]);
+					if (has_normals)
+						object.normals.emplace_back(values[normal[0]], values[normal[1]], values[normal[2]]);
+					if (has_uvs)
+						object.uvs.emplace_back(values[uv[0]], values[uv[1]]);
+				}
+			}
+			else if (element.name == "face") {
+				int indices = find(element, "vertex_indices", "vertex_index");
+				if (indices < 0 || !element.properties[indices].list) {
+					throw std::invalid_argument("PLY faces have no vertex_indices list");
+				}
+				std::vector<uint32_t> polygon;
+				for (size_t f = 0; f < element.count; ++f) {
+					for (size_t p = 0; p < element.properties.size(); ++p) {
+						const Property& property = element.properties[p];
+						if ((int)p != indices) {
+							if (property.list)
+								skip_list(property);
+							else
+								value(property.type);
+							continue;
+						}
+						polygon.resize((size_t)value(property.count_type));
+						for (uint32_t& index : polygon)
+							index = (uint32_t)value(property.type);
+					}
+					if (polygon.size() < 3) {
+						throw std::invalid_argument("PLY face with fewer than 3 vertices");
+					}
+					for (size_t k = 1; k + 1 < polygon.size(); ++k) {
+						object.indices.insert(object.indices.end(), { polygon[0], polygon[k], polygon[k + 1] });
+					}
+				}
+			}
+			else {
+				for (size_t i = 0; i < element.count; ++i) {
+					for (const Property& property : element.properties) {
+						if (property.list)
+							skip_list(property);
+						else
+							value(property.type);
+					}
+				}
+			}
+		}
+
+		for (uint32_t index : object.indices) {
+			if (index >= object.positions.size()) {
+				throw std::invalid_argument("PLY face index out of range");
+			}
+		}
+		if (!has_normals)
+			compute_normals(object);
+		return object;
+	}
+
+private:
+	enum class Format {
+		Ascii,
+		BinaryLittleEndian,
+		BinaryBigEndian,
+	};
+
+	enum class Type {
+		Int8, Uint8, Int16, Uint16, Int32, Uint32, Float32, Float64,
+	};
+
+	struct Property {
+		std::string name;
+		Type type;
+		bool list = false;
+		// Type of the element count of list properties
+		Type count_type = Type::Uint8;
+	};
+
+	struct Element {
+		std::string name;
+		size_t count;
+		std::vector<Property> properties;
+	};
+
+	std::string text;
+	Format format = Format::Ascii;
+	std::vector<Element> elements;
+	// Read position in text
+	size_t cursor = 0;
+
+	static Type parse_type(std::string_view name) {
+		if (name == "char" || name == "int8") return Type::Int8;
+		if (name == "uchar" || name == "uint8") return Type::Uint8;
+		if (name == "short" || name == "int16") return Type::Int16;
+		if (name == "ushort" || name == "uint16") return Type::Uint16;
+		if (name == "int" || name == "int32") return Type::Int32;
+		if (name == "uint" || name == "uint32") return Type::Uint32;
+		if (name == "float" || name == "float32") return Type::Float32;
+		if (name == "double" || name == "float64") return Type::Float64;
+		throw std::invalid_argument("Unknown PLY type " + std::string(name));
+	}
+
+	static size_t type_size(Type type) {
+		switch (type) {
+		case Type::Int8: case Type::Uint8: return 1;
+		case Type::Int16: case Type::Uint16: return 2;
+		case Type::Int32: case Type::Uint32: case Type::Float32: return 4;
+		default: return 8;
+		}
+	}
+
+	/// Index of the first property with one of names, -1 if none
+	template<typename... Names>
+	static int find(const Element& element, Names... names) {
+		for (size_t p = 0; p < element.properties.size(); ++p) {
+			if (((element.properties[p].name == names) || ...))
+				return (int)p;
+		}
+		return -1;
+	}
+
+	std::string_view next_line() {
+		size_t end = text.find('\n', cursor);
+		if (end == std::string::npos) {
+			throw std::invalid_argument("PLY header has no end_header");
+		}
+		std::string_view line = std::string_view(text).substr(cursor, end - cursor);
+		cursor = end + 1;
+		return line;
+	}
+
+	void parse_header() {
+		if (LineTokens{ next_line() }.next() != "ply") {
+			throw std::invalid_argument("File is not a PLY file");
+		}
+		for (;;) {
+			LineTokens tokens{ next_line() };
+			std::string_view keyword = tokens.next();
+			if (keyword == "end_header")
+				break;
+			if (keyword == "format") {
+				std::string_view name = tokens.next();
+				if (name == "ascii")
+					format = Format::Ascii;
+				else if (name == "binary_little_endian")
+					format = Format::BinaryLittleEndian;
+				else if (name == "binary_big_endian")
+					format = Format::BinaryBigEndian;
+				else
+					throw std::invalid_argument("Unknown PLY format " + std::string(name));
+			}
+			else if (keyword == "element") {
+				std::string name{ tokens.next() };
+				elements.push_back({ name, parse_number<size_t>(tokens.next()), {} });
+			}
+			else if (keyword == "property") {
+				if (elements.empty()) {
+					throw std::invalid_argument("PLY property before any element");
+				}
+				Property property;
+				std::string_view type = tokens.next();
+				if (type == "list") {
+					property.list = true;
+					property.count_type = parse_type(tokens.next());
+					type = tokens.next();
+				}
+				property.type = parse_type(type);
+				property.name = tokens.next();
+				elements.back().properties.push_back(property);
+			}
+			// comment and obj_info lines are ignored
+		}
+	}
+
+	double value(Type type) {
+		if (format == Format::Ascii) {
+			size_t start = text.find_first_not_of(" \t\r\n", cursor);
+			if (start == std::string::npos) {
+				throw std::invalid_argument("PLY file ends early");
+			}
+			size_t end = text.find_first_of(" \t\r\n", start);
+			if (end == std::string::npos)
+				end = text.size();
+			cursor = end;
+			return parse_number<double>(std::string_view(text).substr(start, end - start));
+		}
+
+		size_t size = type_size(type);
+		if (cursor + size > text.size()) {
+			throw std::invalid_argument("PLY file ends early");
+		}
+		unsigned char bytes[8];
+		memcpy(bytes, text.data() + cursor, size);
+		cursor += size;
+		if (format == Format::BinaryBigEndian)
+			std::reverse(bytes, bytes + size);
+		auto as = [&](auto v) {
+			memcpy(&v, bytes, sizeof(v));
+			return (double)v;
+		};
+		switch (type) {
+		case Type::Int8: return as(int8_t{});
+		case Type::Uint8: return as(uint8_t{});
+		case Type::Int16: return as(int16_t{});
+		case Type::Uint16: return as(uint16_t{});
+		case Type::Int32: return as(int32_t{});
+		case Type::Uint32: return as(uint32_t{});
+		case Type::Float32: return as(float{});
+		default: return as(double{});
+		}
+	}
+
+	void skip_list(const Property& property) {
+		size_t count = (size_t)value(property.count_type);
+		for (size_t i = 0; i < count; ++i)
+			value(property.type);
+	}
+};
+
+/// Sub objects of an .obj or .ply file, by extension
+inline std::vector<MeshObject> import_mesh(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file) {
+		throw std::runtime_error("Can't open " + path);
+	}
+	std::string extension = path.substr(path.find_last_of('.') + 1);
+	for (char& c : extension)
+		c = (char)tolower((unsigned char)c);
+	if (extension == "obj")
+		return read_obj(file);
+	if (extension == "ply")
+		return { PlyReader{ file }.read() };
+	throw std::invalid_argument(path + " is neither .obj nor .ply");
+}
@@ -0,0 +1,233 @@
+#pragma once
+// Index and vertex order optimisation of triangle lists, for meshes that are drawn instanced so
+// often that every post-transform cache miss is paid once per instance.
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <span>
+#include <vector>
+
+/// Post-transform cache behaviour of an index order, simulated as a FIFO like most hardware
+struct CacheStats {
+	size_t triangles = 0;
+	size_t vertices = 0;
+	size_t misses = 0;
+
+	/// Average cache miss ratio, transformed vertices per triangle. 0.5 at best for a large grid.
+	double acmr() const {
+		return triangles ? (double)misses / triangles : 0;
+	}
+	/// Average transformed to vertex ratio, 1 at best
+	double atvr() const {
+		return vertices ? (double)misses / vertices : 0;
+	}
+};
+
+inline CacheStats simulate_cache(std::span<const uint32_t> indices, size_t vertex_count, size_t cache_size) {
+	CacheStats stats{ indices.size() / 3, vertex_count, 0 };
+	// Time each vertex entered the cache, it's still in it for cache_size more misses
+	std::vector<size_t> entered(vertex_count, SIZE_MAX);
+	size_t time = 0;
+	for (uint32_t index : indices) {
+		if (entered[index] == SIZE_MAX || time - entered[index] >= cache_size) {
+			entered[index] = time++;
+			++stats.misses;
+		}
+	}
+	return stats;
+}
+
+/// Tom Forsyth's linear-speed vertex cache optimisation. Greedily emits the triangle with the
+/// best score, where vertices score by their position in a simulated LRU cache and by how few
+/// triangles still use them, so that lone vertices get finished off early.
+inline std::vector<uint32_t> optimize_vertex_cache(std::span<const uint32_t> indices, size_t vertex_count) {
+	constexpr size_t CACHE_SIZE = 32;
+	constexpr float CACHE_DECAY = 1.5f;
+	constexpr float LAST_TRIANGLE_SCORE = 0.75f;
+	constexpr float VALENCE_SCALE = 2.0f;
+	constexpr float VALENCE_POWER = 0.5f;
+
+	size_t triangle_count = indices.size() / 3;
+
+	// Triangles of each vertex, as ranges into adjacency
+	std::vector<uint32_t> first(vertex_count + 1, 0);
+	for (uint32_t index : indices)
+		++first[index + 1];
+	std::partial_sum(first.begin(), first.end(), first.begin());
+	std::vector<uint32_t> adjacency(indices.size());
+	std::vector<uint32_t> filled(first.begin(), first.end() - 1);
+	for (size_t i = 0; i < indices.size(); ++i)
+		adjacency[filled[indices[i]]++] = (uint32_t)(i / 3);
+
+	// Triangles not yet emitted per vertex, kept at the front of its adjacency range
+	std::vector<uint32_t> live(vertex_count);
+	for (size_t v = 0; v < vertex_count; ++v)
+		live[v] = first[v + 1] - first[v];
+	std::vector<int> cache_position(vertex_count, -1);
+
+	auto vertex_score = [&](uint32_t v) {
+		if (live[v] == 0)
+			return -1.0f;
+		float score = 0;
+		int position = cache_position[v];
+		if (position >= 0) {
+			if (position < 3)
+				score = LAST_TRIANGLE_SCORE;
+			else
+				score = std::pow(1.0f - (float)(position - 3) / (CACHE_SIZE - 3), CACHE_DECAY);
+		}
+		return score + VALENCE_SCALE * std::pow((float)live[v], -VALENCE_POWER);
+	};
+
+	std::vector<float> score(vertex_count);
+	for (size_t v = 0; v < vertex_count; ++v)
+		score[v] = vertex_score((uint32_t)v);
+	std::vector<float> triangle_score(triangle_count);
+	for (size_t t = 0; t < triangle_count; ++t)
+		triangle_score[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+
+	std::vector<bool> emitted(triangle_count, false);
+	std::vector<uint32_t> result;
+	result.reserve(indices.size());
+	std::vector<uint32_t> cache, next_cache;
+	cache.reserve(CACHE_SIZE + 3);
+	next_cache.reserve(CACHE_SIZE + 3);
+	// Scan position for the fallback when nothing in the cache has triangles left
+	size_t fallback = 0;
+
+	int64_t best = triangle_count ? 0 : -1;
+	while (best >= 0) {
+		emitted[best] = true;
+		const uint32_t* triangle = &indices[best * 3];
+		for (int k = 0; k < 3; ++k) {
+			uint32_t v = triangle[k];
+			result.push_back(v);
+			// Move the triangle out of the vertex's live range
+			uint32_t* begin = &adjacency[first[v]];
+			uint32_t* end = begin + live[v];
+			std::iter_swap(std::find(begin, end, (uint32_t)best), end - 1);
+			--live[v];
+		}
+
+		// New triangle's vertices go to the front, the rest keep their order
+		next_cache.assign(triangle, triangle + 3);
+		for (uint32_t v : cache) {
+			if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+				next_cache.push_back(v);
+		}
+		cache.swap(next_cache);
+
+		// Rescore everything whose cache position changed, and their triangles
+		for (size_t i = 0; i < cache.size(); ++i) {
+			uint32_t v = cache[i];
+			cache_position[v] = i < CACHE_SIZE ? (int)i : -1;
+			score[v] = vertex_score(v);
+		}
+		best = -1;
+		float best_score = -1;
+		for (uint32_t v : cache) {
+			for (uint32_t i = first[v]; i < first[v] + live[v]; ++i) {
+				uint32_t t = adjacency[i];
+				triangle_score[t] = score[indices[t * 3]] + score[indices[t * 3 + 1]] + score[indices[t * 3 + 2]];
+				if (triangle_score[t] > best_score) {
+					best_score = triangle_score[t];
+					best = t;
+				}
+			}
+		}
+		if (cache.size() > CACHE_SIZE)
+			cache.resize(CACHE_SIZE);
+
+		if (best < 0) {
+			while (fallback < triangle_count && emitted[fallback])
+				++fallback;
+			if (fallback < triangle_count)
+				best = (int64_t)fallback;
+		}
+	}
+	return result;
+}
+
+/// Orders clusters of the cache optimised indices so that triangles facing away from the mesh
+/// centre are drawn first, like Tipsify's overdraw pass. Clusters start wherever the simulated
+/// cache missed on every vertex, so their order barely changes the cache behaviour; the result is
+/// only kept when ACMR stays within threshold of the input.
+inline std::vector<uint32_t> optimize_overdraw(std::span<const uint32_t> indices, std::span<const glm::vec3> positions,
+	size_t cache_size, float threshold) {
+	size_t triangle_count = indices.size() / 3;
+	std::vector<size_t> cluster_start;
+	std::vector<size_t> entered(positions.size(), SIZE_MAX);
+	size_t time = 0;
+	for (size_t t = 0; t < triangle_count; ++t) {
+		int misses = 0;
+		for (int k = 0; k < 3; ++k) {
+			uint32_t v = indices[t * 3 + k];
+			if (entered[v] == SIZE_MAX || time - entered[v] >= cache_size) {
+				entered[v] = time++;
+				++misses;
+			}
+		}
+		if (t == 0 || misses == 3)
+			cluster_start.push_back(t);
+	}
+	cluster_start.push_back(triangle_count);
+
+	glm::vec3 centre(0);
+	for (const glm::vec3& p : positions)
+		centre += p;
+	centre /= (float)std::max<size_t>(1, positions.size());
+
+	struct Cluster {
+		size_t begin, end;
+		float sort_key;
+	};
+	std::vector<Cluster> clusters;
+	for (size_t c = 0; c + 1 < cluster_start.size(); ++c) {
+		glm::vec3 area_normal(0), centroid(0);
+		float area = 0;
+		for (size_t t = cluster_start[c]; t < cluster_start[c + 1]; ++t) {
+			glm::vec3 a = positions[indices[t * 3]], b = positions[indices[t * 3 + 1]], d = positions[indices[t * 3 + 2]];
+			glm::vec3 n = glm::cross(b - a, d - a);
+			float triangle_area = glm::length(n);
+			area_normal += n;
+			centroid += (a + b + d) * (triangle_area / 3);
+			area += triangle_area;
+		}
+		float length = glm::length(area_normal);
+		float key = 0;
+		if (area > 0 && length > 0)
+			key = glm::dot(centroid / area - centre, area_normal / length);
+		clusters.push_back({ cluster_start[c], cluster_start[c + 1], key });
+	}
+	std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) {
+		return a.sort_key > b.sort_key;
+	});
+
+	std::vector<uint32_t> result;
+	result.reserve(indices.size());
+	for (const Cluster& cluster : clusters)
+		result.insert(result.end(), indices.begin() + cluster.begin * 3, indices.begin() + cluster.end * 3);
+
+	if (simulate_cache(result, positions.size(), cache_size).acmr() > simulate_cache(indices, positions.size(), cache_size).acmr() * threshold)
+		return { indices.begin(), indices.end() };
+	return result;
+}
+
+/// New position of each vertex so that vertices are stored in the order the indices first use
+/// them, unused vertices last. Remaps indices in place.
+inline std::vector<uint32_t> optimize_vertex_fetch(std::span<uint32_t> indices, size_t vertex_count) {
+	std::vector<uint32_t> remap(vertex_count, UINT32_MAX);
+	uint32_t next = 0;
+	for (uint32_t& index : indices) {
+		if (remap[index] == UINT32_MAX)
+			remap[index] = next++;
+		index = remap[index];
+	}
+	for (uint32_t& position : remap) {
+		if (position == UINT32_MAX)
+			position = next++;
+	}
+	return remap;
+}
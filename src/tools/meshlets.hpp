@@ -0,0 +1,115 @@
+#pragma once
+// Splits triangle lists into meshlets with bounding spheres and normal cones, for the meshlet
+// sections of .jpraw files.
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "../pyo_rawobj.hpp"
+
+/// Meshlets of one sub object. Vertex entries index the sub object's vertices and record offsets
+/// point into these lists; RawobjectWriter rebases both for the file.
+struct Meshlets {
+	std::vector<MeshletRecord> records;
+	std::vector<uint32_t> vertices;
+	std::vector<uint8_t> triangles;
+
+	bool empty() const {
+		return records.empty();
+	}
+};
+
+/// Bounding sphere around the box of the meshlet's vertices, and the cone that holds every
+/// triangle normal
+inline void meshlet_bounds(MeshletRecord& meshlet, const Meshlets& meshlets, std::span<const glm::vec3> positions) {
+	auto vertex = [&](size_t local) {
+		return positions[meshlets.vertices[meshlet.vertex_offset + local]];
+	};
+	glm::vec3 low = vertex(0), high = vertex(0);
+	for (size_t v = 1; v < meshlet.vertex_count; ++v) {
+		low = glm::min(low, vertex(v));
+		high = glm::max(high, vertex(v));
+	}
+	glm::vec3 center = (low + high) * 0.5f;
+	float radius = 0;
+	for (size_t v = 0; v < meshlet.vertex_count; ++v)
+		radius = std::max(radius, glm::length(vertex(v) - center));
+
+	std::vector<glm::vec3> normals;
+	glm::vec3 axis(0);
+	for (size_t t = 0; t < meshlet.triangle_count; ++t) {
+		const uint8_t* triangle = &meshlets.triangles[(meshlet.triangle_offset + t) * 3];
+		glm::vec3 a = vertex(triangle[0]), b = vertex(triangle[1]), c = vertex(triangle[2]);
+		glm::vec3 n = glm::cross(b - a, c - a);
+		float length = glm::length(n);
+		// Degenerate triangles face nowhere and are never seen
+		if (length > 0) {
+			normals.push_back(n / length);
+			axis += normals.back();
+		}
+	}
+	float axis_length = glm::length(axis);
+	float min_dot = -1;
+	if (axis_length > 0) {
+		axis /= axis_length;
+		min_dot = 1;
+		for (const glm::vec3& n : normals)
+			min_dot = std::min(min_dot, glm::dot(axis, n));
+	}
+
+	for (int c = 0; c < 3; ++c) {
+		meshlet.center[c] = center[c];
+		meshlet.cone_axis[c] = axis[c];
+	}
+	meshlet.radius = radius;
+	// A cone wider than about 84 degrees from the axis culls too rarely to be worth testing
+	meshlet.cone_cutoff = min_dot <= 0.1f ? 1.0f : std::sqrt(1 - min_dot * min_dot);
+}
+
+/// Cuts indices into meshlets in order, starting a new one whenever the next triangle would
+/// exceed either limit. Run the vertex cache optimisation first, it keeps neighbouring triangles
+/// together, which is what makes meshlets small and their cones narrow.
+inline Meshlets build_meshlets(std::span<const uint32_t> indices, std::span<const glm::vec3> positions,
+	size_t max_vertices = MAX_MESHLET_VERTICES, size_t max_triangles = MAX_MESHLET_TRIANGLES) {
+	Meshlets result;
+	// Local index of each vertex in the open meshlet, or 0xff
+	std::vector<uint8_t> local(positions.size(), 0xff);
+	MeshletRecord open{};
+
+	auto close = [&] {
+		if (open.triangle_count == 0)
+			return;
+		for (size_t v = 0; v < open.vertex_count; ++v)
+			local[result.vertices[open.vertex_offset + v]] = 0xff;
+		meshlet_bounds(open, result, positions);
+		result.records.push_back(open);
+		open = {};
+		open.vertex_offset = (uint32_t)result.vertices.size();
+		open.triangle_offset = (uint32_t)(result.triangles.size() / 3);
+	};
+
+	for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+		size_t added = 0;
+		for (int k = 0; k < 3; ++k) {
+			added += local[indices[t + k]] == 0xff;
+		}
+		// Repeated vertices within the triangle are counted twice, which only closes a meshlet early
+		if (open.vertex_count + added > max_vertices || open.triangle_count + 1 > max_triangles)
+			close();
+
+		for (int k = 0; k < 3; ++k) {
+			uint32_t v = indices[t + k];
+			if (local[v] == 0xff) {
+				local[v] = (uint8_t)open.vertex_count++;
+				result.vertices.push_back(v);
+			}
+			result.triangles.push_back(local[v]);
+		}
+		++open.triangle_count;
+	}
+	close();
+	return result;
+}
@@ -0,0 +1,122 @@
+#pragma once
+// Model matrices of straight pipe segments. A segment is a translation of one of three fixed
+// rotation+scale bases, so the bases are built once and batches are written as four column
+// stores per instance.
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#include "world.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GL_PIPES_SSE 1
+#include <immintrin.h>
+#endif
+
+struct SegmentInstance {
+	glm::vec3 cell;
+	Direction dir;
+};
+
+enum class SegmentAxis : uint8_t {
+	// Up / Down, the mesh's own orientation
+	Y,
+	// North / South
+	Z,
+	// East / West
+	X,
+	COUNT
+};
+
+inline SegmentAxis segment_axis(Direction dir) {
+	switch (dir) {
+	case Direction::North:
+	case Direction::South:
+		return SegmentAxis::Z;
+	case Direction::East:
+	case Direction::West:
+		return SegmentAxis::X;
+	case Direction::Up:
+	case Direction::Down:
+		return SegmentAxis::Y;
+	default:
+		unreachable();
+	}
+}
+
+/// Reference per instance path: translate, rotate the Y aligned mesh onto the axis, then stretch
+/// it along its length. Kept for the microbenchmark and to build the bases below, so the batched
+/// writer produces bit identical matrices.
+inline glm::mat4 segment_transform_glm(glm::vec3 center, Direction dir) {
+	glm::mat4 M = glm::translate(glm::identity<glm::mat4>(), center);
+
+	switch (dir) {
+	case Direction::North:
+	case Direction::South:
+		M = glm::rotate(M, glm::radians<float>(90), glm::vec3{ 1, 0, 0 });
+		break;
+	case Direction::East:
+	case Direction::West:
+		M = glm::rotate(M, glm::radians<float>(90), glm::vec3{ 0, 0, 1 });
+		break;
+	case Direction::Up:
+	case Direction::Down:
+		break;
+
+	default:
+		unreachable();
+	}
+	return glm::scale(M, glm::vec3{ 1, 6.6667f, 1 });
+}
+
+/// Rotation+scale of each axis, translation zero
+inline const glm::mat4* segment_bases() {
+	static const glm::mat4 bases[(size_t)SegmentAxis::COUNT]{
+		segment_transform_glm(glm::vec3(0), Direction::Up),
+		segment_transform_glm(glm::vec3(0), Direction::North),
+		segment_transform_glm(glm::vec3(0), Direction::East),
+	};
+	return bases;
+}
+
+inline glm::mat4 segment_transform(glm::vec3 center, Direction dir) {
+	glm::mat4 M = segment_bases()[(size_t)segment_axis(dir)];
+	M[3] = glm::vec4(center, 1);
+	return M;
+}
+
+/// Writes the model matrix of every segment to out[0, segments.size()). With SSE and a 16 byte
+/// aligned out the columns go out as non-temporal stores, meant for write combined mapped GL
+/// buffers that are never read back; the stores are fenced before returning.
+inline void write_segment_transforms(std::span<const SegmentInstance> segments, glm::mat4* out) {
+	const glm::mat4* bases = segment_bases();
+#ifdef GL_PIPES_SSE
+	if (((uintptr_t)out & 15) == 0) {
+		__m128 columns[(size_t)SegmentAxis::COUNT][3];
+		for (size_t axis = 0; axis < (size_t)SegmentAxis::COUNT; ++axis) {
+			for (int c = 0; c < 3; ++c) {
+				columns[axis][c] = _mm_loadu_ps(&bases[axis][c][0]);
+			}
+		}
+
+		float* dst = &out[0][0][0];
+		for (const SegmentInstance& segment : segments) {
+			const __m128* basis = columns[(size_t)segment_axis(segment.dir)];
+			_mm_stream_ps(dst + 0, basis[0]);
+			_mm_stream_ps(dst + 4, basis[1]);
+			_mm_stream_ps(dst + 8, basis[2]);
+			_mm_stream_ps(dst + 12, _mm_setr_ps(segment.cell.x, segment.cell.y, segment.cell.z, 1.0f));
+			dst += 16;
+		}
+		_mm_sfence();
+		return;
+	}
+#endif
+	for (const SegmentInstance& segment : segments) {
+		glm::mat4 M = bases[(size_t)segment_axis(segment.dir)];
+		M[3] = glm::vec4(segment.cell, 1);
+		std::memcpy(out++, &M, sizeof(glm::mat4));
+	}
+}
@@ -1,3 +1,4 @@
+#pragma once
 // Include GLM
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -5,6 +6,12 @@
 #include <algorithm>
 #include <optional>
 #include  <numeric>
+#include <bit>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "pyoUtils.hpp"
 
 #ifndef unreachable
 #ifdef __GNUC__ // GCC, Clang, ICC
@@ -21,7 +28,7 @@
 #endif
 #endif
 #endif
-enum class Direction {
+enum class Direction : uint8_t {
     North,
     South,
     East,
@@ -36,47 +43,109 @@ enum class PipeUpdataType {
     FIRST_PIPE,
     NEW
 };
+/// Narrowest unsigned integer that holds every value below count
+template<size_t count>
+using index_for = typename min_int<std::max<size_t>(1, std::bit_width(count - 1))>::type;
+
+/// Size of the pipe volume and the most pipes it holds, fixed at compile time so nodes, cell ids
+/// and pipe ids are stored in the narrowest integers that fit: a 20^3 volume keeps a node in 3
+/// bytes, a 256^3 one in 3 bytes too (3 x 8 bit), where a glm::uvec3 takes 12.
+template<uint32_t X, uint32_t Y, uint32_t Z, size_t MaxPipes>
+struct GridBounds {
+    static constexpr uint32_t x = X;
+    static constexpr uint32_t y = Y;
+    static constexpr uint32_t z = Z;
+    static constexpr size_t cells = (size_t)X * Y * Z;
+    static constexpr size_t max_pipes = MaxPipes;
+
+    // One coordinate, a cell id in [0, cells) and a pipe id
+    using axis_t = index_for<std::max({ X, Y, Z })>;
+    using cell_t = index_for<cells>;
+    using pipe_id_t = index_for<MaxPipes>;
+
+    /// Cell coordinate packed per axis
+    struct Coord {
+        axis_t x, y, z;
+
+        Coord() = default;
+        // Only for coordinates inside the bounds, the rest don't fit
+        explicit Coord(glm::uvec3 v) : x{ (axis_t)v.x }, y{ (axis_t)v.y }, z{ (axis_t)v.z } {}
+
+        operator glm::uvec3() const {
+            return { x, y, z };
+        }
+
+        bool operator==(const Coord&) const = default;
+    };
+
+    static glm::uvec3 size() {
+        return { X, Y, Z };
+    }
+
+    static cell_t cell(Coord c) {
+        return (cell_t)(((size_t)c.z * Y + c.y) * X + c.x);
+    }
+
+    static Coord coord(size_t cell) {
+        return Coord{ glm::uvec3(cell % X, cell / X % Y, cell / ((size_t)X * Y)) };
+    }
+};
+
+template<typename Bounds>
 struct PipeStraightData {
-    glm::uvec3 last_node;
-    glm::uvec3 current_node;
+    typename Bounds::Coord last_node;
+    typename Bounds::Coord current_node;
 
     Direction current_dir;
 
-    size_t pipe_id;
+    typename Bounds::pipe_id_t pipe_id;
 };
+template<typename Bounds>
 struct PipeBendData {
-    glm::uvec3 last_node;
-    glm::uvec3 current_node;
+    typename Bounds::Coord last_node;
+    typename Bounds::Coord current_node;
 
     Direction last_dir;
     Direction current_dir;
 
-    size_t pipe_id;
+    typename Bounds::pipe_id_t pipe_id;
 };
 
 
+template<typename Bounds>
 struct NewPipeData {
-    glm::uvec3 start_node;
-    size_t pipe_id;
+    typename Bounds::Coord start_node;
+    typename Bounds::pipe_id_t pipe_id;
 };
+/// Result of one World::pipe_update or new_pipe. With packed nodes a bend is 9 bytes in a 20^3
+/// volume instead of 40.
+template<typename Bounds>
 struct PipeUpdateData {
     PipeUpdataType type;
     union {
-        PipeStraightData pipeStraightData;
-        PipeBendData pipeBendData;
-        NewPipeData newPipeData;
+        PipeStraightData<Bounds> pipeStraightData;
+        PipeBendData<Bounds> pipeBendData;
+        NewPipeData<Bounds> newPipeData;
     } data;
 };
 
 
+template<typename Bounds>
 struct Ocupied {
+    using Coord = typename Bounds::Coord;
+    static constexpr int x = Bounds::x;
+    static constexpr int y = Bounds::y;
+    static constexpr int z = Bounds::z;
 
-    int x, y, z;
     std::vector<bool> ocupied_nodes;
     std::vector<uint64_t> free_map0;
     size_t used = 0;
 
-    Ocupied(int x, int y, int z) : x{ x }, y{ y }, z{ z }, ocupied_nodes(x* y* z, false), free_map0( ( 63 + x * y * z) / 64, UINT64_MAX) {
+    Ocupied() : ocupied_nodes(Bounds::cells, false), free_map0((63 + Bounds::cells) / 64, UINT64_MAX) {
+        mask_leftover();
+    }
+
+    void mask_leftover() {
         size_t leftover = (free_map0.size() * 64) - ocupied_nodes.size();
         if (leftover) {
             // mask out upper leftover bits of free_map0[-1]
@@ -84,24 +153,26 @@ struct Ocupied {
             uint8_t keep_bits = (64 - leftover);
             last &= ((UINT64_C(1) << keep_bits) - 1);
         }
-    
+    }
+
+    /// Frees every node without reallocating
+    void clear() {
+        std::fill(ocupied_nodes.begin(), ocupied_nodes.end(), false);
+        std::fill(free_map0.begin(), free_map0.end(), UINT64_MAX);
+        mask_leftover();
+        used = 0;
     }
 
     bool operator[](size_t i) {
         return ocupied_nodes[i];
     }
-    glm::u64vec3 iTovec(size_t i) {
-        size_t z_c = i / x * y;
-        i %= x * y;
-        size_t y_c = i / x;
-        i %= x;
-        size_t x_c = i;
-        return { x_c, y_c, z_c };
+    Coord iTovec(size_t i) {
+        return Bounds::coord(i);
     }
-    size_t vecToi(glm::u64vec3 vec) {
-        return vec.z * (x * y) + vec.y * x + vec.x;
+    size_t vecToi(Coord vec) {
+        return Bounds::cell(vec);
     }
-    bool operator[](glm::u64vec3 i) {
+    bool operator[](Coord i) {
         return ocupied_nodes[vecToi(i)];
     }
 
@@ -112,27 +183,27 @@ struct Ocupied {
         used += 1;
     }
 
-    void set(glm::u64vec3 i) {
+    void set(Coord i) {
         set(vecToi(i));
     }
 
 
-    std::optional<glm::u64vec3> getRandomFree(auto& rng) {
+    std::optional<Coord> getRandomFree(auto& rng) {
         std::vector<size_t> choices(free_map0.size());
         std::iota(choices.begin(), choices.end(), 0);
         std::shuffle(choices.begin(), choices.end(), rng);
         
-        for (size_t i = 0; i < choices.size(); ++i) {
-            if (choices[i] == 0)
+        for (size_t word : choices) {
+            uint64_t free = free_map0[word];
+            if (!free)
                 continue;
-            uint64_t choice = choices[i];
             uint8_t bitChoice[64];
             std::iota(bitChoice, bitChoice + 64, 0);
             std::shuffle(bitChoice, bitChoice + 64, rng);
 
-            for (uint8_t j = 0; j < 64; ++j) {
-                if (choice & (UINT64_C(1) << (bitChoice[j]))) {
-                    size_t index = i * 64 + j;
+            for (uint8_t bit : bitChoice) {
+                if (free & (UINT64_C(1) << bit)) {
+                    size_t index = word * 64 + bit;
                     set(index);
                     return iTovec(index);
                 }
@@ -147,7 +218,8 @@ struct Ocupied {
 };
 /// Returns a random coordinate that is not occupied by any other pipe (including the pipe itself if
 /// somehow the pipe is already on the board)
-glm::u64vec3 get_random_start(Ocupied& occupied_nodes, auto& rng) {
+template<typename Bounds>
+typename Bounds::Coord get_random_start(Ocupied<Bounds>& occupied_nodes, auto& rng) {
     //Double check if somehow there is no more space on the board
     auto coord = occupied_nodes.getRandomFree(rng);
     if (!coord) {
@@ -194,30 +266,42 @@ bool is_in_bounds(glm::uvec3 coord, glm::uvec3 bounds) {
     return coord.x < bounds.x && coord.y < bounds.y && coord.z < bounds.z;
 }
 
+template<typename Bounds>
 struct Pipe {
-    bool alive;
-    glm::uvec3 space_bounds;
+    using Coord = typename Bounds::Coord;
 
-    std::vector<glm::uvec3> nodes;
-    Direction current_dir;
+    bool alive = true;
+
+    std::vector<Coord> nodes;
+    Direction current_dir = Direction::Up;
 
     size_t len() {
         return nodes.size();
     }
 
-    Pipe(glm::uvec3 space_bounds, Ocupied& ocupied_nodes, auto& rng) : space_bounds{ space_bounds } {
+    Pipe(Ocupied<Bounds>& ocupied_nodes, auto& rng) {
+        nodes.emplace_back(get_random_start(ocupied_nodes, rng));
+    }
+
+    /// Starts over as a new pipe, keeping the capacity of nodes
+    void reset(Ocupied<Bounds>& ocupied_nodes, auto& rng) {
+        alive = true;
+        current_dir = Direction::Up;
+        nodes.clear();
         nodes.emplace_back(get_random_start(ocupied_nodes, rng));
     }
 
     Direction get_current_dir() {
         return current_dir;
     }
-    glm::uvec3 get_current_head() {
+    Coord get_current_head() {
         return nodes.back();
     }
 
-    void kill(){}
-    void update(Ocupied& ocupied_nodes, auto& rng) {
+    void kill(){
+        alive = false;
+    }
+    void update(Ocupied<Bounds>& ocupied_nodes, auto& rng) {
         if(!alive)
             return;
         
@@ -237,11 +321,12 @@ struct Pipe {
         bool found_valid_direction = false;
         glm::uvec3 new_position{ 0, 0, 0 };
         for(auto dir : directions_to_try){
+            // Stepped in 32 bits, so stepping off the low edge wraps to far out of bounds
             new_position = step_in_dir(nodes.back(), (Direction)dir);
-            if(!is_in_bounds(new_position, space_bounds)){
+            if(!is_in_bounds(new_position, Bounds::size())){
                 continue;
             }
-            if(ocupied_nodes[new_position]) {
+            if(ocupied_nodes[Coord{ new_position }]) {
                 continue;
             }
             found_valid_direction = true;
@@ -253,7 +338,7 @@ struct Pipe {
             return;
         }
 
-        ocupied_nodes.set(new_position);
+        ocupied_nodes.set(Coord{ new_position });
 
         nodes.emplace_back(new_position);
         
@@ -263,27 +348,52 @@ struct Pipe {
 
 
 
+template<typename Bounds>
 struct World {
+    using Coord = typename Bounds::Coord;
+    using UpdateData = PipeUpdateData<Bounds>;
+
     std::default_random_engine rng;
     std::uniform_int_distribution<> directions{ 0, 5 };
     std::uniform_int_distribution<> xdir;
     std::uniform_int_distribution<> ydir;
     std::uniform_int_distribution<> zdir;
     glm::uvec3 bounds;
-    Ocupied ocupied_nodes;
+    Ocupied<Bounds> ocupied_nodes;
     double new_pipe_chance = .1L;
     int active_pipes = 0;
     bool gen_complete;
     std::vector<glm::vec3> colors;
-    std::vector<Pipe> pipes;
-    uint8_t max_pipes;
-    World(int x_max, int y_max, int z_max, uint8_t max_pipes) :rng(std::random_device{}()), xdir(0, x_max), ydir(0, y_max), zdir(0, z_max), ocupied_nodes{ x_max, y_max, z_max }, max_pipes{ max_pipes }, bounds{ x_max, y_max, z_max } {
+    std::vector<Pipe<Bounds>> pipes;
+    // Pipes of previous generations, reused by new_pipe so their nodes aren't reallocated
+    std::vector<Pipe<Bounds>> spare_pipes;
+    static constexpr size_t max_pipes = Bounds::max_pipes;
+    World(unsigned seed = std::random_device{}()) :rng(seed), xdir(0, Bounds::x), ydir(0, Bounds::y), zdir(0, Bounds::z), bounds{ Bounds::size() } {
+        colors.resize(max_pipes);
+        pipes.reserve(max_pipes);
+        spare_pipes.reserve(max_pipes);
+        pick_colors();
+    }
+
+    void pick_colors() {
         std::uniform_real_distribution<float> color_rng{ 0., 1. };
-        for (int i = 0; i < max_pipes; ++i) {
-            colors.emplace_back(color_rng(rng), color_rng(rng) ,color_rng(rng));
+        for (glm::vec3& color : colors) {
+            color = { color_rng(rng), color_rng(rng) ,color_rng(rng) };
         }
     }
 
+    /// Starts a new generation in the same space. Nothing is reallocated, pipes are kept aside
+    /// for new_pipe to reuse. The rng carries on, so generations stay deterministic for a seed.
+    void reset() {
+        ocupied_nodes.clear();
+        for (Pipe<Bounds>& pipe : pipes) {
+            spare_pipes.push_back(std::move(pipe));
+        }
+        pipes.clear();
+        active_pipes = 0;
+        pick_colors();
+    }
+
     size_t pipe_count() {
         return pipes.size();
     }
@@ -295,32 +405,56 @@ struct World {
         double flip = std::uniform_real_distribution<double>(0., 1.)(rng);
         return odds < flip;
     }
-    void new_pipe(PipeUpdateData& data) {
-        Pipe& pipe = pipes.emplace_back(bounds, ocupied_nodes, rng);
-        //pipe.current_dir;
-        size_t pipe_id = pipes.size() - 1;
+    /// Adds a pipe. Pipe ids, and colors, only go up to max_pipes.
+    void new_pipe(UpdateData& data) {
+        if (pipes.size() == max_pipes) {
+            throw std::runtime_error("The world already has max_pipes pipes");
+        }
+        if (spare_pipes.empty()) {
+            pipes.emplace_back(ocupied_nodes, rng);
+        }
+        else {
+            pipes.push_back(std::move(spare_pipes.back()));
+            spare_pipes.pop_back();
+            pipes.back().reset(ocupied_nodes, rng);
+        }
+        started(data, pipes.size() - 1);
+    }
+    /// Starts a dead pipe over from a random free cell, under the same id
+    void respawn_pipe(UpdateData& data, size_t pipe_id) {
+        pipes[pipe_id].reset(ocupied_nodes, rng);
+        started(data, pipe_id);
+    }
+    void started(UpdateData& data, size_t pipe_id) {
         active_pipes += 1;
-
         data.type = PipeUpdataType::NEW;
-        data.data.newPipeData = { .start_node = pipe.get_current_head(), .pipe_id = pipe_id
-        };
-
+        data.data.newPipeData = { .start_node = pipes[pipe_id].get_current_head(), .pipe_id = (typename Bounds::pipe_id_t)pipe_id };
     }
     bool is_gen_complete() {
         return active_pipes == 0;
     }
-    void pipe_update(PipeUpdateData& data, size_t pipe_id) {
+    void pipe_update(UpdateData& data, size_t pipe_id) {
         size_t color_id = pipe_id;
-        glm::uvec3 last_node = pipes[pipe_id].get_current_head();
+        Coord last_node = pipes[pipe_id].get_current_head();
         Direction last_dir = pipes[pipe_id].get_current_dir();
+        size_t last_len = pipes[pipe_id].len();
         pipes[pipe_id].update(ocupied_nodes, rng);
 
-        glm::uvec3 current_node = pipes[pipe_id].get_current_head();
+        // Boxed in, the pipe died without growing
+        if (pipes[pipe_id].len() == last_len) {
+            if (!pipes[pipe_id].alive) {
+                active_pipes -= 1;
+            }
+            data.type = PipeUpdataType::NOP;
+            return;
+        }
+
+        Coord current_node = pipes[pipe_id].get_current_head();
         Direction current_dir = pipes[pipe_id].get_current_dir();
         bool first_pipe = pipes[pipe_id].nodes.size() == 1;
         //Add a random chance post update to kill the pipe
         //increases the more the space is filled
-        size_t total_nodes = ocupied_nodes.x * ocupied_nodes.y * ocupied_nodes.z;
+        size_t total_nodes = Bounds::cells;
         double chance_to_kill = ((double)(ocupied_nodes.used)) / ((double)(total_nodes));
 
         if (pipes[pipe_id].len() >= (total_nodes * 10 / 100) && chance(chance_to_kill))
@@ -331,11 +465,11 @@ struct World {
 
         if (first_pipe || current_dir == last_dir) {
             data.type = PipeUpdataType::PIPE_STRAIGHT;
-            data.data.pipeStraightData = { .last_node = last_node, .current_node = current_node, .current_dir = current_dir, .pipe_id = pipe_id };
+            data.data.pipeStraightData = { .last_node = last_node, .current_node = current_node, .current_dir = current_dir, .pipe_id = (typename Bounds::pipe_id_t)pipe_id };
         }
         else {
             data.type = PipeUpdataType::PIPE_BEND;
-            data.data.pipeBendData = { .last_node = last_node, .current_node = current_node, .last_dir = last_dir, .current_dir = current_dir, .pipe_id = pipe_id };
+            data.data.pipeBendData = { .last_node = last_node, .current_node = current_node, .last_dir = last_dir, .current_dir = current_dir, .pipe_id = (typename Bounds::pipe_id_t)pipe_id };
         }
         
     